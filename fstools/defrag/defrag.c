@@ -0,0 +1,183 @@
+/* defrag - offline defragmenter, running the kernel's fs.c on an image file.
+ *
+ * Compacts every directory, and moves every fragmented file to as few runs of
+ * contiguous blocks as possible. The fragmentation score of each fragmented
+ * file, and of the whole volume, is reported before and after.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#undef NAME_MAX
+#undef PATH_MAX
+#include "fs.h"
+#include "bdev.h"
+
+int parse_args(int argc, char **argv);
+void report(int ino, struct frag_info *before, struct frag_info *after);
+
+int fd = -1;
+uint32_t num_blocks;
+const char *img_fname;
+int report_only;
+int verbose;
+
+int main(int argc, char **argv)
+{
+	struct filesys fs;
+	struct frag_info before, after;
+	int res;
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+
+	if((fd = open(img_fname, report_only ? O_RDONLY : O_RDWR)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", img_fname, strerror(errno));
+		return 1;
+	}
+	if(!(num_blocks = lseek(fd, 0, SEEK_END) / BLKSZ)) {
+		fprintf(stderr, "%s: can't determine the size (only image files are supported)\n", img_fname);
+		return 1;
+	}
+
+	if((res = openfs(&fs, 0)) != 0) {
+		fprintf(stderr, "failed to open the filesystem: %s\n", strerror(-res));
+		return 1;
+	}
+
+	if((res = defrag_fs(&fs, report_only ? DEFRAG_REPORT_ONLY : 0, &before, &after, report)) != 0) {
+		fprintf(stderr, "defragmentation failed: %s\n", strerror(-res));
+	}
+
+	printf("volume: %u files, %u blocks, %u extents, score %d%%", before.nfiles,
+			before.nblocks, before.nextents, frag_score(&before));
+	if(!report_only) {
+		printf(" -> %u blocks, %u extents, score %d%%", after.nblocks, after.nextents,
+				frag_score(&after));
+	}
+	putchar('\n');
+
+	if(!report_only) {
+		closefs(&fs);
+	}
+	close(fd);
+	return res ? 1 : 0;
+}
+
+void report(int ino, struct frag_info *before, struct frag_info *after)
+{
+	if(!verbose && before->nextents <= 1) {
+		return;
+	}
+
+	printf("inode %d: %u blocks, %u extents, score %d%%", ino, before->nblocks,
+			before->nextents, frag_score(before));
+	if(!report_only) {
+		printf(" -> %u blocks, %u extents, score %d%%", after->nblocks, after->nextents,
+				frag_score(after));
+	}
+	putchar('\n');
+}
+
+/* called by fs.c */
+void panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "panic: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	abort();
+}
+
+/* block device interface used by fs.c, backed by the image file */
+struct block_device *blk_open(dev_t dev)
+{
+	struct block_device *bdev;
+
+	if(!(bdev = malloc(sizeof *bdev))) {
+		return 0;
+	}
+	memset(bdev, 0, sizeof *bdev);
+	bdev->size = num_blocks;
+	return bdev;
+}
+
+void blk_close(struct block_device *bdev)
+{
+	free(bdev);
+}
+
+int blk_read(struct block_device *bdev, uint32_t blk, int count, void *buf)
+{
+	if(blk + count > bdev->size) {
+		return -1;
+	}
+	if(pread(fd, buf, BLKSZ * count, (off_t)blk * BLKSZ) < BLKSZ * count) {
+		return -1;
+	}
+	return 0;
+}
+
+int blk_write(struct block_device *bdev, uint32_t blk, int count, void *buf)
+{
+	if(report_only || blk + count > bdev->size) {
+		return -1;
+	}
+	if(pwrite(fd, buf, BLKSZ * count, (off_t)blk * BLKSZ) < BLKSZ * count) {
+		return -1;
+	}
+	return 0;
+}
+
+int parse_args(int argc, char **argv)
+{
+	int i;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'n':
+				report_only = 1;
+				break;
+
+			case 'v':
+				verbose = 1;
+				break;
+
+			case 'h':
+				printf("usage: %s [options] <image file>\n", argv[0]);
+				printf("options:\n");
+				printf(" -n  only report the fragmentation, don't change anything\n");
+				printf(" -v  report every file, not just the fragmented ones\n");
+				printf(" -h  print usage and exit\n");
+				exit(0);
+
+			default:
+				goto invalid;
+			}
+		} else {
+			if(img_fname) {
+				goto invalid;
+			}
+			img_fname = argv[i];
+		}
+	}
+
+	if(!img_fname) {
+		fprintf(stderr, "you must specify an image file\n");
+		return -1;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid argument: %s\n", argv[i]);
+	return -1;
+}
@@ -0,0 +1,451 @@
+/* fsbench - filesystem benchmark running the kernel's fs.c in userspace.
+ *
+ * Formats an image file and runs a set of scripted workloads against it,
+ * reporting the number of operations per second, and the number of blocks
+ * read and written per operation for each of them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "bdev.h"
+
+#define CHUNK_SZ	4096
+
+struct phase {
+	const char *name;
+	double start;
+	unsigned long nread, nwrite;
+};
+
+int parse_args(int argc, char **argv);
+void begin_phase(struct phase *ph, const char *name);
+void end_phase(struct phase *ph, unsigned long ops);
+double get_time(void);
+void fill_pattern(char *buf, long offs, int sz);
+int check_pattern(char *buf, long offs, int sz);
+void fail(const char *fmt, ...);
+
+void bench_files(struct filesys *fs);
+void bench_data(struct filesys *fs);
+void bench_deep(struct filesys *fs);
+
+int fd = -1;
+const char *img_fname;
+uint32_t num_blocks = 65536;	/* 64mb */
+int num_files = 2000;
+long data_size = 8 * 1024 * 1024;
+int num_rand = 2000;
+int dir_depth = 64;
+
+/* block I/O counters */
+unsigned long blk_nread, blk_nwrite;
+
+int main(int argc, char **argv)
+{
+	struct filesys fs;
+	unsigned int free_blocks, free_inodes;
+	int res;
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+
+	if((fd = open(img_fname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", img_fname, strerror(errno));
+		return 1;
+	}
+	if(ftruncate(fd, (off_t)num_blocks * BLKSZ) == -1) {
+		fprintf(stderr, "failed to resize %s: %s\n", img_fname, strerror(errno));
+		return 1;
+	}
+
+	if(mkfs(&fs, 0) == -1) {
+		fprintf(stderr, "mkfs failed\n");
+		return 1;
+	}
+	closefs(&fs);
+
+	if((res = openfs(&fs, 0)) != 0) {
+		fprintf(stderr, "failed to mount the new filesystem: %s\n", strerror(-res));
+		return 1;
+	}
+	free_blocks = fs.sb->bm->nfree;
+	free_inodes = fs.sb->ibm->nfree;
+
+	printf("image: %s, %u blocks, %u inodes\n", img_fname,
+			(unsigned int)fs.sb->num_blocks, (unsigned int)fs.sb->num_inodes);
+	printf("%-12s %10s %12s %10s %10s\n", "phase", "ops", "ops/sec", "reads/op", "writes/op");
+
+	bench_files(&fs);
+	bench_data(&fs);
+	bench_deep(&fs);
+
+	/* everything was removed, make sure nothing leaked */
+	if(fs.sb->bm->nfree != free_blocks || fs.sb->ibm->nfree != free_inodes) {
+		fprintf(stderr, "leak: %d blocks and %d inodes not freed\n",
+				(int)(free_blocks - fs.sb->bm->nfree),
+				(int)(free_inodes - fs.sb->ibm->nfree));
+		return 1;
+	}
+
+	closefs(&fs);
+	close(fd);
+	return 0;
+}
+
+/* create, lookup, and unlink storms in a single directory. The directory is
+ * removed at the end, so that the blocks it grew to are freed as well.
+ */
+void bench_files(struct filesys *fs)
+{
+	int i, j, res, *order;
+	char name[NAME_MAX + 1];
+	struct inode node, dir, *root = fs->sb->root;
+	struct phase ph;
+
+	if((res = create_file(fs, root, "files", S_IFDIR | 0755, &dir)) != 0) {
+		fail("mkdir files failed: %s\n", strerror(-res));
+	}
+
+	if(!(order = malloc(num_files * sizeof *order))) {
+		fail("failed to allocate lookup order array\n");
+	}
+	for(i=0; i<num_files; i++) {
+		order[i] = i;
+	}
+	for(i=num_files-1; i>0; i--) {
+		int tmp = order[i];
+		j = rand() % (i + 1);
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	begin_phase(&ph, "create");
+	for(i=0; i<num_files; i++) {
+		sprintf(name, "file%d", i);
+		if((res = create_file(fs, &dir, name, S_IFREG | 0644, &node)) != 0) {
+			fail("create %s failed: %s\n", name, strerror(-res));
+		}
+	}
+	end_phase(&ph, num_files);
+
+	begin_phase(&ph, "lookup");
+	for(i=0; i<num_files; i++) {
+		sprintf(name, "file%d", order[i]);
+		if((res = lookup(fs, &dir, name)) < 0) {
+			fail("lookup %s failed: %s\n", name, strerror(-res));
+		}
+	}
+	end_phase(&ph, num_files);
+
+	begin_phase(&ph, "unlink");
+	for(i=0; i<num_files; i++) {
+		sprintf(name, "file%d", order[i]);
+		if((res = unlink_file(fs, &dir, name)) != 0) {
+			fail("unlink %s failed: %s\n", name, strerror(-res));
+		}
+	}
+	end_phase(&ph, num_files);
+
+	if((res = unlink_file(fs, root, "files")) != 0) {
+		fail("rmdir files failed: %s\n", strerror(-res));
+	}
+	free(order);
+}
+
+/* sequential and random writes and reads of a single large file */
+void bench_data(struct filesys *fs)
+{
+	int i, res;
+	long offs, nchunks = data_size / CHUNK_SZ;
+	char *buf;
+	struct inode node;
+	struct phase ph;
+
+	if(!(buf = malloc(CHUNK_SZ))) {
+		fail("failed to allocate buffer\n");
+	}
+	if((res = create_file(fs, fs->sb->root, "data", S_IFREG | 0644, &node)) != 0) {
+		fail("create data failed: %s\n", strerror(-res));
+	}
+
+	begin_phase(&ph, "seq write");
+	for(offs=0; offs<nchunks * CHUNK_SZ; offs+=CHUNK_SZ) {
+		fill_pattern(buf, offs, CHUNK_SZ);
+		if(write_file(fs, &node, offs, buf, CHUNK_SZ) != CHUNK_SZ) {
+			fail("write failed at offset %ld\n", offs);
+		}
+	}
+	end_phase(&ph, nchunks);
+
+	begin_phase(&ph, "seq read");
+	for(offs=0; offs<nchunks * CHUNK_SZ; offs+=CHUNK_SZ) {
+		if(read_file(fs, &node, offs, buf, CHUNK_SZ) != CHUNK_SZ) {
+			fail("read failed at offset %ld\n", offs);
+		}
+		if(check_pattern(buf, offs, CHUNK_SZ) == -1) {
+			fail("read back wrong data at offset %ld\n", offs);
+		}
+	}
+	end_phase(&ph, nchunks);
+
+	begin_phase(&ph, "rand write");
+	for(i=0; i<num_rand; i++) {
+		offs = (rand() % nchunks) * CHUNK_SZ;
+		fill_pattern(buf, offs, CHUNK_SZ);
+		if(write_file(fs, &node, offs, buf, CHUNK_SZ) != CHUNK_SZ) {
+			fail("write failed at offset %ld\n", offs);
+		}
+	}
+	end_phase(&ph, num_rand);
+
+	begin_phase(&ph, "rand read");
+	for(i=0; i<num_rand; i++) {
+		offs = (rand() % nchunks) * CHUNK_SZ;
+		if(read_file(fs, &node, offs, buf, CHUNK_SZ) != CHUNK_SZ) {
+			fail("read failed at offset %ld\n", offs);
+		}
+		if(check_pattern(buf, offs, CHUNK_SZ) == -1) {
+			fail("read back wrong data at offset %ld\n", offs);
+		}
+	}
+	end_phase(&ph, num_rand);
+
+	put_inode(fs, &node);
+	if((res = unlink_file(fs, fs->sb->root, "data")) != 0) {
+		fail("unlink data failed: %s\n", strerror(-res));
+	}
+	free(buf);
+}
+
+/* a deep chain of nested directories, and path walks down through it */
+void bench_deep(struct filesys *fs)
+{
+	int i, j, res, npass = 100;
+	char name[NAME_MAX + 1];
+	struct inode *dirs, node;
+	struct phase ph;
+
+	if(!(dirs = malloc((dir_depth + 1) * sizeof *dirs))) {
+		fail("failed to allocate directory array\n");
+	}
+	dirs[0] = *fs->sb->root;
+
+	begin_phase(&ph, "mkdir");
+	for(i=0; i<dir_depth; i++) {
+		sprintf(name, "dir%d", i);
+		if((res = create_file(fs, dirs + i, name, S_IFDIR | 0755, dirs + i + 1)) != 0) {
+			fail("mkdir %s failed: %s\n", name, strerror(-res));
+		}
+	}
+	end_phase(&ph, dir_depth);
+
+	/* one op is a path component lookup, followed by reading its inode */
+	begin_phase(&ph, "path walk");
+	for(i=0; i<npass; i++) {
+		node = dirs[0];
+		for(j=0; j<dir_depth; j++) {
+			sprintf(name, "dir%d", j);
+			if((res = lookup(fs, &node, name)) < 0) {
+				fail("lookup %s failed: %s\n", name, strerror(-res));
+			}
+			if(get_inode(fs, res, &node) == -1) {
+				fail("failed to read inode %d\n", res);
+			}
+		}
+	}
+	end_phase(&ph, npass * dir_depth);
+
+	begin_phase(&ph, "rmdir");
+	for(i=dir_depth-1; i>=0; i--) {
+		sprintf(name, "dir%d", i);
+		if((res = unlink_file(fs, dirs + i, name)) != 0) {
+			fail("rmdir %s failed: %s\n", name, strerror(-res));
+		}
+	}
+	end_phase(&ph, dir_depth);
+
+	*fs->sb->root = dirs[0];
+	free(dirs);
+}
+
+void begin_phase(struct phase *ph, const char *name)
+{
+	ph->name = name;
+	ph->nread = blk_nread;
+	ph->nwrite = blk_nwrite;
+	ph->start = get_time();
+}
+
+void end_phase(struct phase *ph, unsigned long ops)
+{
+	double dt = get_time() - ph->start;
+	double nops = ops ? ops : 1;
+
+	printf("%-12s %10lu %12.1f %10.2f %10.2f\n", ph->name, ops, dt > 0.0 ? ops / dt : 0.0,
+			(blk_nread - ph->nread) / nops, (blk_nwrite - ph->nwrite) / nops);
+}
+
+double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void fill_pattern(char *buf, long offs, int sz)
+{
+	int i;
+	for(i=0; i<sz; i++) {
+		buf[i] = (offs + i) * 7 + (offs + i) / 1021;
+	}
+}
+
+int check_pattern(char *buf, long offs, int sz)
+{
+	int i;
+	for(i=0; i<sz; i++) {
+		if(buf[i] != (char)((offs + i) * 7 + (offs + i) / 1021)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+/* called by fs.c */
+void panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "panic: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	abort();
+}
+
+/* block device interface used by fs.c, backed by the image file */
+struct block_device *blk_open(dev_t dev)
+{
+	struct block_device *bdev;
+
+	if(!(bdev = malloc(sizeof *bdev))) {
+		return 0;
+	}
+	memset(bdev, 0, sizeof *bdev);
+	bdev->size = num_blocks;
+	return bdev;
+}
+
+void blk_close(struct block_device *bdev)
+{
+	free(bdev);
+}
+
+int blk_read(struct block_device *bdev, uint32_t blk, int count, void *buf)
+{
+	if(blk + count > bdev->size) {
+		return -1;
+	}
+	if(pread(fd, buf, BLKSZ * count, (off_t)blk * BLKSZ) < BLKSZ * count) {
+		return -1;
+	}
+	blk_nread += count;
+	return 0;
+}
+
+int blk_write(struct block_device *bdev, uint32_t blk, int count, void *buf)
+{
+	if(blk + count > bdev->size) {
+		return -1;
+	}
+	if(pwrite(fd, buf, BLKSZ * count, (off_t)blk * BLKSZ) < BLKSZ * count) {
+		return -1;
+	}
+	blk_nwrite += count;
+	return 0;
+}
+
+int parse_args(int argc, char **argv)
+{
+	int i;
+	long val;
+	char *endp;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && argv[i][2] == 0) {
+			if(argv[i][1] == 'h') {
+				printf("usage: %s [options] <image file>\n", argv[0]);
+				printf("options:\n");
+				printf(" -s <n>  image size in kb (default: %u)\n", (unsigned int)num_blocks);
+				printf(" -n <n>  number of files for the create/lookup/unlink storms (default: %d)\n", num_files);
+				printf(" -d <n>  size of the data file in kb (default: %ld)\n", data_size / 1024);
+				printf(" -r <n>  number of random reads and writes (default: %d)\n", num_rand);
+				printf(" -l <n>  depth of the nested directory chain (default: %d)\n", dir_depth);
+				printf(" -h      print usage and exit\n");
+				exit(0);
+			}
+
+			if(!argv[++i] || (val = strtol(argv[i], &endp, 10)) <= 0 || *endp) {
+				fprintf(stderr, "%s must be followed by a positive number\n", argv[i - 1]);
+				return -1;
+			}
+
+			switch(argv[i - 1][1]) {
+			case 's':
+				num_blocks = val * 1024 / BLKSZ;
+				break;
+			case 'n':
+				num_files = val;
+				break;
+			case 'd':
+				data_size = val * 1024;
+				if(data_size < CHUNK_SZ) {
+					data_size = CHUNK_SZ;
+				}
+				break;
+			case 'r':
+				num_rand = val;
+				break;
+			case 'l':
+				dir_depth = val;
+				break;
+			default:
+				goto invalid;
+			}
+		} else {
+			if(img_fname) {
+				goto invalid;
+			}
+			img_fname = argv[i];
+		}
+	}
+
+	if(!img_fname) {
+		fprintf(stderr, "you must specify an image file\n");
+		return -1;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid argument: %s\n", argv[i]);
+	return -1;
+}
@@ -0,0 +1,504 @@
+/* fsck - parallel consistency checker for the filesystem format in fs.h
+ *
+ * The image is mapped read-only and checked in the following phases:
+ *  1. superblock: sanity checks of the superblock and the layout.
+ *  2. inodes: the inode table is split in chunks handed out to the worker
+ *     threads. For every inode marked used in the inode bitmap, all the block
+ *     pointers are followed and the blocks are marked in a shared ownership
+ *     bitmap with atomic operations, which catches blocks claimed twice.
+ *     Directory entries are checked, and the references to each inode are
+ *     counted.
+ *  3. links: link counts, orphaned inodes, and the parent of each directory.
+ *  4. bitmaps: the on-disk block and inode bitmaps are compared to what was
+ *     found, and the free counts in the superblock are verified.
+ *
+ * Nothing is repaired, the exit status is 0 if the filesystem is clean, 1 if
+ * any problems were found, and 2 if the check couldn't be done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#undef NAME_MAX
+#undef PATH_MAX
+#include "fs.h"
+
+#define BLK_INODES		(BLKSZ / sizeof(struct inode))
+#define BLK_DIRENT		(BLKSZ / sizeof(struct dir_entry))
+#define BLK_BLKID		(BLKSZ / sizeof(blkid))
+
+#define BM_ISSET(bm, x)	((bm)[(x) / 32] & (1 << ((x) & 0x1f)))
+
+#define BLKPTR(bno)		((void*)(img + (size_t)(bno) * BLKSZ))
+
+/* number of inodes handed to a worker thread at a time */
+#define CHUNK_INODES	256
+/* problems printed unless -v is used */
+#define MAX_REPORT		64
+
+/* inode flags */
+#define IF_USED		1
+#define IF_DIR		2
+
+int parse_args(int argc, char **argv);
+int check_superblock(void);
+void *inode_worker(void *arg);
+void check_inode(int ino);
+int mark_block(int ino, blkid bno, const char *what);
+void check_dir_block(int dirino, struct inode *dir, blkid bno, int boffs);
+void check_links(void);
+void check_bitmaps(void);
+void problem(const char *fmt, ...);
+double get_time(void);
+
+int fd;
+unsigned char *img;
+uint32_t num_blocks;
+struct superblock *sb;
+blkid data_start;
+uint32_t *disk_ibm, *disk_bm;
+
+/* shared state built by the inode workers */
+uint32_t *blk_owned;		/* blocks referenced by some inode */
+int *refs;					/* directory entries pointing to each inode */
+int *parent;				/* directory holding the first entry for each inode */
+int *dotdot;				/* the ".." entry of each directory */
+unsigned char *iflags;
+unsigned int next_chunk;
+unsigned int nproblems;
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *img_fname;
+int num_threads;
+int verbose;
+
+int main(int argc, char **argv)
+{
+	int i;
+	struct stat st;
+	pthread_t *threads;
+	double t0, t;
+
+	if(parse_args(argc, argv) == -1) {
+		return 2;
+	}
+
+	if((fd = open(img_fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", img_fname, strerror(errno));
+		return 2;
+	}
+	if(fstat(fd, &st) == -1 || !(num_blocks = st.st_size / BLKSZ)) {
+		fprintf(stderr, "%s: can't determine the size (only image files are supported)\n", img_fname);
+		return 2;
+	}
+	img = mmap(0, (size_t)num_blocks * BLKSZ, PROT_READ, MAP_SHARED, fd, 0);
+	if(img == (void*)-1) {
+		fprintf(stderr, "failed to map %s: %s\n", img_fname, strerror(errno));
+		return 2;
+	}
+
+	t0 = t = get_time();
+	printf("phase 1: superblock\n");
+	if(check_superblock() == -1) {
+		return 2;
+	}
+	printf("  %.3f sec\n", get_time() - t);
+
+	blk_owned = calloc((sb->num_blocks + 31) / 32, sizeof *blk_owned);
+	refs = calloc(sb->num_inodes, sizeof *refs);
+	parent = calloc(sb->num_inodes, sizeof *parent);
+	dotdot = calloc(sb->num_inodes, sizeof *dotdot);
+	iflags = calloc(sb->num_inodes, 1);
+	threads = malloc(num_threads * sizeof *threads);
+	if(!blk_owned || !refs || !parent || !dotdot || !iflags || !threads) {
+		fprintf(stderr, "failed to allocate memory\n");
+		return 2;
+	}
+
+	t = get_time();
+	printf("phase 2: inodes, block references, directories (%d threads)\n", num_threads);
+	for(i=0; i<num_threads; i++) {
+		if(pthread_create(threads + i, 0, inode_worker, 0) != 0) {
+			fprintf(stderr, "failed to create worker thread\n");
+			return 2;
+		}
+	}
+	for(i=0; i<num_threads; i++) {
+		pthread_join(threads[i], 0);
+	}
+	printf("  %.3f sec\n", get_time() - t);
+
+	t = get_time();
+	printf("phase 3: link counts and directory tree\n");
+	check_links();
+	printf("  %.3f sec\n", get_time() - t);
+
+	t = get_time();
+	printf("phase 4: bitmaps and free counts\n");
+	check_bitmaps();
+	printf("  %.3f sec\n", get_time() - t);
+
+	printf("total: %.3f sec, %u problem%s found\n", get_time() - t0, nproblems,
+			nproblems == 1 ? "" : "s");
+	return nproblems ? 1 : 0;
+}
+
+int check_superblock(void)
+{
+	sb = BLKPTR(1);
+
+	if(num_blocks < 2 || sb->magic != MAGIC) {
+		fprintf(stderr, "invalid magic, not a filesystem image\n");
+		return -1;
+	}
+	if(sb->ver > FS_VER) {
+		fprintf(stderr, "unsupported version: %d\n", sb->ver);
+		return -1;
+	}
+	if(sb->blksize != BLKSZ) {
+		fprintf(stderr, "unsupported block size: %d\n", sb->blksize);
+		return -1;
+	}
+	if(sb->num_blocks > num_blocks) {
+		fprintf(stderr, "filesystem is larger than the image (%u > %u blocks)\n",
+				(unsigned int)sb->num_blocks, (unsigned int)num_blocks);
+		return -1;
+	}
+
+	if(sb->ibm_count < (sb->num_inodes + BLKSZ * 8 - 1) / (BLKSZ * 8) ||
+			sb->bm_count < (sb->num_blocks + BLKSZ * 8 - 1) / (BLKSZ * 8) ||
+			sb->itbl_count < (sb->num_inodes + BLK_INODES - 1) / BLK_INODES) {
+		fprintf(stderr, "metadata areas too small for %u blocks and %u inodes\n",
+				(unsigned int)sb->num_blocks, (unsigned int)sb->num_inodes);
+		return -1;
+	}
+	if(sb->ibm_start < 2 || sb->ibm_start + sb->ibm_count > sb->num_blocks ||
+			sb->bm_start < 2 || sb->bm_start + sb->bm_count > sb->num_blocks ||
+			sb->itbl_start < 2 || sb->itbl_start + sb->itbl_count > sb->num_blocks) {
+		fprintf(stderr, "metadata areas out of bounds\n");
+		return -1;
+	}
+	if(sb->root_ino <= 0 || sb->root_ino >= sb->num_inodes) {
+		fprintf(stderr, "invalid root inode: %d\n", sb->root_ino);
+		return -1;
+	}
+
+	data_start = sb->ibm_start + sb->ibm_count;
+	if(sb->bm_start + sb->bm_count > data_start) data_start = sb->bm_start + sb->bm_count;
+	if(sb->itbl_start + sb->itbl_count > data_start) data_start = sb->itbl_start + sb->itbl_count;
+
+	disk_ibm = BLKPTR(sb->ibm_start);
+	disk_bm = BLKPTR(sb->bm_start);
+
+	printf("  %u blocks, %u inodes, data starts at block %u\n", (unsigned int)sb->num_blocks,
+			(unsigned int)sb->num_inodes, (unsigned int)data_start);
+	return 0;
+}
+
+/* grab chunks of the inode table until there are none left */
+void *inode_worker(void *arg)
+{
+	unsigned int i, start, end;
+
+	while((start = __atomic_fetch_add(&next_chunk, CHUNK_INODES, __ATOMIC_RELAXED)) < sb->num_inodes) {
+		end = start + CHUNK_INODES;
+		if(end > sb->num_inodes) end = sb->num_inodes;
+
+		for(i=start; i<end; i++) {
+			check_inode(i);
+		}
+	}
+	return 0;
+}
+
+void check_inode(int ino)
+{
+	int i, j, boffs;
+	struct inode *node;
+	blkid *ind, *dind;
+
+	node = (struct inode*)BLKPTR(sb->itbl_start) + ino;
+
+	/* the contents of free inodes don't matter, and inode 0 is always
+	 * marked used but never used.
+	 */
+	if(!BM_ISSET(disk_ibm, ino) || ino == 0) {
+		return;
+	}
+
+	iflags[ino] = IF_USED;
+	if(S_ISDIR(node->mode)) {
+		iflags[ino] |= IF_DIR;
+	}
+	if(node->ino != ino) {
+		problem("inode %d: wrong inode number %d\n", ino, node->ino);
+	}
+
+	for(i=0; i<NDIRBLK; i++) {
+		if(node->blk[i] && mark_block(ino, node->blk[i], "data") == 0 && (iflags[ino] & IF_DIR)) {
+			check_dir_block(ino, node, node->blk[i], i);
+		}
+	}
+
+	boffs = NDIRBLK;
+	if(node->ind && mark_block(ino, node->ind, "indirect") == 0) {
+		ind = BLKPTR(node->ind);
+		for(i=0; i<BLK_BLKID; i++) {
+			if(ind[i] && mark_block(ino, ind[i], "data") == 0 && (iflags[ino] & IF_DIR)) {
+				check_dir_block(ino, node, ind[i], boffs + i);
+			}
+		}
+	}
+	boffs += BLK_BLKID;
+
+	if(node->dind && mark_block(ino, node->dind, "double-indirect") == 0) {
+		dind = BLKPTR(node->dind);
+		for(i=0; i<BLK_BLKID; i++) {
+			if(!dind[i] || mark_block(ino, dind[i], "indirect") == -1) {
+				continue;
+			}
+			ind = BLKPTR(dind[i]);
+			for(j=0; j<BLK_BLKID; j++) {
+				if(ind[j] && mark_block(ino, ind[j], "data") == 0 && (iflags[ino] & IF_DIR)) {
+					check_dir_block(ino, node, ind[j], boffs + i * BLK_BLKID + j);
+				}
+			}
+		}
+	}
+}
+
+/* claim a block for an inode. returns -1 if the block number is invalid or
+ * the block belongs to someone else already, in which case it's not followed.
+ */
+int mark_block(int ino, blkid bno, const char *what)
+{
+	uint32_t bit, prev;
+
+	if(bno < data_start || bno >= sb->num_blocks) {
+		problem("inode %d: invalid %s block %u\n", ino, what, (unsigned int)bno);
+		return -1;
+	}
+
+	bit = 1 << (bno & 0x1f);
+	prev = __atomic_fetch_or(blk_owned + bno / 32, bit, __ATOMIC_RELAXED);
+	if(prev & bit) {
+		problem("inode %d: %s block %u is also used by another inode\n", ino, what, (unsigned int)bno);
+		return -1;
+	}
+	return 0;
+}
+
+void check_dir_block(int dirino, struct inode *dir, blkid bno, int boffs)
+{
+	int i, len, ino;
+	struct dir_entry *ent = BLKPTR(bno);
+	int expected;
+
+	if((long)boffs * BLKSZ >= dir->size) {
+		return;	/* preallocated past the end, not part of the directory */
+	}
+
+	for(i=0; i<BLK_DIRENT; i++) {
+		if(!(ino = ent[i].ino)) {
+			continue;
+		}
+
+		len = strnlen(ent[i].name, NAME_MAX + 1);
+		if(len == 0 || len > NAME_MAX) {
+			problem("directory %d: entry %d has an invalid name\n", dirino, boffs * BLK_DIRENT + i);
+			continue;
+		}
+		if(ino < 0 || ino >= sb->num_inodes) {
+			problem("directory %d: entry \"%s\" has invalid inode %d\n", dirino, ent[i].name, ino);
+			continue;
+		}
+		if(!BM_ISSET(disk_ibm, ino)) {
+			problem("directory %d: entry \"%s\" refers to free inode %d\n", dirino, ent[i].name, ino);
+			continue;
+		}
+		__atomic_fetch_add(refs + ino, 1, __ATOMIC_RELAXED);
+
+		if(strcmp(ent[i].name, ".") == 0) {
+			if(ino != dirino) {
+				problem("directory %d: \".\" refers to inode %d\n", dirino, ino);
+			}
+		} else if(strcmp(ent[i].name, "..") == 0) {
+			dotdot[dirino] = ino;
+		} else {
+			/* remember the first directory refering to each inode */
+			expected = 0;
+			__atomic_compare_exchange_n(parent + ino, &expected, dirino, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void check_links(void)
+{
+	int i, depth, p, root = sb->root_ino;
+	struct inode *itbl = BLKPTR(sb->itbl_start);
+
+	if(!(iflags[root] & IF_DIR)) {
+		problem("root inode %d is not a directory\n", root);
+		return;
+	}
+	if(dotdot[root] != root) {
+		problem("root directory: \"..\" refers to inode %d\n", dotdot[root]);
+	}
+
+	for(i=1; i<sb->num_inodes; i++) {
+		if(!(iflags[i] & IF_USED)) {
+			continue;
+		}
+
+		if(!refs[i]) {
+			problem("inode %d: not in any directory\n", i);
+			continue;
+		}
+		if(itbl[i].nlink != refs[i]) {
+			problem("inode %d: link count is %d, should be %d\n", i, itbl[i].nlink, refs[i]);
+		}
+
+		if(!(iflags[i] & IF_DIR) || i == root) {
+			continue;
+		}
+
+		/* directories must have a parent, which their ".." refers to, and
+		 * must be reachable from the root.
+		 */
+		if(!parent[i]) {
+			problem("directory %d: only referenced by itself\n", i);
+			continue;
+		}
+		if(dotdot[i] != parent[i]) {
+			problem("directory %d: \"..\" refers to inode %d, parent is %d\n", i, dotdot[i], parent[i]);
+		}
+		p = parent[i];
+		for(depth=0; p && p != root && depth < sb->num_inodes; depth++) {
+			p = parent[p];
+		}
+		if(p != root) {
+			problem("directory %d: not reachable from the root directory\n", i);
+		}
+	}
+}
+
+void check_bitmaps(void)
+{
+	int i, used, owned, nfree;
+
+	/* everything before the data area belongs to the filesystem */
+	nfree = 0;
+	for(i=0; i<sb->num_blocks; i++) {
+		used = BM_ISSET(disk_bm, i) != 0;
+		owned = i < data_start || BM_ISSET(blk_owned, i);
+
+		if(used && !owned) {
+			problem("block %d: marked used, but not referenced\n", i);
+		} else if(!used && owned) {
+			problem("block %d: referenced, but marked free\n", i);
+		}
+		if(!used) nfree++;
+	}
+	if(sb->ver >= 2 && sb->free_blocks != nfree) {
+		problem("superblock: %u free blocks, should be %d\n", sb->free_blocks, nfree);
+	}
+
+	nfree = 0;
+	for(i=0; i<sb->num_inodes; i++) {
+		if(!BM_ISSET(disk_ibm, i)) nfree++;
+	}
+	if(sb->ver >= 2 && sb->free_inodes != nfree) {
+		problem("superblock: %u free inodes, should be %d\n", sb->free_inodes, nfree);
+	}
+}
+
+void problem(const char *fmt, ...)
+{
+	va_list ap;
+	unsigned int n = __atomic_add_fetch(&nproblems, 1, __ATOMIC_RELAXED);
+
+	if(!verbose && n > MAX_REPORT) {
+		if(n == MAX_REPORT + 1) {
+			fprintf(stderr, "  too many problems, use -v to list them all\n");
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&report_lock);
+	fprintf(stderr, "  ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&report_lock);
+}
+
+double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int parse_args(int argc, char **argv)
+{
+	int i;
+	char *endp;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'j':
+				if(!argv[++i] || (num_threads = strtol(argv[i], &endp, 10)) <= 0 || *endp) {
+					fprintf(stderr, "-j must be followed by the number of threads\n");
+					return -1;
+				}
+				break;
+
+			case 'v':
+				verbose = 1;
+				break;
+
+			case 'h':
+				printf("usage: %s [options] <image file>\n", argv[0]);
+				printf("options:\n");
+				printf(" -j <n>  number of worker threads (default: number of cpus)\n");
+				printf(" -v      list all problems found\n");
+				printf(" -h      print usage and exit\n");
+				exit(0);
+
+			default:
+				goto invalid;
+			}
+		} else {
+			if(img_fname) {
+				goto invalid;
+			}
+			img_fname = argv[i];
+		}
+	}
+
+	if(!img_fname) {
+		fprintf(stderr, "you must specify an image file\n");
+		return -1;
+	}
+	if(num_threads <= 0) {
+		num_threads = 1;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid argument: %s\n", argv[i]);
+	return -1;
+}
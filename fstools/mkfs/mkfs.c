@@ -1,58 +1,85 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #ifdef __linux__
 #include <linux/fs.h>
 #endif
 #ifdef __darwin__
 #include <dev/disk.h>
 #endif
+/* the system headers define their own NAME_MAX and PATH_MAX */
+#undef NAME_MAX
+#undef PATH_MAX
 #include "fs.h"
+#include "bdev.h"
+#include "mkfs.h"
 
-int mkfs(int fd, int blksize, uint32_t nblocks);
 uint32_t get_block_count(int fd, int blksize);
-int user_readblock(int dev, uint32_t blk, void *buf);
-int user_writeblock(int dev, uint32_t blk, void *buf);
 int parse_args(int argc, char **argv);
 
 int fd;
 uint32_t num_blocks;
+unsigned char *img;
+
+const char *dev_fname;
+const char *root_dir;
+unsigned long img_size;	/* in kb, create/resize the image file if non-zero */
 
 int main(int argc, char **argv)
 {
+	struct filesys fs;
+
 	if(parse_args(argc, argv) == -1) {
 		return 1;
 	}
 
+	if((fd = open(dev_fname, O_RDWR | (img_size ? O_CREAT : 0), 0644)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", dev_fname, strerror(errno));
+		return 1;
+	}
+	if(img_size && ftruncate(fd, (off_t)img_size * 1024) == -1) {
+		fprintf(stderr, "failed to resize %s: %s\n", dev_fname, strerror(errno));
+		return 1;
+	}
+
 	if((num_blocks = get_block_count(fd, BLKSZ)) == 0) {
 		fprintf(stderr, "could not determine the number of blocks\n");
 		return 1;
 	}
 	printf("total blocks: %u\n", (unsigned int)num_blocks);
 
-	if(mkfs(fd, num_blocks) == -1) {
+	/* all block I/O goes through a shared mapping of the whole device */
+	img = mmap(0, (size_t)num_blocks * BLKSZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(img == (void*)-1) {
+		fprintf(stderr, "failed to map %s: %s\n", dev_fname, strerror(errno));
 		return 1;
 	}
 
-	return 0;
-}
-
-int mkfs(int fd, int blksize, uint32_t nblocks)
-{
-	struct superblock *sb;
+	if(mkfs(&fs, 0) == -1) {
+		fprintf(stderr, "failed to create the filesystem\n");
+		return 1;
+	}
+	closefs(&fs);
 
-	sb = malloc(BLKSZ);
-	assert(sb);
+	if(root_dir && populate(img, num_blocks, root_dir) == -1) {
+		return 1;
+	}
 
-	sb->magic = MAGIC;
-	sb->ver = 0;
-	sb->num_blocks = nblocks;
+	if(msync(img, (size_t)num_blocks * BLKSZ, MS_SYNC) == -1) {
+		fprintf(stderr, "failed to write back %s: %s\n", dev_fname, strerror(errno));
+		return 1;
+	}
+	munmap(img, (size_t)num_blocks * BLKSZ);
+	close(fd);
+	return 0;
 }
 
 uint32_t get_block_count(int fd, int blksize)
@@ -86,57 +113,96 @@ uint32_t get_block_count(int fd, int blksize)
 	return 0;
 }
 
-int blk_read(void*, uint32_t blk, int count, void *buf)
+/* block device interface used by fs.c, on top of the mapped image */
+struct block_device *blk_open(dev_t dev)
 {
-	if(lseek(fd, blk * BLKSZ, SEEK_SET) == -1) {
-		return -1;
+	struct block_device *bdev;
+
+	if(!(bdev = malloc(sizeof *bdev))) {
+		return 0;
 	}
-	if(read(fd, buf, BLKSZ * count) < BLKSZ * count) {
+	memset(bdev, 0, sizeof *bdev);
+	bdev->size = num_blocks;
+	return bdev;
+}
+
+void blk_close(struct block_device *bdev)
+{
+	free(bdev);
+}
+
+int blk_read(struct block_device *bdev, uint32_t blk, int count, void *buf)
+{
+	if(blk + count > num_blocks) {
 		return -1;
 	}
+	memcpy(buf, img + (size_t)blk * BLKSZ, count * BLKSZ);
 	return 0;
 }
 
-int blk_write(void*, uint32_t blk, int count, void *buf)
+int blk_write(struct block_device *bdev, uint32_t blk, int count, void *buf)
 {
-	if(lseek(fd, blk * BLKSZ, SEEK_SET) == -1) {
-		return -1;
-	}
-	if(write(fd, buf, BLKSZ * count) < BLKSZ * count) {
+	if(blk + count > num_blocks) {
 		return -1;
 	}
+	memcpy(img + (size_t)blk * BLKSZ, buf, count * BLKSZ);
 	return 0;
 }
 
+/* called by fs.c */
+void panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "panic: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	abort();
+}
+
 int parse_args(int argc, char **argv)
 {
 	int i;
-
-	fd = -1;
+	char *endp;
 
 	for(i=1; i<argc; i++) {
 		if(argv[i][0] == '-' && argv[i][2] == 0) {
 			switch(argv[i][1]) {
+			case 'r':
+				if(!(root_dir = argv[++i])) {
+					fprintf(stderr, "-r must be followed by a directory\n");
+					return -1;
+				}
+				break;
+
+			case 's':
+				if(!argv[++i] || !(img_size = strtoul(argv[i], &endp, 10)) || *endp) {
+					fprintf(stderr, "-s must be followed by the image size in kb\n");
+					return -1;
+				}
+				break;
+
 			case 'h':
-				printf("usage: %s <device file>\n", argv[0]);
+				printf("usage: %s [options] <device file>\n", argv[0]);
+				printf("options:\n");
+				printf(" -r <dir>   populate the filesystem with the contents of dir\n");
+				printf(" -s <size>  create or resize an image file to size kb\n");
+				printf(" -h         print usage and exit\n");
 				exit(0);
 
 			default:
 				goto invalid;
 			}
 		} else {
-			if(fd != -1) {
+			if(dev_fname) {
 				goto invalid;
 			}
-
-			if((fd = open(argv[i], O_RDWR)) == -1) {
-				fprintf(stderr, "failed to open %s: %s\n", argv[i], strerror(errno));
-				return -1;
-			}
+			dev_fname = argv[i];
 		}
 	}
 
-	if(fd == -1) {
+	if(!dev_fname) {
 		fprintf(stderr, "you must specify a device or image file\n");
 		return -1;
 	}
@@ -0,0 +1,11 @@
+#ifndef MKFS_H_
+#define MKFS_H_
+
+#include <inttypes.h>
+
+/* populate.c: copy a host directory tree into a freshly made filesystem,
+ * in the mapped image img of nblocks blocks.
+ */
+int populate(unsigned char *img, uint32_t nblocks, const char *rootdir);
+
+#endif	/* MKFS_H_ */
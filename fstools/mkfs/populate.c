@@ -0,0 +1,423 @@
+/* Image builder: populates a freshly made filesystem with a host directory
+ * tree in one pass.
+ *
+ * Instead of going through fs.c one block at a time, the whole layout is
+ * planned up front from the scanned tree, and written straight into the
+ * mapped image:
+ *  - inode numbers are handed out in breadth-first order, so that the entries
+ *    of each directory have consecutive inodes.
+ *  - all directory blocks come first, right after the inode table, followed
+ *    by the data of each file in one contiguous run (broken only by its
+ *    indirect blocks, which precede the blocks they map).
+ *  - file data is read into the image with one read call per run.
+ *  - the bitmaps and the superblock free counts are updated once at the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#undef NAME_MAX
+#undef PATH_MAX
+#include "fs.h"
+#include "mkfs.h"
+
+#define BLK_DIRENT		(BLKSZ / sizeof(struct dir_entry))
+#define BLK_BLKID		(BLKSZ / sizeof(blkid))
+#define MAX_IND			(NDIRBLK + BLK_BLKID)
+#define MAX_DIND		(MAX_IND + BLK_BLKID * BLK_BLKID)
+
+#define BLKPTR(bno)		((void*)(img + (size_t)(bno) * BLKSZ))
+
+struct node {
+	char *path;
+	char name[NAME_MAX + 1];
+	struct stat st;
+
+	int ino;
+	int nblk;
+	blkid *blist;
+	blkid ind, dind;
+
+	int nchild, nsubdir;
+	struct node *parent;
+	struct node *child, *next;	/* first child, next sibling */
+	struct node *qnext;			/* next node in breadth-first order */
+};
+
+static struct node *scan(const char *path, const char *name);
+static int cmp_node(const void *a, const void *b);
+static int place_blocks(struct node *n);
+static blkid next_block(void);
+static int write_dir(struct node *n);
+static int write_data(struct node *n);
+static void write_inode(struct node *n);
+static int mark_used(blkid bmstart, int start, int count);
+static void free_tree(struct node *n);
+
+static unsigned char *img;
+static uint32_t num_blocks;
+static struct superblock *sb;
+static blkid cursor;
+
+int populate(unsigned char *image, uint32_t nblocks, const char *rootdir)
+{
+	struct node *root, *n, *tail;
+	int ino, res = -1;
+	blkid first;
+
+	img = image;
+	num_blocks = nblocks;
+	sb = BLKPTR(1);
+
+	if(!(root = scan(rootdir, "/"))) {
+		return -1;
+	}
+	if(!S_ISDIR(root->st.st_mode)) {
+		fprintf(stderr, "%s is not a directory\n", rootdir);
+		goto end;
+	}
+
+	/* breadth-first order, handing out inode numbers on the way */
+	ino = sb->root_ino;
+	root->ino = ino++;
+	tail = root;
+	for(n=root; n; n=n->qnext) {
+		struct node *c = n->child;
+		while(c) {
+			if(ino >= sb->num_inodes) {
+				fprintf(stderr, "out of inodes\n");
+				goto end;
+			}
+			c->ino = ino++;
+			tail->qnext = c;
+			tail = c;
+			c = c->next;
+		}
+	}
+
+	/* all directories first, then all file data. The root directory block
+	 * made by mkfs is the first one after the inode table, and it's reused.
+	 */
+	first = cursor = sb->itbl_start + sb->itbl_count;
+	for(n=root; n; n=n->qnext) {
+		if(S_ISDIR(n->st.st_mode)) {
+			n->nblk = (n->nchild + 2 + BLK_DIRENT - 1) / BLK_DIRENT;
+			if(place_blocks(n) == -1) goto end;
+		}
+	}
+	for(n=root; n; n=n->qnext) {
+		if(S_ISREG(n->st.st_mode)) {
+			n->nblk = (n->st.st_size + BLKSZ - 1) / BLKSZ;
+			if(place_blocks(n) == -1) goto end;
+		}
+	}
+	printf("%d inodes, %u blocks used\n", ino, (unsigned int)cursor);
+
+	for(n=root; n; n=n->qnext) {
+		if(S_ISDIR(n->st.st_mode)) {
+			if(write_dir(n) == -1) goto end;
+		} else {
+			if(write_data(n) == -1) goto end;
+		}
+		write_inode(n);
+	}
+
+	/* and finally update the bitmaps and the free counts */
+	sb->free_inodes -= mark_used(sb->ibm_start, root->ino, ino - root->ino);
+	sb->free_blocks -= mark_used(sb->bm_start, first, cursor - first);
+	res = 0;
+
+end:
+	free_tree(root);
+	return res;
+}
+
+static struct node *scan(const char *path, const char *name)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct node *n, *c, **carr;
+	int i, len;
+
+	if(!(n = calloc(1, sizeof *n)) || !(n->path = strdup(path))) {
+		fprintf(stderr, "failed to allocate memory\n");
+		free(n);
+		return 0;
+	}
+	strcpy(n->name, name);
+
+	if(lstat(path, &n->st) == -1) {
+		fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
+		free_tree(n);
+		return 0;
+	}
+	if(!S_ISDIR(n->st.st_mode)) {
+		return n;
+	}
+
+	if(!(dir = opendir(path))) {
+		fprintf(stderr, "failed to open directory %s: %s\n", path, strerror(errno));
+		free_tree(n);
+		return 0;
+	}
+	while((dent = readdir(dir))) {
+		char *cpath;
+
+		if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+		if(strlen(dent->d_name) > NAME_MAX) {
+			fprintf(stderr, "skipping %s/%s: name too long\n", path, dent->d_name);
+			continue;
+		}
+
+		len = strlen(path) + strlen(dent->d_name) + 2;
+		if(!(cpath = malloc(len))) {
+			fprintf(stderr, "failed to allocate memory\n");
+			break;
+		}
+		sprintf(cpath, "%s/%s", path, dent->d_name);
+
+		c = scan(cpath, dent->d_name);
+		free(cpath);
+		if(!c) continue;
+
+		if(!S_ISDIR(c->st.st_mode) && !S_ISREG(c->st.st_mode)) {
+			fprintf(stderr, "skipping %s: not a regular file or directory\n", c->path);
+			free_tree(c);
+			continue;
+		}
+		if(S_ISDIR(c->st.st_mode)) {
+			n->nsubdir++;
+		}
+		c->parent = n;
+		c->next = n->child;
+		n->child = c;
+		n->nchild++;
+	}
+	closedir(dir);
+
+	/* sort the entries by name, so that images are reproducible */
+	if(n->nchild > 1 && (carr = malloc(n->nchild * sizeof *carr))) {
+		c = n->child;
+		for(i=0; i<n->nchild; i++) {
+			carr[i] = c;
+			c = c->next;
+		}
+		qsort(carr, n->nchild, sizeof *carr, cmp_node);
+		for(i=0; i<n->nchild; i++) {
+			carr[i]->next = i < n->nchild - 1 ? carr[i + 1] : 0;
+		}
+		n->child = carr[0];
+		free(carr);
+	}
+	return n;
+}
+
+static int cmp_node(const void *a, const void *b)
+{
+	return strcmp((*(struct node**)a)->name, (*(struct node**)b)->name);
+}
+
+/* assign consecutive disk blocks to all the blocks of a node, with each
+ * indirect block placed just before the first block it maps, and fill in
+ * the indirect blocks.
+ */
+static int place_blocks(struct node *n)
+{
+	int i;
+	blkid *ind = 0, *dind = 0;
+
+	if(n->nblk > MAX_DIND) {
+		fprintf(stderr, "%s: file too large\n", n->path);
+		return -1;
+	}
+	if(!n->nblk) {
+		return 0;
+	}
+	if(!(n->blist = malloc(n->nblk * sizeof *n->blist))) {
+		fprintf(stderr, "failed to allocate memory\n");
+		return -1;
+	}
+
+	for(i=0; i<n->nblk; i++) {
+		if(i == NDIRBLK) {
+			if(!(n->ind = next_block())) return -1;
+			ind = BLKPTR(n->ind);
+			memset(ind, 0, BLKSZ);
+		} else if(i == MAX_IND) {
+			if(!(n->dind = next_block())) return -1;
+			dind = BLKPTR(n->dind);
+			memset(dind, 0, BLKSZ);
+		}
+		if(i >= MAX_IND && (i - MAX_IND) % BLK_BLKID == 0) {
+			blkid bno;
+			if(!(bno = next_block())) return -1;
+			dind[(i - MAX_IND) / BLK_BLKID] = bno;
+			ind = BLKPTR(bno);
+			memset(ind, 0, BLKSZ);
+		}
+
+		if(!(n->blist[i] = next_block())) {
+			return -1;
+		}
+		if(i >= MAX_IND) {
+			ind[(i - MAX_IND) % BLK_BLKID] = n->blist[i];
+		} else if(i >= NDIRBLK) {
+			ind[i - NDIRBLK] = n->blist[i];
+		}
+	}
+	return 0;
+}
+
+static blkid next_block(void)
+{
+	if(cursor >= num_blocks) {
+		fprintf(stderr, "image too small\n");
+		return 0;
+	}
+	return cursor++;
+}
+
+static int write_dir(struct node *n)
+{
+	int i;
+	struct node *c;
+	struct dir_entry *ent;
+
+	for(i=0; i<n->nblk; i++) {
+		memset(BLKPTR(n->blist[i]), 0, BLKSZ);
+	}
+
+	for(i=0, c=n->child; i<n->nchild + 2; i++) {
+		ent = (struct dir_entry*)BLKPTR(n->blist[i / BLK_DIRENT]) + i % BLK_DIRENT;
+
+		if(i == 0) {
+			ent->ino = n->ino;
+			strcpy(ent->name, ".");
+		} else if(i == 1) {
+			ent->ino = n->parent ? n->parent->ino : n->ino;
+			strcpy(ent->name, "..");
+		} else {
+			ent->ino = c->ino;
+			strcpy(ent->name, c->name);
+			c = c->next;
+		}
+	}
+	return 0;
+}
+
+/* read the file data into the image, one read call per contiguous run */
+static int write_data(struct node *n)
+{
+	int fd, i, len;
+	long sz, rd;
+	char *dest;
+
+	if(!n->nblk) {
+		return 0;
+	}
+	if((fd = open(n->path, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", n->path, strerror(errno));
+		return -1;
+	}
+
+	sz = n->st.st_size;
+	for(i=0; i<n->nblk; i+=len) {
+		len = 1;
+		while(i + len < n->nblk && n->blist[i + len] == n->blist[i] + len) {
+			len++;
+		}
+
+		dest = BLKPTR(n->blist[i]);
+		rd = (long)len * BLKSZ;
+		if(rd > sz) rd = sz;
+		sz -= rd;
+
+		while(rd > 0) {
+			long res = read(fd, dest, rd);
+			if(res <= 0) {
+				fprintf(stderr, "failed to read %s: %s\n", n->path,
+						res ? strerror(errno) : "file truncated");
+				close(fd);
+				return -1;
+			}
+			dest += res;
+			rd -= res;
+		}
+	}
+	close(fd);
+
+	/* clear the rest of the last block */
+	if((len = n->st.st_size % BLKSZ)) {
+		dest = BLKPTR(n->blist[n->nblk - 1]);
+		memset(dest + len, 0, BLKSZ - len);
+	}
+	return 0;
+}
+
+static void write_inode(struct node *n)
+{
+	int i;
+	struct inode *inode;
+
+	inode = (struct inode*)BLKPTR(sb->itbl_start) + n->ino;
+	memset(inode, 0, sizeof *inode);
+
+	inode->ino = n->ino;
+	inode->uid = n->st.st_uid;
+	inode->gid = n->st.st_gid;
+	inode->mode = n->st.st_mode;
+	inode->atime = n->st.st_atime;
+	inode->ctime = n->st.st_ctime;
+	inode->mtime = n->st.st_mtime;
+
+	if(S_ISDIR(n->st.st_mode)) {
+		inode->nlink = 2 + n->nsubdir;
+		inode->size = n->nblk * BLKSZ;
+	} else {
+		inode->nlink = 1;
+		inode->size = n->st.st_size;
+	}
+
+	for(i=0; i<n->nblk && i<NDIRBLK; i++) {
+		inode->blk[i] = n->blist[i];
+	}
+	inode->ind = n->ind;
+	inode->dind = n->dind;
+}
+
+/* set count bits in the on-disk bitmap starting at bmstart, and return how
+ * many of them were previously clear.
+ */
+static int mark_used(blkid bmstart, int start, int count)
+{
+	int i, nset = 0;
+	uint32_t *bm = BLKPTR(bmstart);
+
+	for(i=start; i<start+count; i++) {
+		if(!(bm[i / 32] & (1 << (i & 0x1f)))) {
+			bm[i / 32] |= 1 << (i & 0x1f);
+			nset++;
+		}
+	}
+	return nset;
+}
+
+static void free_tree(struct node *n)
+{
+	struct node *c;
+
+	while(n->child) {
+		c = n->child;
+		n->child = c->next;
+		free_tree(c);
+	}
+	free(n->path);
+	free(n->blist);
+	free(n);
+}
@@ -0,0 +1,80 @@
+/* the byte at a time versions of the klibc memory and string functions, which
+ * strbench compares the current ones against
+ */
+#include <stdlib.h>
+
+void old_memset(void *s, int c, size_t n)
+{
+	char *ptr = s;
+	while(n--) {
+		*ptr++ = c;
+	}
+}
+
+void old_memset16(void *s, int c, size_t n)
+{
+	short *ptr = s;
+	while(n--) {
+		*ptr++ = c;
+	}
+}
+
+void *old_memcpy(void *dest, const void *src, size_t n)
+{
+	char *dptr = dest;
+	const char *sptr = src;
+
+	while(n--) {
+		*dptr++ = *sptr++;
+	}
+	return dest;
+}
+
+void *old_memmove(void *dest, const void *src, size_t n)
+{
+	int i;
+	char *dptr;
+	const char *sptr;
+
+	if(dest <= src) {
+		dptr = dest;
+		sptr = src;
+		for(i=0; i<n; i++) {
+			*dptr++ = *sptr++;
+		}
+	} else {
+		dptr = (char*)dest + n - 1;
+		sptr = (const char*)src + n - 1;
+		for(i=0; i<n; i++) {
+			*dptr-- = *sptr--;
+		}
+	}
+	return dest;
+}
+
+size_t old_strlen(const char *s)
+{
+	size_t len = 0;
+	while(*s++) len++;
+	return len;
+}
+
+char *old_strchr(const char *s, int c)
+{
+	while(*s) {
+		if(*s == c) {
+			return (char*)s;
+		}
+		s++;
+	}
+	return 0;
+}
+
+int old_strcmp(const char *s1, const char *s2)
+{
+	while(*s1 && *s1 == *s2) {
+		s1++;
+		s2++;
+	}
+	return *s1 - *s2;
+}
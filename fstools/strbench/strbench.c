@@ -0,0 +1,302 @@
+/* strbench - benchmark of the klibc memory and string functions.
+ *
+ * Runs the kernel's string.c in userspace, built with the same flags as the
+ * kernel, and compares it with the previous byte at a time versions across a
+ * range of sizes. Before timing anything, both are checked against the C
+ * library with random sizes, alignments and overlaps.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define BUF_SZ		(256 * 1024)
+/* part of the buffers used by the correctness checks */
+#define CHECK_SZ	(16 * 1024)
+
+/* kernel string.c */
+void k_memset(void *s, int c, size_t n);
+void k_memset16(void *s, int c, size_t n);
+void *k_memcpy(void *dest, const void *src, size_t n);
+void *k_memmove(void *dest, const void *src, size_t n);
+size_t k_strlen(const char *s);
+char *k_strchr(const char *s, int c);
+int k_strcmp(const char *s1, const char *s2);
+
+/* oldstring.c */
+void old_memset(void *s, int c, size_t n);
+void old_memset16(void *s, int c, size_t n);
+void *old_memcpy(void *dest, const void *src, size_t n);
+void *old_memmove(void *dest, const void *src, size_t n);
+size_t old_strlen(const char *s);
+char *old_strchr(const char *s, int c);
+int old_strcmp(const char *s1, const char *s2);
+
+struct funcs {
+	void (*memset)(void*, int, size_t);
+	void (*memset16)(void*, int, size_t);
+	void *(*memcpy)(void*, const void*, size_t);
+	void *(*memmove)(void*, const void*, size_t);
+	size_t (*strlen)(const char*);
+	char *(*strchr)(const char*, int);
+	int (*strcmp)(const char*, const char*);
+};
+
+enum { OP_MEMSET, OP_MEMSET16, OP_MEMCPY, OP_MEMMOVE, OP_STRLEN, OP_STRCHR, OP_STRCMP };
+
+int parse_args(int argc, char **argv);
+void check(void);
+void bench(int op, const char *name);
+double run(struct funcs *f, int op, int size, long iter);
+double get_time(void);
+int sign(int x);
+void fail(const char *fmt, ...);
+
+struct funcs kfuncs = {
+	k_memset, k_memset16, k_memcpy, k_memmove, k_strlen, k_strchr, k_strcmp
+};
+struct funcs oldfuncs = {
+	old_memset, old_memset16, old_memcpy, old_memmove, old_strlen, old_strchr, old_strcmp
+};
+
+int sizes[] = {4, 16, 64, 256, 1024, 4096, 65536};
+#define NUM_SIZES	(sizeof sizes / sizeof *sizes)
+
+long bench_bytes = 64 * 1024 * 1024;
+int num_checks = 100000;
+
+char *buf_a, *buf_b, *buf_ref, *buf_rnd;
+
+
+int main(int argc, char **argv)
+{
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+
+	if(!(buf_a = malloc(BUF_SZ)) || !(buf_b = malloc(BUF_SZ)) || !(buf_ref = malloc(BUF_SZ)) ||
+			!(buf_rnd = malloc(BUF_SZ))) {
+		fail("failed to allocate buffers\n");
+	}
+
+	check();
+
+	printf("%-10s %8s %12s %12s %8s\n", "function", "size", "old MB/s", "new MB/s", "speedup");
+	bench(OP_MEMSET, "memset");
+	bench(OP_MEMSET16, "memset16");
+	bench(OP_MEMCPY, "memcpy");
+	bench(OP_MEMMOVE, "memmove");
+	bench(OP_STRLEN, "strlen");
+	bench(OP_STRCHR, "strchr");
+	bench(OP_STRCMP, "strcmp");
+	return 0;
+}
+
+/* compare the results of the kernel functions with the C library */
+void check(void)
+{
+	int i, j, n, offs, soffs, c, res, ref;
+	char *s, *sref;
+
+	srand(0);
+	for(i=0; i<BUF_SZ; i++) {
+		buf_rnd[i] = rand();
+	}
+
+	for(i=0; i<num_checks; i++) {
+		n = rand() % (rand() & 1 ? 64 : 8192);
+		offs = rand() % 64;
+		soffs = rand() % 64;
+		c = rand();
+
+		memcpy(buf_a, buf_rnd + rand() % (BUF_SZ - CHECK_SZ), CHECK_SZ);
+		memcpy(buf_ref, buf_a, CHECK_SZ);
+		memcpy(buf_b, buf_rnd + rand() % (BUF_SZ - CHECK_SZ), CHECK_SZ);
+
+		switch(i % 5) {
+		case 0:
+			k_memset(buf_a + offs, c, n);
+			memset(buf_ref + offs, c, n);
+			break;
+
+		case 1:
+			k_memset16(buf_a + offs, c, n / 2);
+			for(j=0; j<n / 2; j++) {
+				memcpy(buf_ref + offs + j * 2, &(short){c}, 2);
+			}
+			break;
+
+		case 2:
+			k_memcpy(buf_a + offs, buf_b + soffs, n);
+			memcpy(buf_ref + offs, buf_b + soffs, n);
+			break;
+
+		case 3:
+			/* overlapping both ways */
+			k_memmove(buf_a + offs, buf_a + soffs, n);
+			memmove(buf_ref + offs, buf_ref + soffs, n);
+			break;
+
+		case 4:
+			s = buf_a + offs;
+			sref = buf_ref + soffs;
+			for(j=0; j<n; j++) {
+				s[j] = sref[j] = (rand() % 255) + 1;
+			}
+			s[n] = sref[n] = 0;
+			if(n && rand() & 1) {
+				/* differ somewhere, or end early */
+				j = rand() % n;
+				sref[j] = rand() & 1 ? 0 : s[j] + 1;
+			}
+
+			if(k_strlen(s) != strlen(s)) {
+				fail("strlen(%d, offs %d): %u, should be %u\n", n, offs,
+						(unsigned int)k_strlen(s), (unsigned int)strlen(s));
+			}
+			c = rand() & 1 ? (rand() % 255) + 1 : 0;
+			if(k_strchr(s, c) != strchr(s, c)) {
+				fail("strchr(%d, offs %d, %d): wrong match\n", n, offs, c);
+			}
+			/* the C library compares unsigned chars, we compare plain chars */
+			res = sign(k_strcmp(s, sref));
+			ref = sign(old_strcmp(s, sref));
+			if(res != ref) {
+				fail("strcmp(%d, offs %d/%d): %d, should be %d\n", n, offs, soffs, res, ref);
+			}
+			continue;
+		}
+
+		if(memcmp(buf_a, buf_ref, CHECK_SZ) != 0) {
+			fail("check %d failed (n: %d, offs: %d, src offs: %d)\n", i % 5, n, offs, soffs);
+		}
+	}
+	printf("%d random checks passed\n\n", num_checks);
+}
+
+void bench(int op, const char *name)
+{
+	int i, size;
+	long iter;
+	double told, tnew;
+
+	for(i=0; i<NUM_SIZES; i++) {
+		size = sizes[i];
+		iter = bench_bytes / size;
+
+		told = run(&oldfuncs, op, size, iter);
+		tnew = run(&kfuncs, op, size, iter);
+
+		printf("%-10s %8d %12.1f %12.1f %7.1fx\n", name, size,
+				bench_bytes / told / 1048576.0, bench_bytes / tnew / 1048576.0, told / tnew);
+	}
+}
+
+/* time iter calls of one of the functions on size bytes */
+double run(struct funcs *f, int op, int size, long iter)
+{
+	long i;
+	double start;
+	volatile long sink = 0;
+
+	memset(buf_a, 'x', size);
+	buf_a[size] = 0;
+	memcpy(buf_b, buf_a, size + 1);
+	buf_b[size - 1] = 'y';
+
+	start = get_time();
+	for(i=0; i<iter; i++) {
+		switch(op) {
+		case OP_MEMSET:
+			f->memset(buf_a, i, size);
+			break;
+		case OP_MEMSET16:
+			f->memset16(buf_a, i, size / 2);
+			break;
+		case OP_MEMCPY:
+			f->memcpy(buf_b, buf_a, size);
+			break;
+		case OP_MEMMOVE:
+			/* overlapping, backwards */
+			f->memmove(buf_a + 4, buf_a, size);
+			break;
+		case OP_STRLEN:
+			sink += f->strlen(buf_b);
+			break;
+		case OP_STRCHR:
+			sink += (long)f->strchr(buf_b, 'y');
+			break;
+		case OP_STRCMP:
+			sink += f->strcmp(buf_a, buf_b);
+			break;
+		}
+	}
+	return get_time() - start;
+}
+
+double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int sign(int x)
+{
+	return x < 0 ? -1 : (x > 0 ? 1 : 0);
+}
+
+void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+int parse_args(int argc, char **argv)
+{
+	int i;
+	long val;
+	char *endp;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && argv[i][2] == 0) {
+			if(argv[i][1] == 'h') {
+				printf("usage: %s [options]\n", argv[0]);
+				printf("options:\n");
+				printf(" -m <n>  megabytes processed by each measurement (default: %ld)\n",
+						bench_bytes / 1048576);
+				printf(" -c <n>  number of random correctness checks (default: %d)\n", num_checks);
+				exit(0);
+			}
+			if(!argv[++i] || (val = strtol(argv[i], &endp, 10)) < 0 || *endp) {
+				fprintf(stderr, "%s must be followed by a number\n", argv[i - 1]);
+				return -1;
+			}
+
+			switch(argv[i - 1][1]) {
+			case 'm':
+				bench_bytes = val * 1048576;
+				if(val <= 0) {
+					fprintf(stderr, "invalid size: %ld\n", val);
+					return -1;
+				}
+				break;
+			case 'c':
+				num_checks = val;
+				break;
+			default:
+				fprintf(stderr, "invalid option: %s\n", argv[i - 1]);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -42,6 +42,11 @@
 #define ENOSPC			10
 #define EPERM			11
 #define ENOTDIR			12
+#define EBADF			13
+#define EEXIST			14
+#define ENOTEMPTY		15
+#define EFAULT			16
+#define E2BIG			17
 
 #define EBUG		127	/* for missing features and known bugs */
 #endif	/* errno.h */
@@ -66,9 +71,17 @@
 #define SYS_READ		11
 #define SYS_WRITE		12
 #define SYS_LSEEK		13
+#define SYS_COPY_FILE_RANGE	14
+#define SYS_FALLOCATE	15
+#define SYS_VFORK		16
+#define SYS_SPAWN		17
+#define SYS_BRK			18
+#define SYS_SBRK		19
+#define SYS_MMAP		20
+#define SYS_MUNMAP		21
 
 /* keep this one more than the last syscall */
-#define NUM_SYSCALLS	14
+#define NUM_SYSCALLS	22
 
 #endif	/* syscall.h */
 
@@ -103,5 +116,23 @@
 
 #endif	/* sys/stat.h */
 
+/* --- defines for sys/mman.h */
+#if defined(KERNEL) || defined(KDEF_MMAN_H)
+
+#define PROT_NONE		0
+#define PROT_READ		1
+#define PROT_WRITE		2
+#define PROT_EXEC		4
+
+#define MAP_SHARED		0x01
+#define MAP_PRIVATE		0x02
+#define MAP_FIXED		0x10
+#define MAP_ANONYMOUS	0x20
+#define MAP_ANON		MAP_ANONYMOUS
+
+#define MAP_FAILED		((void*)-1)
+
+#endif	/* sys/mman.h */
+
 
 #endif	/* KERNEL_DEFS_H_ */
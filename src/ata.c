@@ -53,7 +53,7 @@ struct device {
 };
 
 
-static int readwrite_pio(int devno, uint64_t sect, void *buf, void (*rwdata)(struct device*, void*));
+static int readwrite_pio(int devno, uint64_t sect, int count, void *buf, void (*rwdata)(struct device*, void*));
 static int identify(struct device *dev, int iface, int id);
 static void select_dev(struct device *dev);
 static int wait_busy(struct device *dev);
@@ -69,6 +69,9 @@ static void *atastr(void *res, void *src, int n);
 static char *size_str(uint64_t nsect, char *buf);
 static void print_error(int devid, int wr, uint32_t high, uint32_t low, unsigned char err);
 
+/* base address of the two ATA interfaces */
+static const int port_base[] = {0x1f0, 0x170};
+
 /* last drive selected on each bus */
 static int drvsel[2] = {-1, -1};
 
@@ -92,6 +95,7 @@ void init_ata(void)
 {
 	int i;
 
+	interrupt(IRQ_TO_INTR(14), ata_intr);
 	interrupt(IRQ_TO_INTR(15), ata_intr);
 
 	ndev = 0;
@@ -122,17 +126,28 @@ uint64_t ata_num_sectors(int devno)
 
 int ata_read_pio(int devno, uint64_t sect, void *buf)
 {
-	return readwrite_pio(devno, sect, buf, read_data);
+	return readwrite_pio(devno, sect, 1, buf, read_data);
+}
+
+/* read count consecutive sectors (at most ATA_MAX_MULTI) with a single command */
+int ata_read_pio_multi(int devno, uint64_t sect, int count, void *buf)
+{
+	if(count < 1 || count > ATA_MAX_MULTI) {
+		return -1;
+	}
+	return readwrite_pio(devno, sect, count, buf, read_data);
 }
 
 int ata_write_pio(int devno, uint64_t sect, void *buf)
 {
-	return readwrite_pio(devno, sect, buf, write_data);
+	return readwrite_pio(devno, sect, 1, buf, write_data);
 }
 
-static int readwrite_pio(int devno, uint64_t sect, void *buf, void (*rwdata)(struct device*, void*))
+static int readwrite_pio(int devno, uint64_t sect, int count, void *buf, void (*rwdata)(struct device*, void*))
 {
-	int use_irq, cmd, st, res = -1;
+	int i, use_irq, cmd, st, istate, res = -1;
+	int wr = rwdata == write_data;
+	char *ptr = buf;
 	uint32_t sect_low, sect_high;
 	struct device *dev = devices + devno;
 
@@ -156,19 +171,19 @@ static int readwrite_pio(int devno, uint64_t sect, void *buf, void (*rwdata)(str
 		if(sect >= dev->nsect_lba48) {
 			goto end;
 		}
-		cmd = CMD_READ48;
+		cmd = wr ? CMD_WRITE48 : CMD_READ48;
 
 		write_reg8(dev, REG_COUNT, 0);
 		write_reg8(dev, REG_LBA0, sect_high & 0xff);
 		write_reg8(dev, REG_LBA1, (sect_high >> 8) & 0xff);
 		write_reg8(dev, REG_LBA2, (sect_high >> 16) & 0xff);
 	} else {
-		cmd = CMD_READ;
+		cmd = wr ? CMD_WRITE : CMD_READ;
 		sect_high = 0;
 		sect_low = (uint32_t)sect & 0xfffffff;
 	}
 
-	write_reg8(dev, REG_COUNT, 1);
+	write_reg8(dev, REG_COUNT, count);
 	write_reg8(dev, REG_LBA0, sect_low & 0xff);
 	write_reg8(dev, REG_LBA1, (sect_low >> 8) & 0xff);
 	write_reg8(dev, REG_LBA2, (sect_low >> 16) & 0xff);
@@ -176,25 +191,45 @@ static int readwrite_pio(int devno, uint64_t sect, void *buf, void (*rwdata)(str
 	/* execute */
 	write_reg8(dev, REG_CMD, cmd);
 
-	/* wait for the data to become available */
-	do {
-		if(use_irq) {
-			/* also sleep on the mutex if we're called from userspace */
-			wait(&pending);
+	/* wait for the drive to be ready for the data transfer. When reading, it
+	 * interrupts once the data is available, and if we're called from a
+	 * process, we sleep until then (see ata_intr). When writing, it asks for
+	 * the first sector without an interrupt, so there's nothing to sleep on.
+	 */
+	istate = get_intr_state();
+	while(((st = read_reg8(dev, REG_ALTSTAT)) & (ST_DRQ | ST_ERR)) == 0) {
+		if(use_irq && !wr) {
+			/* don't miss the interrupt between checking and sleeping */
+			disable_intr();
+			if(!(read_reg8(dev, REG_ALTSTAT) & (ST_DRQ | ST_ERR))) {
+				wait(&pending);
+			}
 		}
-	} while(((st = read_reg8(dev, REG_ALTSTAT)) & (ST_DRQ | ST_ERR)) == 0);
+	}
+	set_intr_state(istate);
 
 	if(st & ST_ERR) {
 		//print_error(int devid, int wr, uint32_t high, uint32_t low, unsigned char err);
 		unsigned char err;
 
 		err = read_reg8(dev, REG_ERROR);
-		print_error(devno, 0, sect_high, sect_low, err);
+		print_error(devno, wr, sect_high, sect_low, err);
 		goto end;
 	}
 
 	/* read/write the data and we're done */
-	rwdata(dev, buf);
+	for(i=0; i<count; i++) {
+		if(i > 0) {
+			/* give the drive time to raise BSY before polling for the next sector */
+			iodelay(); iodelay(); iodelay(); iodelay();
+			if(wait_busy(dev) == -1) {
+				print_error(devno, wr, sect_high, sect_low + i, read_reg8(dev, REG_ERROR));
+				goto end;
+			}
+		}
+		rwdata(dev, ptr);
+		ptr += 512;
+	}
 	res = 0;
 end:
 	if(use_irq) {
@@ -205,8 +240,6 @@ end:
 
 static int identify(struct device *dev, int iface, int id)
 {
-	/* base address of the two ATA interfaces */
-	static const int port_base[] = {0x1f0, 0x170};
 	unsigned char st;
 	uint16_t *info;
 	char textbuf[42];	/* at most we need 40 chars for ident strings */
@@ -353,9 +386,17 @@ static inline void write_reg16(struct device *dev, int reg, uint16_t val)
 	outw(val, dev->port_base + reg);
 }
 
+/* the primary interface interrupts on IRQ 14, the secondary on 15 */
 static void ata_intr(int inum)
 {
-	printf("ATA interrupt\n");
+	unsigned char st;
+	int iface = INTR_TO_IRQ(inum) - 14;
+
+	/* reading the status register acknowledges the interrupt */
+	inb(st, port_base[iface] + REG_STATUS);
+
+	/* wake up the process waiting for its data in readwrite_pio */
+	wakeup(&pending);
 }
 
 static void *atastr(void *res, void *src, int n)
@@ -6,7 +6,11 @@ void init_ata(void);
 int ata_num_devices(void);
 uint64_t ata_num_sectors(int devno);
 
+/* maximum sector count for ata_read_pio_multi */
+#define ATA_MAX_MULTI	128
+
 int ata_read_pio(int devno, uint64_t sect, void *buf);
+int ata_read_pio_multi(int devno, uint64_t sect, int count, void *buf);
 int ata_write_pio(int devno, uint64_t sect, void *buf);
 
 #endif	/* ATA_H_ */
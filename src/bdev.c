@@ -4,6 +4,7 @@
 #include "bdev.h"
 #include "ata.h"
 #include "part.h"
+#include "config.h"
 
 #define MKMINOR(disk, part)	((((disk) & 0xf) << 4) | ((part) & 0xf))
 #define MINOR_DISK(x)		(((x) >> 4) & 0xf)
@@ -58,18 +59,58 @@ void blk_close(struct block_device *bdev)
 }
 
 #define NSECT	(BLKSZ / 512)
+/* maximum number of blocks transfered by a single ATA command */
+#define MAX_RUN	(ATA_MAX_MULTI / NSECT)
+
+/* Cache of blocks brought in ahead of time by blk_prefetch. Blocks are
+ * identified by ATA device and starting sector, so that different block
+ * devices (partitions) on the same disk share it. blk_read checks it before
+ * going to the disk, and blk_write keeps it up to date. Replacement is FIFO.
+ */
+#define BCACHE_HASH_SIZE	61
+
+struct bcache_ent {
+	int ata_dev;	/* -1 if unused */
+	uint32_t sect;
+	char *data;
+	struct bcache_ent *hnext;
+};
+
+static struct bcache_ent *bcache_find(int ata_dev, uint32_t sect);
+static struct bcache_ent *bcache_add(int ata_dev, uint32_t sect);
+static int read_run(struct block_device *bdev, uint32_t sect, int count, void *buf);
+
+static struct bcache_ent *bcache;
+static struct bcache_ent *bcache_htab[BCACHE_HASH_SIZE];
+static int bcache_next;
+
+#define BCACHE_HASH(dev, sect)	(((sect) / NSECT + (dev)) % BCACHE_HASH_SIZE)
+
 
 int blk_read(struct block_device *bdev, uint32_t blk, int count, void *buf)
 {
-	int i;
+	int i, run;
 	char *ptr = buf;
 	uint32_t sect = blk * NSECT + bdev->offset;
+	struct bcache_ent *ent;
 
-	for(i=0; i<NSECT * count; i++) {
-		if(ata_read_pio(bdev->ata_dev, sect++, ptr) == -1) {
-			return -1;
+	for(i=0; i<count; i+=run) {
+		if((ent = bcache_find(bdev->ata_dev, sect))) {
+			memcpy(ptr, ent->data, BLKSZ);
+			run = 1;
+		} else {
+			/* read the whole run of blocks missing from the cache in one go */
+			run = 1;
+			while(i + run < count && run < MAX_RUN &&
+					!bcache_find(bdev->ata_dev, sect + run * NSECT)) {
+				run++;
+			}
+			if(read_run(bdev, sect, run, ptr) == -1) {
+				return -1;
+			}
 		}
-		ptr += 512;
+		ptr += run * BLKSZ;
+		sect += run * NSECT;
 	}
 	return 0;
 }
@@ -79,8 +120,14 @@ int blk_write(struct block_device *bdev, uint32_t blk, int count, void *buf)
 	int i;
 	char *ptr = buf;
 	uint32_t sect = blk * NSECT + bdev->offset;
+	struct bcache_ent *ent;
 
 	for(i=0; i<NSECT * count; i++) {
+		/* keep any cached copy of this block in sync */
+		if(i % NSECT == 0 && (ent = bcache_find(bdev->ata_dev, sect))) {
+			memcpy(ent->data, ptr, BLKSZ);
+		}
+
 		if(ata_write_pio(bdev->ata_dev, sect++, ptr) == -1) {
 			return -1;
 		}
@@ -89,6 +136,128 @@ int blk_write(struct block_device *bdev, uint32_t blk, int count, void *buf)
 	return 0;
 }
 
+/* bring count blocks starting at blk into the cache, ahead of them being
+ * requested with blk_read. Blocks already in the cache are skipped, and every
+ * run of missing blocks is read with a single ATA command.
+ * returns the number of blocks actually read.
+ */
+int blk_prefetch(struct block_device *bdev, uint32_t blk, int count)
+{
+	int i, j, run, res = 0;
+	uint32_t sect = blk * NSECT + bdev->offset;
+	char *buf;
+
+	if(count > BCACHE_SIZE) {
+		count = BCACHE_SIZE;
+	}
+	if(!(buf = malloc(MAX_RUN * BLKSZ))) {
+		return 0;
+	}
+
+	for(i=0; i<count; i+=run) {
+		if(bcache_find(bdev->ata_dev, sect)) {
+			run = 1;
+		} else {
+			run = 1;
+			while(i + run < count && run < MAX_RUN &&
+					!bcache_find(bdev->ata_dev, sect + run * NSECT)) {
+				run++;
+			}
+			if(read_run(bdev, sect, run, buf) == -1) {
+				break;
+			}
+
+			for(j=0; j<run; j++) {
+				struct bcache_ent *ent = bcache_add(bdev->ata_dev, sect + j * NSECT);
+				if(!ent) goto end;
+				memcpy(ent->data, buf + j * BLKSZ, BLKSZ);
+			}
+			res += run;
+		}
+		sect += run * NSECT;
+	}
+end:
+	free(buf);
+	return res;
+}
+
+static int read_run(struct block_device *bdev, uint32_t sect, int count, void *buf)
+{
+	return ata_read_pio_multi(bdev->ata_dev, sect, count * NSECT, buf);
+}
+
+static struct bcache_ent *bcache_find(int ata_dev, uint32_t sect)
+{
+	struct bcache_ent *ent;
+
+	if(!bcache) {
+		return 0;
+	}
+
+	ent = bcache_htab[BCACHE_HASH(ata_dev, sect)];
+	while(ent) {
+		if(ent->ata_dev == ata_dev && ent->sect == sect) {
+			return ent;
+		}
+		ent = ent->hnext;
+	}
+	return 0;
+}
+
+/* grab the next cache entry in FIFO order, and give it a new identity.
+ * If the block is already in the cache (someone else read it while we were
+ * waiting for the disk), the existing entry is returned instead.
+ */
+static struct bcache_ent *bcache_add(int ata_dev, uint32_t sect)
+{
+	int i;
+	struct bcache_ent *ent, dummy, *prev;
+
+	if((ent = bcache_find(ata_dev, sect))) {
+		return ent;
+	}
+
+	if(!bcache) {
+		if(!(bcache = malloc(BCACHE_SIZE * sizeof *bcache))) {
+			return 0;
+		}
+		for(i=0; i<BCACHE_SIZE; i++) {
+			if(!(bcache[i].data = malloc(BLKSZ))) {
+				while(--i >= 0) free(bcache[i].data);
+				free(bcache);
+				bcache = 0;
+				return 0;
+			}
+			bcache[i].ata_dev = -1;
+		}
+	}
+
+	ent = bcache + bcache_next;
+	bcache_next = (bcache_next + 1) % BCACHE_SIZE;
+
+	if(ent->ata_dev != -1) {
+		/* evict it, unlink from its hash chain */
+		int idx = BCACHE_HASH(ent->ata_dev, ent->sect);
+
+		dummy.hnext = bcache_htab[idx];
+		prev = &dummy;
+		while(prev->hnext) {
+			if(prev->hnext == ent) {
+				prev->hnext = ent->hnext;
+				break;
+			}
+			prev = prev->hnext;
+		}
+		bcache_htab[idx] = dummy.hnext;
+	}
+
+	ent->ata_dev = ata_dev;
+	ent->sect = sect;
+	ent->hnext = bcache_htab[BCACHE_HASH(ata_dev, sect)];
+	bcache_htab[BCACHE_HASH(ata_dev, sect)] = ent;
+	return ent;
+}
+
 dev_t bdev_by_name(const char *name)
 {
 	int minor;
@@ -3,7 +3,7 @@
 
 #include "fs.h"	/* for dev_t */
 
-/* TODO buffer cache */
+/* TODO buffer cache (for now only read-ahead blocks are cached, see bdev.c) */
 
 struct block_device {
 	int ata_dev;
@@ -22,6 +22,8 @@ void blk_close(struct block_device *bdev);
 int blk_read(struct block_device *bdev, uint32_t blk, int count, void *buf);
 int blk_write(struct block_device *bdev, uint32_t blk, int count, void *buf);
 
+int blk_prefetch(struct block_device *bdev, uint32_t blk, int count);
+
 dev_t bdev_by_name(const char *name);
 
 #endif	/* BDEV_H_ */
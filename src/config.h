@@ -10,7 +10,38 @@
 /* allow automatic user stack growth by at most 1024 pages at a time (4mb) */
 #define USTACK_MAXGROW		1024
 
+/* largest executable image accepted by spawn (1mb), which is copied to
+ * kernel memory before the new process starts
+ */
+#define SPAWN_MAX_SIZE		(1024 * 1024)
+
 /* per-process kernel stack size (2 pages) */
 #define KERN_STACK_SIZE		8192
 
+/* number of blocks in the block device read-ahead cache */
+#define BCACHE_SIZE			64
+
+/* sequential read-ahead window size limits (in filesystem blocks) */
+#define READAHEAD_MIN		4
+#define READAHEAD_MAX		32
+
+/* maximum number of pages a tmpfs can use for file data (4mb) */
+#define TMPFS_MAX_PAGES		1024
+
+/* bounce buffer size for copying between different filesystems */
+#define COPY_BUF_SIZE		4096
+
+/* physical memory beyond this is ignored (64gb, the limit of the first PAE
+ * processors). Each page costs a struct page in the frame database.
+ */
+#define MAX_PHYS_PAGES		(16 * 1024 * 1024)
+
+/* number of pre-zeroed physical pages kept by the idle loop */
+#define ZERO_POOL_SIZE		64
+
+/* number of pages paged out at a time when we run out of memory, and maximum
+ * number of pages read back in with a single swap request
+ */
+#define SWAP_CLUSTER		8
+
 #endif	/* _CONFIG_H_ */
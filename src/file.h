@@ -4,8 +4,14 @@
 #include "fs.h"
 
 struct file {
+	struct filesys *fs;
 	struct inode *inode;
 	long ptr;
+
+	/* sequential read-ahead state, in file blocks (see sys_read) */
+	int ra_next;	/* block a sequential reader would read next */
+	int ra_start;	/* start of the last read-ahead window */
+	int ra_size;	/* size of the last read-ahead window, 0 if not sequential */
 };
 
 #endif	/* FILE_H_ */
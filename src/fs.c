@@ -11,14 +11,21 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 #include "fs.h"
 #include "bdev.h"
+#include "panic.h"
 #include "kdef.h"
 
 /* number of inodes in a block */
 #define BLK_INODES		(BLKSZ / sizeof(struct inode))
 /* number of directory entries in a block */
 #define BLK_DIRENT		(BLKSZ / sizeof(struct dir_entry))
+/* number of block numbers in an indirect block */
+#define BLK_BLKID		(BLKSZ / sizeof(blkid))
+/* first file block past the indirect, and double-indirect blocks */
+#define MAX_IND			(NDIRBLK + BLK_BLKID)
+#define MAX_DIND		(MAX_IND + BLK_BLKID * BLK_BLKID)
 
 #define BLKBITS				(BLKSZ * 8)
 
@@ -32,15 +39,27 @@
 
 static struct inode *newdir(struct filesys *fs, struct inode *parent);
 static int addlink(struct filesys *fs, struct inode *target, struct inode *node, const char *name);
+static int find_dirent(struct filesys *fs, struct inode *dir, const char *name, blkid *bnoptr, struct dir_entry *data);
+static int is_empty_dir(struct filesys *fs, struct inode *dir);
+static void free_file_blocks(struct filesys *fs, struct inode *node);
 static int read_superblock(struct filesys *fs);
 static int write_superblock(struct filesys *fs);
-static int get_inode(struct filesys *fs, int ino, struct inode *inode);
-static int put_inode(struct filesys *fs, struct inode *inode);
 static int find_free(uint32_t *bm, int sz);
+static int find_free_run(uint32_t *bm, int nbits, int count, int *len);
+static void bm_set_range(uint32_t *bm, int start, int count);
+static struct bitmap *bm_create(blkid start, unsigned int count, unsigned int nbits, unsigned int nfree);
+static void bm_free_bitmap(struct bitmap *bm);
+static uint32_t *bm_load(struct filesys *fs, struct bitmap *bm, int g);
+static int bm_sync(struct filesys *fs, struct bitmap *bm);
+static int bm_alloc(struct filesys *fs, struct bitmap *bm);
+static int bm_alloc_run(struct filesys *fs, struct bitmap *bm, int count, int *len);
+static void bm_mark_used(struct filesys *fs, struct bitmap *bm, int start, int count);
+static void bm_free(struct filesys *fs, struct bitmap *bm, int x);
 static int alloc_inode(struct filesys *fs);
-#define free_inode(fs, ino)		BM_CLR((fs)->sb->ibm, (ino))
+#define free_inode(fs, ino)		bm_free((fs), (fs)->sb->ibm, (ino))
 static int alloc_block(struct filesys *fs);
-#define free_block(fs, bno)		BM_CLR((fs)->sb->bm, (bno))
+#define free_block(fs, bno)		bm_free((fs), (fs)->sb->bm, (bno))
+static int alloc_blocks(struct filesys *fs, int count, int *len);
 #define zero_block(fs, bno) \
 	do { \
 		assert(bno > 0); \
@@ -50,7 +69,36 @@ static int alloc_block(struct filesys *fs);
 static int file_block(struct filesys *fs, struct inode *node, int boffs, int allocate);
 #define get_file_block(fs, node, boffs)		file_block(fs, node, boffs, 0)
 #define alloc_file_block(fs, node, boffs)	file_block(fs, node, boffs, 1)
+static int map_blocks_rsv(struct filesys *fs, struct inode *node, int boffs, int count, blkid *blist,
+		uint32_t *alloc_mask, int *rsv, int *rsv_len);
+#define map_blocks(fs, node, boffs, count, blist, alloc_mask) \
+	map_blocks_rsv(fs, node, boffs, count, blist, alloc_mask, 0, 0)
+static int alloc_rsv_block(struct filesys *fs, int *rsv, int *rsv_len);
+static int missing_ind_blocks(struct filesys *fs, struct inode *node, int boffs, int count);
+static int prealloc_blocks(struct filesys *fs, struct inode *node, int boffs, int count);
+static void zero_gap(struct filesys *fs, struct inode *node, long offs);
+static int mapped_blocks(struct filesys *fs, struct inode *node);
+static blkid *get_block_list(struct filesys *fs, struct inode *node, int nblk);
+static void count_extents(blkid *blist, int nblk, struct frag_info *fi);
+static int relocate(struct filesys *fs, struct inode *node, int nblk, blkid *blist, char *data, int max_extents);
+
+/* maximum number of blocks moved with a single blk_read/blk_write call by the
+ * file data functions (must not exceed 32, see map_blocks).
+ */
+#define RUN_MAX		32
+
 
+struct fs_operations diskfs_ops = {
+	closefs,
+	get_inode,
+	put_inode,
+	lookup,
+	create_file,
+	unlink_file,
+	read_file,
+	write_file,
+	prealloc_file
+};
 
 int openfs(struct filesys *fs, dev_t dev)
 {
@@ -77,16 +125,33 @@ int openfs(struct filesys *fs, dev_t dev)
 	/* allocate the zero-block buffer written to zero-out blocks */
 	if(!(fs->zeroblock = malloc(fs->sb->blksize))) {
 		blk_close(bdev);
-		free(fs->sb->ibm);
-		free(fs->sb->bm);
+		bm_free_bitmap(fs->sb->ibm);
+		bm_free_bitmap(fs->sb->bm);
 		free(fs->sb->root);
 		return -ENOMEM;
 	}
-	memset(fs->zeroblock, 0xff, fs->sb->blksize);
+	memset(fs->zeroblock, 0, fs->sb->blksize);
 
+	fs->fsop = &diskfs_ops;
+	fs->root_ino = fs->sb->root_ino;
+	fs->data = 0;
 	return 0;
 }
 
+/* write back everything and release the filesystem */
+void closefs(struct filesys *fs)
+{
+	if(write_superblock(fs) == -1) {
+		printf("closefs: failed to write back the superblock\n");
+	}
+	bm_free_bitmap(fs->sb->ibm);
+	bm_free_bitmap(fs->sb->bm);
+	free(fs->sb->root);
+	free(fs->sb);
+	free(fs->zeroblock);
+	blk_close(fs->bdev);
+}
+
 int mkfs(struct filesys *fs, dev_t dev)
 {
 	struct superblock *sb;
@@ -104,6 +169,13 @@ int mkfs(struct filesys *fs, dev_t dev)
 	}
 	fs->sb = sb;
 
+	if(!(fs->zeroblock = malloc(BLKSZ))) {
+		blk_close(bdev);
+		free(sb);
+		return -1;
+	}
+	memset(fs->zeroblock, 0, BLKSZ);
+
 	/* populate the superblock */
 	sb->magic = MAGIC;
 	sb->ver = FS_VER;
@@ -115,40 +187,49 @@ int mkfs(struct filesys *fs, dev_t dev)
 	/* inode bitmap just after the superblock */
 	sb->ibm_start = 2;
 	sb->ibm_count = (sb->num_inodes + BLKBITS - 1) / BLKBITS;
-	/* also allocate and initialize in-memory inode bitmap */
-	sb->ibm = malloc(sb->ibm_count * BLKSZ);
+	/* also create the in-memory inode bitmap */
+	sb->free_inodes = sb->num_inodes;
+	sb->ibm = bm_create(sb->ibm_start, sb->ibm_count, sb->num_inodes, sb->free_inodes);
 	assert(sb->ibm);
-	memset(sb->ibm, 0, sb->ibm_count * BLKSZ);
-
-	/* XXX mark inode 0 as used always */
-	BM_SET(sb->ibm, 0);
 
 	/* block bitmap just after the inode bitmap */
 	sb->bm_start = sb->ibm_start + sb->ibm_count;
 	sb->bm_count = (sb->num_blocks + BLKBITS - 1) / BLKBITS;
-	/* also allocate and initialize in-memory block bitmap */
-	sb->bm = malloc(sb->bm_count * BLKSZ);
+	/* also create the in-memory block bitmap */
+	sb->free_blocks = sb->num_blocks;
+	sb->bm = bm_create(sb->bm_start, sb->bm_count, sb->num_blocks, sb->free_blocks);
 	assert(sb->bm);
-	memset(sb->bm, 0, sb->bm_count * BLKSZ);
 
 	/* inode table, just after the block bitmap */
 	sb->itbl_start = sb->bm_start + sb->bm_count;
 	sb->itbl_count = (sb->num_inodes * sizeof(struct inode) + BLKSZ - 1) / BLKSZ;
 
+	/* clear both bitmaps on disk, their blocks are loaded from there on demand */
+	for(i=0; i<sb->ibm_count + sb->bm_count; i++) {
+		zero_block(fs, sb->ibm_start + i);
+	}
+
+	/* XXX mark inode 0 as used always */
+	bm_mark_used(fs, sb->ibm, 0, 1);
+
 	/* mark all used blocks as used */
 	bcount = sb->itbl_start + sb->itbl_count;
-	memset(sb->bm, 0xff, bcount / 8);
-	for(i=0; i<bcount % 8; i++) {
-		int bit = bcount / 8 + i;
-		BM_SET(sb->bm, bit);
-	}
+	bm_mark_used(fs, sb->bm, 0, bcount);
 
 	/* create the root directory */
 	sb->root = newdir(fs, 0);
+	assert(sb->root);
 	sb->root_ino = sb->root->ino;
+	fs->fsop = &diskfs_ops;
+	fs->root_ino = sb->root_ino;
+	fs->data = 0;
 	/* and write the inode to disk */
 	put_inode(fs, sb->root);
 
+	/* write out the superblock and the parts of the bitmaps we touched */
+	if(write_superblock(fs) == -1) {
+		return -1;
+	}
 	return 0;
 }
 
@@ -169,9 +250,14 @@ static struct inode *newdir(struct filesys *fs, struct inode *parent)
 	}
 	dirnode->mode = S_IFDIR;
 
-	/* add . and .. links */
-	addlink(fs, dirnode, dirnode, ".");
-	addlink(fs, dirnode, parent ? parent : dirnode, "..");
+	/* add . and .. links. If ".." fails, the parent's link count is untouched */
+	if(addlink(fs, dirnode, dirnode, ".") != 0 ||
+			addlink(fs, dirnode, parent ? parent : dirnode, "..") != 0) {
+		free_file_blocks(fs, dirnode);
+		free_inode(fs, dirnode->ino);
+		free(dirnode);
+		return 0;
+	}
 
 	return dirnode;
 }
@@ -181,13 +267,13 @@ static int addlink(struct filesys *fs, struct inode *target, struct inode *node,
 	struct dir_entry ent, *data;
 	int i, boffs, bidx, len;
 
+	/* hard links to directories are not allowed, except for the "." and ".."
+	 * links created by newdir. addlink is only called by newdir and
+	 * create_file, which checks that the link does not already exist.
+	 */
 	if(!(target->mode & S_IFDIR)) {
 		return -ENOTDIR;
 	}
-	if(node->mode & S_IFDIR) {
-		return -EPERM;
-	}
-	/* TODO check that the link does not already exist (EEXIST) */
 
 	if((len = strlen(name)) > NAME_MAX) {
 		return -ENAMETOOLONG;
@@ -224,6 +310,7 @@ static int addlink(struct filesys *fs, struct inode *target, struct inode *node,
 	/* zero-fill the new block and add the first entry */
 	memset(data, 0, BLKSZ);
 	*data = ent;
+	target->size = (boffs + 1) * BLKSZ;
 
 success:
 	/* write to disk */
@@ -234,6 +321,230 @@ success:
 	return 0;
 }
 
+/* search the directory for an entry called name, and return its index in the
+ * directory block, which is left in data, with its block number in *bnoptr.
+ * returns -1 if it's not there.
+ */
+static int find_dirent(struct filesys *fs, struct inode *dir, const char *name, blkid *bnoptr, struct dir_entry *data)
+{
+	int i, boffs, bidx;
+
+	boffs = 0;
+	while((bidx = get_file_block(fs, dir, boffs)) > 0) {
+		blk_read(fs->bdev, bidx, 1, data);
+
+		for(i=0; i<BLK_DIRENT; i++) {
+			if(data[i].ino && strcmp(data[i].name, name) == 0) {
+				*bnoptr = bidx;
+				return i;
+			}
+		}
+		boffs++;
+	}
+	return -1;
+}
+
+static int is_empty_dir(struct filesys *fs, struct inode *dir)
+{
+	int i, boffs, bidx;
+	struct dir_entry *data;
+
+	if(!(data = malloc(BLKSZ))) {
+		return 0;
+	}
+
+	boffs = 0;
+	while((bidx = get_file_block(fs, dir, boffs)) > 0) {
+		blk_read(fs->bdev, bidx, 1, data);
+
+		for(i=0; i<BLK_DIRENT; i++) {
+			if(data[i].ino && strcmp(data[i].name, ".") != 0 &&
+					strcmp(data[i].name, "..") != 0) {
+				free(data);
+				return 0;
+			}
+		}
+		boffs++;
+	}
+	free(data);
+	return 1;
+}
+
+/* returns the inode number of the entry called name in directory dir */
+int lookup(struct filesys *fs, struct inode *dir, const char *name)
+{
+	int idx;
+	blkid bno;
+	struct dir_entry *data;
+
+	if(!(dir->mode & S_IFDIR)) {
+		return -ENOTDIR;
+	}
+	if(!(data = malloc(BLKSZ))) {
+		return -ENOMEM;
+	}
+
+	if((idx = find_dirent(fs, dir, name, &bno, data)) == -1) {
+		free(data);
+		return -ENOENT;
+	}
+	idx = data[idx].ino;
+	free(data);
+	return idx;
+}
+
+/* create a new file (or directory if mode has S_IFDIR) called name in
+ * directory dir. The new inode is returned in node. Both inodes are
+ * written to disk.
+ */
+int create_file(struct filesys *fs, struct inode *dir, const char *name, int mode, struct inode *node)
+{
+	int res;
+	struct inode *dirnode;
+
+	if((res = lookup(fs, dir, name)) != -ENOENT) {
+		return res < 0 ? res : -EEXIST;
+	}
+	if(strlen(name) > NAME_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	if(mode & S_IFDIR) {
+		if(!(dirnode = newdir(fs, dir))) {
+			return -ENOSPC;
+		}
+		*node = *dirnode;
+		free(dirnode);
+	} else {
+		memset(node, 0, sizeof *node);
+		if((node->ino = alloc_inode(fs)) == -1) {
+			return -ENOSPC;
+		}
+	}
+	node->mode = mode;
+
+	if((res = addlink(fs, dir, node, name)) != 0) {
+		if(mode & S_IFDIR) {
+			dir->nlink--;	/* the ".." link of the new directory goes away */
+		}
+		free_file_blocks(fs, node);
+		free_inode(fs, node->ino);
+		return res;
+	}
+
+	put_inode(fs, node);
+	put_inode(fs, dir);
+	return 0;
+}
+
+/* remove the entry called name from directory dir. Directories must be empty.
+ * When the last link to an inode is gone, its blocks and the inode itself are
+ * freed.
+ */
+int unlink_file(struct filesys *fs, struct inode *dir, const char *name)
+{
+	int idx;
+	blkid bno;
+	struct dir_entry *data;
+	struct inode node;
+
+	if(!(dir->mode & S_IFDIR)) {
+		return -ENOTDIR;
+	}
+	if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return -EINVAL;
+	}
+	if(!(data = malloc(BLKSZ))) {
+		return -ENOMEM;
+	}
+
+	if((idx = find_dirent(fs, dir, name, &bno, data)) == -1) {
+		free(data);
+		return -ENOENT;
+	}
+	if(get_inode(fs, data[idx].ino, &node) == -1) {
+		free(data);
+		return -EIO;
+	}
+
+	if(node.mode & S_IFDIR) {
+		if(!is_empty_dir(fs, &node)) {
+			free(data);
+			return -ENOTEMPTY;
+		}
+		/* drop the ".." link to the parent, and the "." link to itself */
+		dir->nlink--;
+		put_inode(fs, dir);
+		node.nlink = 1;
+	}
+
+	data[idx].ino = 0;
+	blk_write(fs->bdev, bno, 1, data);
+	free(data);
+
+	if(--node.nlink > 0) {
+		put_inode(fs, &node);
+		return 0;
+	}
+
+	free_file_blocks(fs, &node);
+	free_inode(fs, node.ino);
+
+	idx = node.ino;
+	memset(&node, 0, sizeof node);
+	node.ino = idx;
+	put_inode(fs, &node);
+	return 0;
+}
+
+/* free all the data and indirect blocks of a file */
+static void free_file_blocks(struct filesys *fs, struct inode *node)
+{
+	int i, j;
+	blkid *ind, *dind;
+
+	for(i=0; i<NDIRBLK; i++) {
+		if(node->blk[i]) {
+			free_block(fs, node->blk[i]);
+			node->blk[i] = 0;
+		}
+	}
+
+	if(!node->ind && !node->dind) {
+		return;
+	}
+	ind = malloc(BLKSZ);
+	dind = malloc(BLKSZ);
+	assert(ind && dind);
+
+	if(node->ind) {
+		blk_read(fs->bdev, node->ind, 1, ind);
+		for(i=0; i<BLK_BLKID; i++) {
+			if(ind[i]) free_block(fs, ind[i]);
+		}
+		free_block(fs, node->ind);
+		node->ind = 0;
+	}
+
+	if(node->dind) {
+		blk_read(fs->bdev, node->dind, 1, dind);
+		for(i=0; i<BLK_BLKID; i++) {
+			if(!dind[i]) continue;
+
+			blk_read(fs->bdev, dind[i], 1, ind);
+			for(j=0; j<BLK_BLKID; j++) {
+				if(ind[j]) free_block(fs, ind[j]);
+			}
+			free_block(fs, dind[i]);
+		}
+		free_block(fs, node->dind);
+		node->dind = 0;
+	}
+
+	free(ind);
+	free(dind);
+	node->size = 0;
+}
 
 static int read_superblock(struct filesys *fs)
 {
@@ -257,30 +568,27 @@ static int read_superblock(struct filesys *fs)
 		return -EINVAL;
 	}
 
-	/* allocate and populate in-memory bitmaps */
-	if(!(sb->ibm = malloc(sb->ibm_count * sb->blksize))) {
-		return -ENOMEM;
-	}
-	if(blk_read(fs->bdev, sb->ibm_start, sb->ibm_count, sb->ibm) == -1) {
-		printf("failed to read inode bitmap\n");
-		free(sb->ibm);
-		return -EIO;
+	/* version 1 volumes don't keep free counts, assume the worst, they will
+	 * be corrected as soon as all the bitmap blocks have been seen.
+	 */
+	if(sb->ver < 2) {
+		sb->free_blocks = sb->num_blocks;
+		sb->free_inodes = sb->num_inodes;
 	}
-	if(!(sb->bm = malloc(sb->bm_count * sb->blksize))) {
-		free(sb->ibm);
+
+	/* set up the in-memory bitmaps, bitmap blocks are read on demand */
+	if(!(sb->ibm = bm_create(sb->ibm_start, sb->ibm_count, sb->num_inodes, sb->free_inodes))) {
 		return -ENOMEM;
 	}
-	if(blk_read(fs->bdev, sb->bm_start, sb->bm_count, sb->bm) == -1) {
-		printf("failed to read block bitmap\n");
-		free(sb->ibm);
-		free(sb->bm);
-		return -EIO;
+	if(!(sb->bm = bm_create(sb->bm_start, sb->bm_count, sb->num_blocks, sb->free_blocks))) {
+		bm_free_bitmap(sb->ibm);
+		return -ENOMEM;
 	}
 
 	/* read the root inode */
 	if(!(sb->root = malloc(sizeof *sb->root))) {
-		free(sb->ibm);
-		free(sb->bm);
+		bm_free_bitmap(sb->ibm);
+		bm_free_bitmap(sb->bm);
 		return -ENOMEM;
 	}
 	if(get_inode(fs, sb->root_ino, sb->root) == -1) {
@@ -299,14 +607,13 @@ static int write_superblock(struct filesys *fs)
 	if(put_inode(fs, sb->root) == -1) {
 		return -1;
 	}
-	/* write back the block bitmap */
-	if(blk_write(fs->bdev, sb->bm_start, sb->bm_count, sb->bm) == -1) {
-		return -1;
-	}
-	/* write back the inode bitmap */
-	if(blk_write(fs->bdev, sb->ibm_start, sb->ibm_count, sb->ibm) == -1) {
+	/* write back any modified parts of the block and inode bitmaps */
+	if(bm_sync(fs, sb->bm) == -1 || bm_sync(fs, sb->ibm) == -1) {
 		return -1;
 	}
+	sb->free_blocks = sb->bm->nfree;
+	sb->free_inodes = sb->ibm->nfree;
+
 	/* write the superblock itself */
 	if(blk_write(fs->bdev, 1, 1, sb) == -1) {
 		return -1;
@@ -315,7 +622,7 @@ static int write_superblock(struct filesys *fs)
 }
 
 /* copy the requested inode from the disk, into the buffer passed in the last arg */
-static int get_inode(struct filesys *fs, int ino, struct inode *inode)
+int get_inode(struct filesys *fs, int ino, struct inode *inode)
 {
 	struct inode *buf = malloc(BLKSZ);
 	assert(buf);
@@ -330,7 +637,7 @@ static int get_inode(struct filesys *fs, int ino, struct inode *inode)
 }
 
 /* write the inode to the disk */
-static int put_inode(struct filesys *fs, struct inode *inode)
+int put_inode(struct filesys *fs, struct inode *inode)
 {
 	struct inode *buf = malloc(BLKSZ);
 	assert(buf);
@@ -352,19 +659,17 @@ static int put_inode(struct filesys *fs, struct inode *inode)
 /* find a free element in the bitmap and return its number */
 static int find_free(uint32_t *bm, int nbits)
 {
-	int i, j, nwords = nbits / 32;
+	int i, j, nwords = (nbits + 31) / 32;
 	uint32_t ent = 0;
 
-	for(i=0; i<=nwords; i++) {
+	for(i=0; i<nwords; i++) {
 		if(bm[i] != 0xffffffff) {
-			for(j=0; j<32; j++) {
+			for(j=0; j<32 && ent < nbits; j++) {
 				if(BM_ISFREE(bm, ent)) {
 					return ent;
 				}
 				ent++;
 			}
-
-			panic("shouldn't happen (in find_free:fs.c)");
 		} else {
 			ent += 32;
 		}
@@ -375,125 +680,1426 @@ static int find_free(uint32_t *bm, int nbits)
 
 static int alloc_inode(struct filesys *fs)
 {
-	int ino;
+	return bm_alloc(fs, fs->sb->ibm);
+}
 
-	if((ino = find_free(fs->sb->ibm, fs->sb->num_inodes)) == -1) {
-		return -1;
+/* returns the allocated block number, or 0 if there are no free blocks
+ * (block 0 is the boot block and never free).
+ */
+static int alloc_block(struct filesys *fs)
+{
+	int bno;
+
+	if((bno = bm_alloc(fs, fs->sb->bm)) == -1) {
+		return 0;
 	}
-	BM_SET(fs->sb->ibm, ino);
-	return 0;
+	return bno;
 }
 
-static int alloc_block(struct filesys *fs)
+/* find the first run of count free elements in the bitmap, and return the
+ * number of its first element. If there is no run that long, the longest run
+ * is returned instead. The length of the run (at most count) is returned
+ * through len. Returns -1 if there are no free elements at all.
+ */
+static int find_free_run(uint32_t *bm, int nbits, int count, int *len)
+{
+	int i = 0, start = 0, run = 0;
+	int best = -1, best_len = 0;
+
+	while(i < nbits) {
+		uint32_t word = bm[BM_IDX(i)];
+
+		if(BM_BIT(i) == 0 && (word == 0xffffffff || (word == 0 && i + 32 <= nbits))) {
+			/* whole word full or empty, skip it in one go */
+			if(word) {
+				run = 0;
+			} else {
+				if(!run) start = i;
+				run += 32;
+			}
+			i += 32;
+		} else {
+			if(BM_ISFREE(bm, i)) {
+				if(!run) start = i;
+				run++;
+			} else {
+				run = 0;
+			}
+			i++;
+		}
+
+		if(run >= count) {
+			*len = count;
+			return start;
+		}
+		if(run > best_len) {
+			best = start;
+			best_len = run;
+		}
+	}
+
+	*len = best_len;
+	return best;
+}
+
+/* mark count consecutive elements of the bitmap as used, a word at a time */
+static void bm_set_range(uint32_t *bm, int start, int count)
+{
+	int end = start + count;
+
+	while(start < end && BM_BIT(start)) {
+		BM_SET(bm, start);
+		start++;
+	}
+	while(end - start >= 32) {
+		bm[BM_IDX(start)] = 0xffffffff;
+		start += 32;
+	}
+	while(start < end) {
+		BM_SET(bm, start);
+		start++;
+	}
+}
+
+/* allocate a contiguous run of count blocks, or if there isn't enough
+ * contiguous free space, the longest run available. Returns the first block
+ * of the run and its length through len, or 0 if there are no free blocks.
+ */
+static int alloc_blocks(struct filesys *fs, int count, int *len)
 {
 	int bno;
 
-	if((bno = find_free(fs->sb->bm, fs->sb->num_blocks)) == -1) {
-		return -1;
+	if((bno = bm_alloc_run(fs, fs->sb->bm, count, len)) == -1) {
+		return 0;
 	}
-	BM_SET(fs->sb->bm, bno);
-	return 0;
+	return bno;
 }
 
-#define BLK_BLKID	(BLKSZ / sizeof(blkid))
-#define MAX_IND		(NDIRBLK + BLK_BLKID)
-#define MAX_DIND	(MAX_IND + BLK_BLKID * BLK_BLKID)
+/* --- on-demand loaded bitmaps --- */
 
-static int file_block(struct filesys *fs, struct inode *node, int boffs, int allocate)
+/* number of elements in group g */
+#define GRP_BITS(bm, g) \
+	((g) < (bm)->count - 1 ? BLKBITS : (bm)->nbits - (g) * BLKBITS)
+
+/* free elements in groups we haven't looked at yet, going by the superblock.
+ * The superblock counts are only written when the filesystem is synced, so
+ * they're just a hint: the real number can be larger if we didn't get that far
+ * (see grp_maybe_free), and it's corrected as groups are loaded.
+ */
+#define UNKNOWN_FREE(bm)	((int)((bm)->nfree - (bm)->nfree_known))
+
+static struct bitmap *bm_create(blkid start, unsigned int count, unsigned int nbits, unsigned int nfree)
 {
-	int res, idx, node_dirty = 0;
-	blkid *barr;
+	int i;
+	struct bitmap *bm;
 
-	/* out of bounds */
-	if(boffs < 0 || boffs >= MAX_DIND) {
+	if(!(bm = malloc(sizeof *bm))) {
 		return 0;
 	}
+	memset(bm, 0, sizeof *bm);
 
-	/* is it a direct block ? */
-	if(boffs < NDIRBLK) {
-		if(!(res = node->blk[boffs]) && allocate) {
-			res = node->blk[boffs] = alloc_block(fs);
-			if(res) {
-				zero_block(fs, res);
-				/* also write back the modified inode */
-				put_inode(fs, node);
-			}
-		}
-		return res;
+	if(!(bm->grp = malloc(count * sizeof *bm->grp))) {
+		free(bm);
+		return 0;
+	}
+	for(i=0; i<count; i++) {
+		bm->grp[i].bits = 0;
+		bm->grp[i].nfree = -1;
+		bm->grp[i].dirty = 0;
+	}
+
+	bm->start = start;
+	bm->count = count;
+	bm->nbits = nbits;
+	bm->nfree = nfree;
+	bm->nunknown = count;
+	return bm;
+}
+
+static void bm_free_bitmap(struct bitmap *bm)
+{
+	int i;
+
+	if(!bm) return;
+
+	for(i=0; i<bm->nloaded; i++) {
+		free(bm->grp[bm->loaded[i]].bits);
 	}
+	free(bm->grp);
+	free(bm);
+}
+
+/* make sure group g is in memory and return its bits. If we're at the limit of
+ * loaded groups, the least recently loaded one goes (written back if dirty).
+ */
+static uint32_t *bm_load(struct filesys *fs, struct bitmap *bm, int g)
+{
+	int i, nbits, nfree;
+	struct bm_group *grp = bm->grp + g;
+	uint32_t *bits;
 
-	barr = malloc(fs->sb->blksize);
-	assert(barr);
+	if(grp->bits) {
+		return grp->bits;
+	}
 
-	/* is it an indirect block ? */
-	if(boffs < MAX_IND) {
-		int ind_dirty = 0;
+	if(bm->nloaded >= BM_MAX_LOADED) {
+		struct bm_group *victim = bm->grp + bm->loaded[0];
 
-		if(node->ind) {
-			/* read the indirect block */
-			blk_read(fs->bdev, node->ind, 1, barr);
-		} else {
-			/* does not exist... try to allocate if requested */
-			if(!allocate || !(node->ind = alloc_block(fs))) {
-				res = 0;
-				goto end;
+		if(victim->dirty) {
+			if(blk_write(fs->bdev, bm->start + bm->loaded[0], 1, victim->bits) == -1) {
+				return 0;
 			}
+			victim->dirty = 0;
+		}
+		bits = victim->bits;
+		victim->bits = 0;
+
+		bm->nloaded--;
+		memmove(bm->loaded, bm->loaded + 1, bm->nloaded * sizeof *bm->loaded);
+	} else {
+		if(!(bits = malloc(BLKSZ))) {
+			return 0;
+		}
+	}
 
-			/* allocated a block clear the buffer, and invalidate everything */
-			memset(barr, 0, sizeof fs->sb->blksize);
-			node_dirty = 1;
-			ind_dirty = 1;
+	if(blk_read(fs->bdev, bm->start + g, 1, bits) == -1) {
+		free(bits);
+		return 0;
+	}
+	grp->bits = bits;
+	bm->loaded[bm->nloaded++] = g;
+
+	if(grp->nfree == -1) {
+		/* first time we see this group, count its free elements */
+		nbits = GRP_BITS(bm, g);
+		nfree = 0;
+		for(i=0; i<nbits; i++) {
+			if(BM_ISFREE(bits, i)) nfree++;
+		}
+		grp->nfree = nfree;
+		bm->nfree_known += nfree;
+		/* the superblock count was stale, there's at least what we've seen */
+		if(bm->nfree < bm->nfree_known) {
+			bm->nfree = bm->nfree_known;
 		}
 
-		idx = boffs - NDIRBLK;
+		if(--bm->nunknown == 0) {
+			/* we've seen everything, the total must be exact now */
+			bm->nfree = bm->nfree_known;
+		}
+	}
+	return bits;
+}
 
-		if(!(res = barr[idx])) {
-			if(allocate && (res = barr[idx] = alloc_block(fs))) {
-				ind_dirty = 1;
+/* write back all the modified bitmap blocks */
+static int bm_sync(struct filesys *fs, struct bitmap *bm)
+{
+	int i;
+
+	for(i=0; i<bm->nloaded; i++) {
+		struct bm_group *grp = bm->grp + bm->loaded[i];
+
+		if(grp->dirty) {
+			if(blk_write(fs->bdev, bm->start + bm->loaded[i], 1, grp->bits) == -1) {
+				return -1;
 			}
+			grp->dirty = 0;
 		}
+	}
+	return 0;
+}
 
-		/* write back the indirect block if needed */
-		if(ind_dirty) {
-			blk_write(fs->bdev, node->ind, 1, barr);
-		}
-		goto end;
+/* can group g possibly have free elements? Groups we haven't loaded yet are
+ * only worth a look if the superblock count says there's free space left in
+ * them, unless hint is 0, as a last resort before giving up.
+ */
+static int grp_maybe_free(struct bitmap *bm, int g, int hint)
+{
+	int nfree = bm->grp[g].nfree;
+	return nfree > 0 || (nfree == -1 && (!hint || UNKNOWN_FREE(bm) > 0));
+}
+
+static void grp_take(struct bitmap *bm, int g, int count)
+{
+	bm->grp[g].nfree -= count;
+	bm->grp[g].dirty = 1;
+	bm->nfree_known -= count;
+	bm->nfree -= count;
+	bm->last = g;
+}
+
+/* allocate a single element. The group of the last allocation is tried first,
+ * then groups with known free space, then groups we haven't loaded yet, if the
+ * superblock free count says there's anything left in them, and finally the
+ * rest of them, in case the count was stale.
+ */
+static int bm_alloc(struct filesys *fs, struct bitmap *bm)
+{
+	int i, g, x, hint;
+	uint32_t *bits;
+
+	if(!bm->nfree && !bm->nunknown) {
+		return -1;
 	}
 
-	/* TODO check/rewrite this */
-#if 0
-	/* is it a double-indirect block ? */
-	if(boffs < MAX_DIND) {
-		/* first read the dind block and find the index of the ind block */
-		if(!node->dind) {
-			if(allocate) {
-				/* allocate and zero-out the double indirect block */
-				res = node->dind = alloc_block(fs);
-				if(res) {
-					zero_block(fs, res);
+	for(i=0; i<bm->count; i++) {
+		g = (bm->last + i) % bm->count;
+		if(bm->grp[g].nfree > 0 && bm->grp[g].bits) {
+			goto found;
+		}
+	}
+	for(hint=1; hint>=0; hint--) {
+		for(i=0; i<bm->count; i++) {
+			g = (bm->last + i) % bm->count;
+			if(grp_maybe_free(bm, g, hint)) {
+				if(!bm_load(fs, bm, g)) {
+					return -1;
+				}
+				if(bm->grp[g].nfree > 0) {
+					goto found;
 				}
-			} else {
-				res = 0;
-				goto end;
 			}
 		}
-		blk_read(fd->bdev, node->dind, 1, barr);
-		idx = (boffs - MAX_IND) / BLK_BLKID;
+	}
+	return -1;
 
-		/* then read the ind block and find the index of the block */
-		if(!barr[idx]) {
-			res = 0;
-			goto end;
-		}
-		blk_read(fd->bdev, barr[idx], 1, barr);
-		res = barr[(boffs - MAX_IND) % BLK_BLKID];
+found:
+	bits = bm->grp[g].bits;
+	if((x = find_free(bits, GRP_BITS(bm, g))) == -1) {
+		panic("bm_alloc: group %d free count is wrong\n", g);
 	}
-#endif
+	BM_SET(bits, x);
+	grp_take(bm, g, 1);
+	return g * BLKBITS + x;
+}
 
-end:
-	if(node_dirty) {
-		put_inode(fs, node);
+/* allocate a run of count contiguous elements, or the longest run available if
+ * there isn't one that long. Runs never cross group boundaries. Returns the
+ * first element, and the run length through len, or -1 if there's nothing free.
+ */
+static int bm_alloc_run(struct filesys *fs, struct bitmap *bm, int count, int *len)
+{
+	int i, g, n, start, hint, best_g = -1, best = 0, best_len = 0;
+	uint32_t *bits;
+
+	if(!bm->nfree && !bm->nunknown) {
+		return -1;
 	}
-	free(barr);
-	return res;
+	if(count > BLKBITS) {
+		count = BLKBITS;
+	}
+
+	/* only look at the groups the superblock count says are all used if
+	 * there's nothing anywhere else (see bm_alloc)
+	 */
+	for(hint=1; hint>=0 && best_g == -1; hint--) {
+		for(i=0; i<bm->count; i++) {
+			g = (bm->last + i) % bm->count;
+
+			if(!grp_maybe_free(bm, g, hint)) continue;
+			/* a group with less free elements than our best run can't beat it */
+			if(bm->grp[g].nfree != -1 && bm->grp[g].nfree <= best_len) continue;
+
+			if(!(bits = bm_load(fs, bm, g))) {
+				break;
+			}
+			if((start = find_free_run(bits, GRP_BITS(bm, g), count, &n)) == -1) {
+				continue;
+			}
+			if(n > best_len) {
+				best_g = g;
+				best = start;
+				best_len = n;
+				if(n >= count) break;
+			}
+		}
+	}
+
+	if(best_g == -1) {
+		return -1;
+	}
+
+	/* the group might have been evicted while looking at others */
+	if(!(bits = bm_load(fs, bm, best_g))) {
+		return -1;
+	}
+	bm_set_range(bits, best, best_len);
+	grp_take(bm, best_g, best_len);
+
+	*len = best_len;
+	return best_g * BLKBITS + best;
+}
+
+/* mark a range of elements as used (mkfs) */
+static void bm_mark_used(struct filesys *fs, struct bitmap *bm, int start, int count)
+{
+	int g, n, x;
+	uint32_t *bits;
+
+	while(count > 0) {
+		g = start / BLKBITS;
+		x = start % BLKBITS;
+		n = BLKBITS - x;
+		if(n > count) n = count;
+
+		if(!(bits = bm_load(fs, bm, g))) {
+			panic("bm_mark_used: failed to load bitmap block %d\n", g);
+		}
+		bm_set_range(bits, x, n);
+		grp_take(bm, g, n);
+
+		start += n;
+		count -= n;
+	}
+}
+
+static void bm_free(struct filesys *fs, struct bitmap *bm, int x)
+{
+	int g = x / BLKBITS;
+	uint32_t *bits;
+
+	if(!(bits = bm_load(fs, bm, g))) {
+		printf("bm_free: failed to load bitmap block %d\n", g);
+		return;
+	}
+	x %= BLKBITS;
+
+	if(BM_ISFREE(bits, x)) {
+		printf("bm_free: element %d already free\n", g * BLKBITS + x);
+		return;
+	}
+	BM_CLR(bits, x);
+
+	bm->grp[g].nfree++;
+	bm->grp[g].dirty = 1;
+	bm->nfree_known++;
+	bm->nfree++;
+}
+
+static int file_block(struct filesys *fs, struct inode *node, int boffs, int allocate)
+{
+	blkid bno = 0;
+	uint32_t newblk;
+
+	if(map_blocks(fs, node, boffs, 1, &bno, allocate ? &newblk : 0) == -1) {
+		return 0;
+	}
+
+	if(allocate && newblk) {
+		zero_block(fs, bno);
+		/* also write back the modified inode */
+		put_inode(fs, node);
+	}
+	return bno;
+}
+
+/* map_blocks resolves count consecutive file blocks starting at boffs, to the
+ * disk blocks backing them, and stores the disk block numbers in blist (0 for
+ * holes). Each indirect block is read (and written back if needed) only once
+ * for the whole range, instead of once per file block.
+ *
+ * If alloc_mask is non-null, any holes are filled by allocating new blocks, and
+ * bit i of *alloc_mask is set if blist[i] was newly allocated. The new blocks
+ * are NOT zeroed, and the inode is NOT written back, that's up to the caller.
+ * When allocating, blist must be initialized by the caller: a non-zero entry
+ * is a block (already marked used) to place in that hole, instead of calling
+ * alloc_block. It's ignored if there's no hole there.
+ *
+ * map_blocks_rsv also takes any new indirect blocks from the reserved run of
+ * *rsv_len blocks starting at *rsv (advancing it), while it lasts.
+ */
+static int map_blocks_rsv(struct filesys *fs, struct inode *node, int boffs, int count, blkid *blist,
+		uint32_t *alloc_mask, int *rsv, int *rsv_len)
+{
+	int i, idx, newind, res = 0;
+	blkid *slot, *indptr;
+	blkid *ind = 0, *dind = 0;
+	blkid ind_bno = 0, single_ind;
+	int ind_dirty = 0, dind_dirty = 0;
+
+	assert(count <= RUN_MAX);
+
+	if(alloc_mask) {
+		*alloc_mask = 0;
+	}
+
+	for(i=0; i<count; i++) {
+		int b = boffs + i;
+		blkid want = alloc_mask ? blist[i] : 0;
+
+		blist[i] = 0;
+
+		/* out of bounds */
+		if(b < 0 || b >= MAX_DIND) {
+			if(alloc_mask) {
+				res = -1;
+				break;
+			}
+			continue;
+		}
+
+		/* is it a direct block ? */
+		if(b < NDIRBLK) {
+			slot = node->blk + b;
+
+			if(!*slot && alloc_mask) {
+				if(!(*slot = want ? want : alloc_block(fs))) {
+					res = -1;
+					break;
+				}
+				*alloc_mask |= 1u << i;
+			}
+			blist[i] = *slot;
+			continue;
+		}
+
+		/* find the pointer to the indirect block containing this block */
+		if(b < MAX_IND) {
+			single_ind = node->ind;
+			indptr = &single_ind;
+			idx = b - NDIRBLK;
+		} else {
+			/* double-indirect, first bring in the double-indirect block */
+			if(!dind) {
+				if(!node->dind) {
+					if(!alloc_mask) continue;
+					if(!(node->dind = alloc_rsv_block(fs, rsv, rsv_len))) {
+						res = -1;
+						break;
+					}
+					dind = malloc(BLKSZ);
+					assert(dind);
+					memset(dind, 0, BLKSZ);
+					dind_dirty = 1;
+				} else {
+					dind = malloc(BLKSZ);
+					assert(dind);
+					blk_read(fs->bdev, node->dind, 1, dind);
+				}
+			}
+			indptr = dind + (b - MAX_IND) / BLK_BLKID;
+			idx = (b - MAX_IND) % BLK_BLKID;
+		}
+
+		newind = 0;
+		if(!*indptr) {
+			if(!alloc_mask) continue;
+			if(!(*indptr = alloc_rsv_block(fs, rsv, rsv_len))) {
+				res = -1;
+				break;
+			}
+			if(indptr == &single_ind) {
+				node->ind = single_ind;
+			} else {
+				dind_dirty = 1;
+			}
+			newind = 1;
+		}
+
+		/* bring in the indirect block, unless it's the one we already have */
+		if(*indptr != ind_bno) {
+			if(ind_dirty) {
+				blk_write(fs->bdev, ind_bno, 1, ind);
+				ind_dirty = 0;
+			}
+			if(!ind) {
+				ind = malloc(BLKSZ);
+				assert(ind);
+			}
+			ind_bno = *indptr;
+
+			if(newind) {
+				memset(ind, 0, BLKSZ);
+				ind_dirty = 1;
+			} else {
+				blk_read(fs->bdev, ind_bno, 1, ind);
+			}
+		}
+		slot = ind + idx;
+
+		if(!*slot && alloc_mask) {
+			if(!(*slot = want ? want : alloc_block(fs))) {
+				res = -1;
+				break;
+			}
+			*alloc_mask |= 1u << i;
+			ind_dirty = 1;
+		}
+		blist[i] = *slot;
+	}
+
+	if(ind_dirty) {
+		blk_write(fs->bdev, ind_bno, 1, ind);
+	}
+	if(dind_dirty) {
+		blk_write(fs->bdev, node->dind, 1, dind);
+	}
+	free(ind);
+	free(dind);
+	return res;
+}
+
+static int alloc_rsv_block(struct filesys *fs, int *rsv, int *rsv_len)
+{
+	if(rsv && *rsv_len > 0) {
+		(*rsv_len)--;
+		return (*rsv)++;
+	}
+	return alloc_block(fs);
+}
+
+/* read up to sz bytes of file data starting at byte offset offs. Physically
+ * contiguous block runs are read straight into the destination buffer with a
+ * single blk_read, only partial blocks go through a bounce buffer.
+ * returns the number of bytes read.
+ */
+int read_file(struct filesys *fs, struct inode *node, long offs, void *buf, int sz)
+{
+	int i, nblk, count, start, len, res = 0;
+	blkid blist[RUN_MAX];
+	char *dest = buf;
+	char *tmp = 0;
+
+	if(offs < 0 || sz < 0) {
+		return -EINVAL;
+	}
+	if(offs >= node->size) {
+		return 0;
+	}
+	if(sz > node->size - offs) {
+		sz = node->size - offs;
+	}
+
+	while(sz > 0) {
+		start = offs % BLKSZ;
+		nblk = (start + sz + BLKSZ - 1) / BLKSZ;
+		if(nblk > RUN_MAX) {
+			nblk = RUN_MAX;
+		}
+		map_blocks(fs, node, offs / BLKSZ, nblk, blist, 0);
+
+		i = 0;
+		while(i < nblk && sz > 0) {
+			if(start || sz < BLKSZ) {
+				/* partial block */
+				len = BLKSZ - start;
+				if(len > sz) len = sz;
+
+				if(blist[i]) {
+					if(!tmp && !(tmp = malloc(BLKSZ))) {
+						return res ? res : -ENOMEM;
+					}
+					if(blk_read(fs->bdev, blist[i], 1, tmp) == -1) {
+						goto done;
+					}
+					memcpy(dest, tmp + start, len);
+				} else {
+					memset(dest, 0, len);
+				}
+				start = 0;
+				i++;
+			} else {
+				/* run of whole blocks, contiguous on disk (or all holes) */
+				count = 1;
+				while(i + count < nblk && (count + 1) * BLKSZ <= sz) {
+					blkid next = blist[i + count];
+					if(blist[i] ? next != blist[i] + count : next != 0) {
+						break;
+					}
+					count++;
+				}
+				len = count * BLKSZ;
+
+				if(blist[i]) {
+					if(blk_read(fs->bdev, blist[i], count, dest) == -1) {
+						goto done;
+					}
+				} else {
+					memset(dest, 0, len);
+				}
+				i += count;
+			}
+
+			dest += len;
+			offs += len;
+			sz -= len;
+			res += len;
+		}
+	}
+
+done:
+	free(tmp);
+	return res;
+}
+
+/* write sz bytes of file data starting at byte offset offs, allocating any
+ * missing blocks RUN_MAX at a time, and extending the file if needed.
+ * Blocks which are newly allocated, or lie beyond the current end of file,
+ * are not read back from disk before a partial write; the rest of the block
+ * is zero-filled instead. returns the number of bytes written.
+ */
+int write_file(struct filesys *fs, struct inode *node, long offs, void *buf, int sz)
+{
+	int i, nblk, count, start, len, res = 0;
+	int node_dirty = 0;
+	uint32_t newblk;
+	blkid blist[RUN_MAX];
+	char *src = buf;
+	char *tmp = 0;
+
+	if(offs < 0 || sz < 0) {
+		return -EINVAL;
+	}
+	if(offs > node->size) {
+		zero_gap(fs, node, offs);
+	}
+
+	while(sz > 0) {
+		int boffs = offs / BLKSZ;
+
+		start = offs % BLKSZ;
+		nblk = (start + sz + BLKSZ - 1) / BLKSZ;
+		if(nblk > RUN_MAX) {
+			nblk = RUN_MAX;
+		}
+		memset(blist, 0, sizeof blist);
+		if(map_blocks(fs, node, boffs, nblk, blist, &newblk) == -1) {
+			node_dirty = 1;
+			if(!res) res = -ENOSPC;
+			goto done;
+		}
+		if(newblk) {
+			node_dirty = 1;
+		}
+
+		i = 0;
+		while(i < nblk && sz > 0) {
+			if(start || sz < BLKSZ) {
+				/* partial block, read-modify-write */
+				len = BLKSZ - start;
+				if(len > sz) len = sz;
+
+				if(!tmp && !(tmp = malloc(BLKSZ))) {
+					if(!res) res = -ENOMEM;
+					goto done;
+				}
+				if((newblk & (1u << i)) || (boffs + i) * BLKSZ >= node->size) {
+					memset(tmp, 0, BLKSZ);
+				} else if(blk_read(fs->bdev, blist[i], 1, tmp) == -1) {
+					goto done;
+				}
+				memcpy(tmp + start, src, len);
+				if(blk_write(fs->bdev, blist[i], 1, tmp) == -1) {
+					goto done;
+				}
+				start = 0;
+				i++;
+			} else {
+				/* run of whole blocks, contiguous on disk */
+				count = 1;
+				while(i + count < nblk && (count + 1) * BLKSZ <= sz &&
+						blist[i + count] == blist[i] + count) {
+					count++;
+				}
+				len = count * BLKSZ;
+
+				if(blk_write(fs->bdev, blist[i], count, src) == -1) {
+					goto done;
+				}
+				i += count;
+			}
+
+			src += len;
+			offs += len;
+			sz -= len;
+			res += len;
+
+			if(offs > node->size) {
+				node->size = offs;
+				node_dirty = 1;
+			}
+		}
+	}
+
+done:
+	if(node_dirty) {
+		put_inode(fs, node);
+	}
+	free(tmp);
+	return res;
+}
+
+/* copy sz bytes of file data from src (starting at soffs), to dest (starting
+ * at doffs), without bouncing the data through user space. The destination
+ * blocks past its current end are allocated in one go before copying, and
+ * the data moves in runs of up to RUN_MAX blocks.
+ * returns the number of bytes copied.
+ */
+int copy_file(struct filesys *fs, struct inode *dest, long doffs, struct inode *src, long soffs, int sz)
+{
+	int rd, wr, res = 0;
+	int first, last;
+	char *buf;
+
+	if(doffs < 0 || soffs < 0 || sz < 0) {
+		return -EINVAL;
+	}
+	if(soffs >= src->size) {
+		return 0;
+	}
+	if(sz > src->size - soffs) {
+		sz = src->size - soffs;
+	}
+
+	/* allocate all the destination blocks beyond its current end up front */
+	first = (dest->size + BLKSZ - 1) / BLKSZ;
+	if(first < doffs / BLKSZ) {
+		first = doffs / BLKSZ;
+	}
+	last = (doffs + sz + BLKSZ - 1) / BLKSZ;
+	if(last > first) {
+		prealloc_blocks(fs, dest, first, last - first);
+	}
+
+	if(!(buf = malloc(RUN_MAX * BLKSZ))) {
+		return -ENOMEM;
+	}
+
+	while(sz > 0) {
+		int len = RUN_MAX * BLKSZ;
+
+		/* keep source reads block-aligned, so that every read_file call maps
+		 * to whole-block runs
+		 */
+		len -= soffs % BLKSZ;
+		if(len > sz) len = sz;
+
+		if((rd = read_file(fs, src, soffs, buf, len)) <= 0) {
+			break;
+		}
+		if((wr = write_file(fs, dest, doffs, buf, rd)) <= 0) {
+			if(!res) res = wr;
+			break;
+		}
+
+		soffs += wr;
+		doffs += wr;
+		sz -= wr;
+		res += wr;
+
+		if(wr < rd) break;
+	}
+
+	free(buf);
+	return res;
+}
+
+/* find the disk blocks backing count (at most 32) consecutive file blocks,
+ * starting at boffs. Holes and blocks past the end of file are returned as 0.
+ */
+int get_file_blocks(struct filesys *fs, struct inode *node, int boffs, int count, blkid *blist)
+{
+	int i, nblk = (node->size + BLKSZ - 1) / BLKSZ;
+
+	if(count > RUN_MAX) {
+		return -1;
+	}
+	map_blocks(fs, node, boffs, count, blist, 0);
+
+	for(i=0; i<count; i++) {
+		if(boffs + i >= nblk) {
+			blist[i] = 0;
+		}
+	}
+	return 0;
+}
+
+/* reserve disk space for the byte range [offs, offs + len) of a file, without
+ * changing its size. See prealloc_blocks.
+ */
+int prealloc_file(struct filesys *fs, struct inode *node, long offs, long len)
+{
+	long first, last;
+
+	if(offs < 0 || len <= 0 || len > LONG_MAX - offs) {
+		return -EINVAL;
+	}
+	first = offs / BLKSZ;
+	last = (offs + len + BLKSZ - 1) / BLKSZ;
+
+	if(last > MAX_DIND) {
+		return -ENOSPC;
+	}
+	return prealloc_blocks(fs, node, first, last - first);
+}
+
+/* allocate any missing blocks in the range of file blocks [boffs, boffs +
+ * count), and write back the inode.
+ * All the needed blocks, including any indirect blocks to map them, are first
+ * reserved in the bitmap as a single contiguous run if possible (see
+ * alloc_blocks), and then placed in the holes in file order, so the range ends
+ * up laid out sequentially on disk.
+ * Blocks filling holes inside the file are zeroed, since a hole reads as
+ * zeros. Blocks past the end of file aren't: they're not part of the file
+ * until written, and write_file/zero_gap take care of them.
+ */
+static int prealloc_blocks(struct filesys *fs, struct inode *node, int boffs, int count)
+{
+	int i, n, b, nneed, run_start, run_len, prev_len;
+	uint32_t newblk, dirty = 0;
+	blkid blist[RUN_MAX], given[RUN_MAX];
+	int res = 0;
+
+	/* count the holes that need filling */
+	nneed = 0;
+	for(b=0; b<count; b+=n) {
+		n = count - b > RUN_MAX ? RUN_MAX : count - b;
+
+		map_blocks(fs, node, boffs + b, n, blist, 0);
+		for(i=0; i<n; i++) {
+			if(!blist[i]) nneed++;
+		}
+	}
+	if(!nneed) {
+		return 0;
+	}
+	nneed += missing_ind_blocks(fs, node, boffs, count);
+
+	run_start = run_len = 0;
+
+	for(b=0; b<count; b+=n) {
+		n = count - b > RUN_MAX ? RUN_MAX : count - b;
+
+		map_blocks(fs, node, boffs + b, n, blist, 0);
+
+		/* hand out blocks from the reserved run(s) to the holes */
+		for(i=0; i<n; i++) {
+			given[i] = 0;
+			if(blist[i]) {
+				blist[i] = 0;	/* no hole here, leave it alone */
+				continue;
+			}
+			if(!run_len) {
+				if(!(run_start = alloc_blocks(fs, nneed, &run_len))) {
+					res = -ENOSPC;
+					break;
+				}
+			}
+			given[i] = blist[i] = run_start++;
+			run_len--;
+			nneed--;
+		}
+
+		/* new indirect blocks come out of the same run, after the data */
+		prev_len = run_len;
+		if(map_blocks_rsv(fs, node, boffs + b, i, blist, &newblk, &run_start, &run_len) == -1) {
+			res = -ENOSPC;
+		}
+		nneed -= prev_len - run_len;
+		dirty |= newblk;
+
+		for(n=0; n<i; n++) {
+			if(!(newblk & (1u << n))) {
+				/* handed out, but map_blocks failed before placing it */
+				if(given[n]) {
+					free_block(fs, given[n]);
+				}
+				continue;
+			}
+			/* the blocks which went into holes before the end of file */
+			if((long)(boffs + b + n) * BLKSZ < node->size) {
+				zero_block(fs, blist[n]);
+			}
+		}
+		if(res) break;
+	}
+
+	/* return anything left over after a failure */
+	while(run_len-- > 0) {
+		free_block(fs, run_start);
+		run_start++;
+	}
+
+	if(dirty || res) {
+		put_inode(fs, node);
+	}
+	return res;
+}
+
+/* returns the number of indirect blocks (and the double-indirect block) which
+ * don't exist yet, and are needed to map file blocks [boffs, boffs + count).
+ * Any missing one covers only holes, so there's at least one to map through it.
+ */
+static int missing_ind_blocks(struct filesys *fs, struct inode *node, int boffs, int count)
+{
+	int i, first, last, res = 0;
+	int end = boffs + count;
+	blkid *dind;
+
+	if(boffs < MAX_IND && end > NDIRBLK && !node->ind) {
+		res++;
+	}
+	if(end <= MAX_IND) {
+		return res;
+	}
+
+	first = (boffs > MAX_IND ? boffs - MAX_IND : 0) / BLK_BLKID;
+	last = (end - 1 - MAX_IND) / BLK_BLKID;
+
+	if(!node->dind) {
+		/* the double-indirect block, and all the indirect blocks under it */
+		return res + 1 + last - first + 1;
+	}
+
+	dind = malloc(BLKSZ);
+	assert(dind);
+	blk_read(fs->bdev, node->dind, 1, dind);
+
+	for(i=first; i<=last; i++) {
+		if(!dind[i]) res++;
+	}
+	free(dind);
+	return res;
+}
+
+/* called before writing at offs, past the end of file. Any blocks between the
+ * current end of file and offs, which were allocated ahead of time but never
+ * written, are about to become part of the file and must read as zeros.
+ */
+static void zero_gap(struct filesys *fs, struct inode *node, long offs)
+{
+	int i, n;
+	int first = (node->size + BLKSZ - 1) / BLKSZ;
+	int last = offs / BLKSZ;
+	blkid blist[RUN_MAX];
+
+	while(first < last) {
+		n = last - first > RUN_MAX ? RUN_MAX : last - first;
+
+		map_blocks(fs, node, first, n, blist, 0);
+		for(i=0; i<n; i++) {
+			if(blist[i]) {
+				zero_block(fs, blist[i]);
+			}
+		}
+		first += n;
+	}
+}
+
+/* --- defragmentation --- */
+
+/* returns the number of file blocks up to and including the last one which
+ * is mapped to a disk block, regardless of the file size.
+ */
+static int mapped_blocks(struct filesys *fs, struct inode *node)
+{
+	int i, j, res = 0;
+	blkid *buf;
+
+	if(!(buf = malloc(BLKSZ))) {
+		return -1;
+	}
+
+	if(node->dind) {
+		blk_read(fs->bdev, node->dind, 1, buf);
+		for(i=BLK_BLKID-1; i>=0 && !res; i--) {
+			blkid ind_bno = buf[i];
+			if(!ind_bno) continue;
+
+			blk_read(fs->bdev, ind_bno, 1, buf);
+			for(j=BLK_BLKID-1; j>=0; j--) {
+				if(buf[j]) {
+					res = MAX_IND + i * BLK_BLKID + j + 1;
+					break;
+				}
+			}
+			if(!res) {
+				/* empty indirect block, bring the double-indirect back in */
+				blk_read(fs->bdev, node->dind, 1, buf);
+			}
+		}
+	}
+	if(!res && node->ind) {
+		blk_read(fs->bdev, node->ind, 1, buf);
+		for(j=BLK_BLKID-1; j>=0; j--) {
+			if(buf[j]) {
+				res = NDIRBLK + j + 1;
+				break;
+			}
+		}
+	}
+	for(i=NDIRBLK-1; i>=0 && !res; i--) {
+		if(node->blk[i]) {
+			res = i + 1;
+		}
+	}
+
+	free(buf);
+	return res;
+}
+
+/* returns a malloced array with the disk blocks of the first nblk file blocks */
+static blkid *get_block_list(struct filesys *fs, struct inode *node, int nblk)
+{
+	int b, n;
+	blkid *blist;
+
+	if(!(blist = malloc((nblk ? nblk : 1) * sizeof *blist))) {
+		return 0;
+	}
+	for(b=0; b<nblk; b+=n) {
+		n = nblk - b > RUN_MAX ? RUN_MAX : nblk - b;
+		map_blocks(fs, node, b, n, blist + b, 0);
+	}
+	return blist;
+}
+
+/* count the data blocks, and the runs of physically contiguous data blocks.
+ * Holes don't break a run, if the blocks on either side are adjacent.
+ */
+static void count_extents(blkid *blist, int nblk, struct frag_info *fi)
+{
+	int i;
+	blkid prev = 0;
+
+	memset(fi, 0, sizeof *fi);
+
+	for(i=0; i<nblk; i++) {
+		if(!blist[i]) continue;
+
+		if(!prev || blist[i] != prev + 1) {
+			fi->nextents++;
+		}
+		fi->nblocks++;
+		prev = blist[i];
+	}
+	fi->nfiles = fi->nblocks ? 1 : 0;
+}
+
+/* percentage of consecutive data blocks which are not adjacent on disk:
+ * 0 when every file is contiguous, 100 when no two blocks are.
+ */
+int frag_score(struct frag_info *fi)
+{
+	if(fi->nblocks <= fi->nfiles) {
+		return 0;
+	}
+	return (fi->nextents - fi->nfiles) * 100 / (fi->nblocks - fi->nfiles);
+}
+
+int get_frag_info(struct filesys *fs, struct inode *node, struct frag_info *fi)
+{
+	int nblk;
+	blkid *blist;
+
+	if((nblk = mapped_blocks(fs, node)) == -1 || !(blist = get_block_list(fs, node, nblk))) {
+		return -ENOMEM;
+	}
+	count_extents(blist, nblk, fi);
+	free(blist);
+	return 0;
+}
+
+/* Move the nblk first blocks of a file (those which are not holes in blist) to
+ * newly allocated blocks, as contiguous as possible. All the indirect blocks
+ * needed go first, followed by the data blocks in file order. The data is
+ * taken from the nblk * BLKSZ buffer data if it's not null, otherwise it's
+ * copied from the old blocks.
+ *
+ * Nothing is changed in place: the data and the new indirect blocks are
+ * written first, and then the new block pointers replace the old ones with a
+ * single write of the inode. Only after that are the old blocks freed, along
+ * with any blocks past the first nblk.
+ *
+ * When copying, if the new blocks wouldn't be in fewer runs than max_extents,
+ * nothing is done. returns 1 if the blocks were moved, 0 if not.
+ */
+static int relocate(struct filesys *fs, struct inode *node, int nblk, blkid *blist, char *data, int max_extents)
+{
+	int i, k, len, total, nmeta, pos, meta, last_k, res = -ENOSPC;
+	blkid start, *newblk, *newlist = 0, *ind = 0, *dind = 0, ind_bno = 0;
+	struct inode newnode, oldnode;
+	struct frag_info fi;
+	char *buf = 0;
+
+	/* count the data blocks, and the indirect blocks needed to map them */
+	nmeta = total = 0;
+	last_k = -1;
+	for(i=0; i<nblk; i++) {
+		if(!blist[i]) continue;
+
+		if(i >= MAX_IND) {
+			if(last_k == -1) nmeta++;	/* double-indirect */
+			if((k = (i - MAX_IND) / BLK_BLKID) != last_k) {
+				last_k = k;
+				nmeta++;
+			}
+		} else if(i >= NDIRBLK && !nmeta) {
+			nmeta++;
+		}
+		total++;
+	}
+	total += nmeta;
+
+	/* grab as few runs of free blocks as possible */
+	if(!(newblk = malloc((total ? total : 1) * sizeof *newblk))) {
+		return -ENOMEM;
+	}
+	for(pos=0; pos<total; ) {
+		if(!(start = alloc_blocks(fs, total - pos, &len))) {
+			goto end;
+		}
+		while(len-- > 0) {
+			newblk[pos++] = start++;
+		}
+	}
+
+	/* assign them to the file blocks, metadata first */
+	if(!(newlist = malloc(nblk * sizeof *newlist)) || !(buf = malloc(RUN_MAX * BLKSZ)) ||
+			!(ind = malloc(BLKSZ)) || !(dind = malloc(BLKSZ))) {
+		res = -ENOMEM;
+		goto end;
+	}
+	meta = 0;
+	pos = nmeta;
+	for(i=0; i<nblk; i++) {
+		newlist[i] = blist[i] ? newblk[pos++] : 0;
+	}
+	count_extents(newlist, nblk, &fi);
+	if(!data && fi.nextents >= max_extents) {
+		res = 0;
+		goto end;
+	}
+
+	/* write the data */
+	for(i=0; i<nblk; i+=len) {
+		if(!blist[i]) {
+			len = 1;
+			continue;
+		}
+		len = 1;
+		while(i + len < nblk && len < RUN_MAX && newlist[i + len] == newlist[i] + len &&
+				(data || blist[i + len] == blist[i] + len)) {
+			len++;
+		}
+		if(data) {
+			blk_write(fs->bdev, newlist[i], len, data + i * BLKSZ);
+		} else {
+			blk_read(fs->bdev, blist[i], len, buf);
+			blk_write(fs->bdev, newlist[i], len, buf);
+		}
+	}
+
+	/* build the new block pointers, and write the new indirect blocks */
+	newnode = *node;
+	memset(newnode.blk, 0, sizeof newnode.blk);
+	newnode.ind = newnode.dind = 0;
+	last_k = -1;
+
+	for(i=0; i<nblk; i++) {
+		if(!newlist[i]) continue;
+
+		if(i < NDIRBLK) {
+			newnode.blk[i] = newlist[i];
+			continue;
+		}
+		if(i < MAX_IND) {
+			if(!newnode.ind) {
+				ind_bno = newnode.ind = newblk[meta++];
+				memset(ind, 0, BLKSZ);
+			}
+			ind[i - NDIRBLK] = newlist[i];
+			continue;
+		}
+
+		if(!newnode.dind) {
+			newnode.dind = newblk[meta++];
+			memset(dind, 0, BLKSZ);
+		}
+		if((k = (i - MAX_IND) / BLK_BLKID) != last_k) {
+			if(ind_bno) {
+				blk_write(fs->bdev, ind_bno, 1, ind);
+			}
+			last_k = k;
+			ind_bno = dind[k] = newblk[meta++];
+			memset(ind, 0, BLKSZ);
+		}
+		ind[(i - MAX_IND) % BLK_BLKID] = newlist[i];
+	}
+	if(ind_bno) {
+		blk_write(fs->bdev, ind_bno, 1, ind);
+	}
+	if(newnode.dind) {
+		blk_write(fs->bdev, newnode.dind, 1, dind);
+	}
+	assert(meta == nmeta);
+
+	/* swap the block pointers, then release the old blocks */
+	if(put_inode(fs, &newnode) == -1) {
+		res = -EIO;
+		goto end;
+	}
+	oldnode = *node;
+	*node = newnode;
+	free_file_blocks(fs, &oldnode);
+	res = 1;
+	total = 0;	/* the new blocks are in use now */
+
+end:
+	for(i=0; i<pos && i<total; i++) {
+		free_block(fs, newblk[i]);
+	}
+	free(newblk);
+	free(newlist);
+	free(buf);
+	free(ind);
+	free(dind);
+	return res;
+}
+
+/* move the blocks of a fragmented file to as few runs of contiguous blocks
+ * as possible. returns 1 if the file was moved, 0 if there was no need, or
+ * if it wouldn't be any less fragmented.
+ */
+int defrag_file(struct filesys *fs, struct inode *node)
+{
+	int nblk, res;
+	blkid *blist;
+	struct frag_info fi;
+
+	if((nblk = mapped_blocks(fs, node)) == -1 || !(blist = get_block_list(fs, node, nblk))) {
+		return -ENOMEM;
+	}
+	count_extents(blist, nblk, &fi);
+
+	res = 0;
+	if(fi.nextents > 1) {
+		res = relocate(fs, node, nblk, blist, 0, fi.nextents);
+	}
+	free(blist);
+	return res;
+}
+
+/* pack the entries of a directory into as few blocks as possible, freeing
+ * the blocks left empty by unlinks. returns 1 if the directory shrunk.
+ */
+int compact_dir(struct filesys *fs, struct inode *dir)
+{
+	int i, j, nblk, nent, newblk, res = 0;
+	blkid *blist;
+	struct dir_entry *ents, *tmp;
+	unsigned int oldsize;
+
+	if(!(dir->mode & S_IFDIR)) {
+		return -ENOTDIR;
+	}
+	if((nblk = mapped_blocks(fs, dir)) <= 1) {
+		return nblk == -1 ? -ENOMEM : 0;
+	}
+	if(!(blist = get_block_list(fs, dir, nblk))) {
+		return -ENOMEM;
+	}
+	if(!(ents = malloc(nblk * BLKSZ)) || !(tmp = malloc(BLKSZ))) {
+		free(ents);
+		free(blist);
+		return -ENOMEM;
+	}
+	memset(ents, 0, nblk * BLKSZ);
+
+	nent = 0;
+	for(i=0; i<nblk; i++) {
+		if(!blist[i]) continue;
+
+		blk_read(fs->bdev, blist[i], 1, tmp);
+		for(j=0; j<BLK_DIRENT; j++) {
+			if(tmp[j].ino) {
+				ents[nent++] = tmp[j];
+			}
+		}
+	}
+
+	if((newblk = (nent + BLK_DIRENT - 1) / BLK_DIRENT) < nblk) {
+		/* the packed blocks are all present, any non-zero blist entry will do */
+		for(i=0; i<newblk; i++) {
+			blist[i] = 1;
+		}
+		oldsize = dir->size;
+		dir->size = newblk * BLKSZ;
+		if((res = relocate(fs, dir, newblk, blist, (char*)ents, 0)) <= 0) {
+			dir->size = oldsize;
+		}
+	}
+
+	free(tmp);
+	free(ents);
+	free(blist);
+	return res;
+}
+
+/* compact every directory and defragment every file in the filesystem.
+ * The fragmentation of the volume before and after is returned in before and
+ * after, and report is called (if not null) for each file with data. With
+ * DEFRAG_REPORT_ONLY nothing is changed.
+ */
+int defrag_fs(struct filesys *fs, unsigned int flags, struct frag_info *before, struct frag_info *after,
+		void (*report)(int, struct frag_info*, struct frag_info*))
+{
+	int i, ino, nblk_itbl;
+	struct inode *itbl, node, *nptr;
+	struct frag_info fb, fa;
+	uint32_t *bits;
+
+	if(!(itbl = malloc(BLKSZ))) {
+		return -ENOMEM;
+	}
+	memset(before, 0, sizeof *before);
+	memset(after, 0, sizeof *after);
+
+	nblk_itbl = (fs->sb->num_inodes + BLK_INODES - 1) / BLK_INODES;
+	for(i=0; i<nblk_itbl; i++) {
+		if(blk_read(fs->bdev, fs->sb->itbl_start + i, 1, itbl) == -1) {
+			free(itbl);
+			return -EIO;
+		}
+
+		for(ino = i * BLK_INODES; ino < (i + 1) * BLK_INODES && ino < fs->sb->num_inodes; ino++) {
+			if(!ino || !(bits = bm_load(fs, fs->sb->ibm, ino / BLKBITS)) ||
+					BM_ISFREE(bits, ino % BLKBITS)) {
+				continue;
+			}
+
+			/* the root inode is kept in memory, work on that one */
+			if(ino == fs->sb->root_ino) {
+				nptr = fs->sb->root;
+			} else {
+				node = itbl[ino % BLK_INODES];
+				nptr = &node;
+			}
+
+			get_frag_info(fs, nptr, &fb);
+			if(!(flags & DEFRAG_REPORT_ONLY)) {
+				if(nptr->mode & S_IFDIR) {
+					compact_dir(fs, nptr);
+				}
+				defrag_file(fs, nptr);
+				get_frag_info(fs, nptr, &fa);
+			} else {
+				fa = fb;
+			}
+
+			before->nblocks += fb.nblocks;
+			before->nextents += fb.nextents;
+			before->nfiles += fb.nfiles;
+			after->nblocks += fa.nblocks;
+			after->nextents += fa.nextents;
+			after->nfiles += fa.nfiles;
+
+			if(report && fb.nblocks) {
+				report(ino, &fb, &fa);
+			}
+		}
+	}
+
+	free(itbl);
+	return 0;
 }
@@ -4,7 +4,7 @@
 #include <inttypes.h>
 
 #define MAGIC		0xccf5ccf5
-#define FS_VER		1
+#define FS_VER		2
 #define BLKSZ		1024
 
 #define NAME_MAX	27	/* +1 termin. +4 ino = 32 per dirent */
@@ -17,7 +17,11 @@
 #define DEV_MINOR(dev)	((dev) & 0xff)
 
 
+#ifdef KERNEL
 typedef uint32_t dev_t;
+#else
+#include <sys/types.h>
+#endif
 typedef uint32_t blkid;
 
 
@@ -27,7 +31,7 @@ struct inode {
 	int ino;
 	int uid, gid, mode;
 	int nlink;
-	dev_t dev;
+	uint32_t dev;
 	uint32_t atime, ctime, mtime;
 	uint32_t size;
 	blkid blk[NDIRBLK];	/* direct blocks */
@@ -62,34 +66,122 @@ struct superblock {
 
 	int root_ino;	/* root direcotry inode number */
 
+	/* number of free blocks and inodes (version 2 and later) */
+	unsigned int free_blocks;
+	unsigned int free_inodes;
+
 	/* the following are valid only at runtime, ignored on disk */
-	uint32_t *ibm;	/* in-memory inode bitmap */
-	uint32_t *bm;	/* in-memory block bitmap */
+	struct bitmap *ibm;	/* in-memory inode bitmap */
+	struct bitmap *bm;	/* in-memory block bitmap */
 	struct inode *root;	/* in-memory root inode */
 
 } __attribute__((packed));
 
+/* In-memory bitmaps are not read in their entirety at mount time. Each block
+ * of the on-disk bitmap (a "group" of BLKSZ * 8 elements) is loaded the first
+ * time it's needed, and at most BM_MAX_LOADED of them are kept in memory.
+ */
+#define BM_MAX_LOADED	32
+
+struct bm_group {
+	uint32_t *bits;	/* bitmap block, or 0 if it's not loaded */
+	int nfree;		/* free elements in the group, -1 if not known yet */
+	int dirty;
+};
+
+struct bitmap {
+	blkid start;			/* first block of the bitmap on disk */
+	unsigned int count;		/* number of bitmap blocks (groups) */
+	unsigned int nbits;		/* number of elements */
+
+	unsigned int nfree;		/* free elements (superblock count, a hint until nunknown is 0) */
+	unsigned int nfree_known;	/* free elements in groups with known nfree */
+	unsigned int nunknown;	/* number of groups with unknown nfree */
+
+	int last;	/* group of the last allocation */
+
+	int loaded[BM_MAX_LOADED], nloaded;
+	struct bm_group *grp;
+};
+
+
+
+/* fragmentation of a file, or a whole volume (see defrag_fs) */
+struct frag_info {
+	unsigned int nblocks;	/* data blocks */
+	unsigned int nextents;	/* runs of physically contiguous data blocks */
+	unsigned int nfiles;	/* files with any data blocks */
+};
+
+/* defrag_fs flags */
+#define DEFRAG_REPORT_ONLY	1
+
+struct filesys;
 
+/* operations of a filesystem type, following the disk filesystem functions
+ * in fs.c, which are the ones used by diskfs_ops.
+ */
+struct fs_operations {
+	void (*umount)(struct filesys *fs);
+
+	int (*get_inode)(struct filesys *fs, int ino, struct inode *inode);
+	int (*put_inode)(struct filesys *fs, struct inode *inode);
+
+	int (*lookup)(struct filesys *fs, struct inode *dir, const char *name);
+	int (*create)(struct filesys *fs, struct inode *dir, const char *name, int mode, struct inode *node);
+	int (*unlink)(struct filesys *fs, struct inode *dir, const char *name);
+
+	int (*read)(struct filesys *fs, struct inode *node, long offs, void *buf, int sz);
+	int (*write)(struct filesys *fs, struct inode *node, long offs, void *buf, int sz);
+	int (*prealloc)(struct filesys *fs, struct inode *node, long offs, long len);
+};
 
 struct filesys {
-	struct block_device *bdev;
+	struct fs_operations *fsop;
+	int root_ino;
 
+	/* disk filesystems only */
+	struct block_device *bdev;
 	struct superblock *sb;
-
 	void *zeroblock;
 
+	void *data;		/* other filesystem types keep their state here */
+
+	char mtpt[PATH_MAX];	/* where it's mounted */
 	struct filesys *next;
 };
 
+extern struct fs_operations diskfs_ops;
+
 /* defined in fs.c */
 int openfs(struct filesys *fs, dev_t dev);
 int mkfs(struct filesys *fs, dev_t dev);
 void closefs(struct filesys *fs);
 int find_inode(const char *path);
 
+int get_inode(struct filesys *fs, int ino, struct inode *inode);
+int put_inode(struct filesys *fs, struct inode *inode);
+
+int lookup(struct filesys *fs, struct inode *dir, const char *name);
+int create_file(struct filesys *fs, struct inode *dir, const char *name, int mode, struct inode *node);
+int unlink_file(struct filesys *fs, struct inode *dir, const char *name);
+
+int read_file(struct filesys *fs, struct inode *node, long offs, void *buf, int sz);
+int write_file(struct filesys *fs, struct inode *node, long offs, void *buf, int sz);
+int copy_file(struct filesys *fs, struct inode *dest, long doffs, struct inode *src, long soffs, int sz);
+int prealloc_file(struct filesys *fs, struct inode *node, long offs, long len);
+int get_file_blocks(struct filesys *fs, struct inode *node, int boffs, int count, blkid *blist);
+
+int get_frag_info(struct filesys *fs, struct inode *node, struct frag_info *fi);
+int frag_score(struct frag_info *fi);
+int defrag_file(struct filesys *fs, struct inode *node);
+int compact_dir(struct filesys *fs, struct inode *dir);
+int defrag_fs(struct filesys *fs, unsigned int flags, struct frag_info *before, struct frag_info *after,
+		void (*report)(int, struct frag_info*, struct frag_info*));
+
 /* defined in fs_sys.c */
 int sys_mount(char *mntpt, char *devname, unsigned int flags);
-int sys_umount(char *devname);
+int sys_umount(char *mtpt);
 
 int sys_open(char *pathname, int flags, unsigned int mode);
 int sys_close(int fd);
@@ -98,5 +190,8 @@ int sys_read(int fd, void *buf, int sz);
 int sys_write(int fd, void *buf, int sz);
 long sys_lseek(int fd, long offs, int from);
 
+int sys_copy_file_range(int fd_in, int fd_out, int sz);
+int sys_fallocate(int fd, long offs, long len);
+
 
 #endif	/* FS_H_ */
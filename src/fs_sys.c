@@ -6,62 +6,377 @@
 #include <assert.h>
 #include <errno.h>
 #include "fs.h"
+#include "tmpfs.h"
 #include "part.h"
 #include "panic.h"
 #include "bdev.h"
 #include "ata.h"
+#include "proc.h"
+#include "file.h"
+#include "config.h"
 
 static dev_t find_rootfs(void);
+static struct filesys *find_mount(const char *mtpt);
+static int fs_busy(struct filesys *fs);
+static struct file *get_file(int fd);
+static int copy_generic(struct file *fout, struct file *fin, int sz);
+static int copy_backward(struct file *fout, struct file *fin, int sz);
+static void readahead(struct file *file, int first, int last);
 
-/* list of mounted filesystems
- * XXX currently only one, the root filesystem
- */
+/* mount table, the root filesystem is always the last one in the list */
 static struct filesys *fslist;
 
 
+/* mount a filesystem at mtpt. devname is either the name of a block device, or
+ * "tmpfs" for a memory filesystem. The root filesystem must be mounted first,
+ * and with a null devname its device is detected automatically.
+ */
 int sys_mount(char *mtpt, char *devname, unsigned int flags)
 {
 	dev_t dev;
-	int err;
+	int err, isroot;
 	struct filesys *fs;
 
-	if(strcmp(mtpt, "/") != 0) {
-		printf("only root can be mounted at the moment\n");
-		return -EBUG;
+	if(!mtpt || mtpt[0] != '/') {
+		return -EINVAL;
 	}
-
-	/* mounting root filesystem */
-	if(fslist) {
-		printf("root already mounted\n");
-		return -EBUSY;
+	if(strlen(mtpt) >= PATH_MAX) {
+		return -ENAMETOOLONG;
 	}
+	isroot = strcmp(mtpt, "/") == 0;
 
-	if(devname) {
-		dev = bdev_by_name(devname);
-	} else {
-		/* try to autodetect it */
-		dev = find_rootfs();
+	if(!isroot && !fslist) {
+		printf("can't mount %s before the root filesystem\n", mtpt);
+		return -EINVAL;
 	}
-	if(!dev) {
-		err = -ENOENT;
-		goto rootfail;
+	if(find_mount(mtpt)) {
+		printf("%s already mounted\n", mtpt);
+		return -EBUSY;
 	}
 
-	if(!(fs = malloc(sizeof *fslist))) {
+	if(!(fs = malloc(sizeof *fs))) {
 		err = -ENOMEM;
-		goto rootfail;
+		goto fail;
 	}
-	if((err = openfs(fs, dev)) != 0) {
+
+	if(devname && strcmp(devname, "tmpfs") == 0) {
+		err = tmpfs_mount(fs, TMPFS_MAX_PAGES);
+	} else {
+		if(devname) {
+			dev = bdev_by_name(devname);
+		} else {
+			/* try to autodetect it */
+			dev = isroot ? find_rootfs() : 0;
+		}
+		err = dev ? openfs(fs, dev) : -ENOENT;
+	}
+	if(err != 0) {
 		free(fs);
-		goto rootfail;
+		goto fail;
 	}
+	memcpy(fs->mtpt, mtpt, strlen(mtpt) + 1);
 
+	fs->next = fslist;
 	fslist = fs;
 	return 0;
 
-rootfail:
-	panic("failed to mount root filesystem: %d\n", -err);
-	return err;	/* unreachable */
+fail:
+	if(isroot) {
+		panic("failed to mount root filesystem: %d\n", -err);
+	}
+	return err;
+}
+
+/* unmount the filesystem mounted at mtpt. Fails with EBUSY if any process has
+ * files open on it, or if it's the root filesystem and others are still
+ * mounted.
+ */
+int sys_umount(char *mtpt)
+{
+	struct filesys *fs, dummy, *prev;
+
+	if(!mtpt || !(fs = find_mount(mtpt))) {
+		return -EINVAL;
+	}
+	if(fs_busy(fs)) {
+		return -EBUSY;
+	}
+	if(!fs->next && fs != fslist) {
+		/* root, but other filesystems are still mounted */
+		return -EBUSY;
+	}
+
+	dummy.next = fslist;
+	prev = &dummy;
+	while(prev->next != fs) {
+		prev = prev->next;
+	}
+	prev->next = fs->next;
+	fslist = dummy.next;
+
+	fs->fsop->umount(fs);
+	free(fs);
+	return 0;
+}
+
+int sys_read(int fd, void *buf, int sz)
+{
+	int res;
+	struct file *file;
+
+	if(!(file = get_file(fd))) {
+		return -EBADF;
+	}
+	if((res = file->fs->fsop->read(file->fs, file->inode, file->ptr, buf, sz)) > 0) {
+		/* the data asked for is already in buf, read ahead of it only now */
+		if(file->fs->fsop == &diskfs_ops) {
+			readahead(file, file->ptr / BLKSZ, (file->ptr + res - 1) / BLKSZ);
+		}
+		file->ptr += res;
+	}
+	return res;
+}
+
+int sys_write(int fd, void *buf, int sz)
+{
+	int res;
+	struct file *file;
+
+	if(!(file = get_file(fd))) {
+		return -EBADF;
+	}
+	if((res = file->fs->fsop->write(file->fs, file->inode, file->ptr, buf, sz)) > 0) {
+		file->ptr += res;
+	}
+	return res;
+}
+
+/* copy sz bytes from the current position of fd_in, to the current position
+ * of fd_out, entirely within the kernel (see copy_file in fs.c, for files on
+ * the same disk filesystem), and advance both file pointers by the number of
+ * bytes copied. Copies within the same file go through the bounce buffer, and
+ * may overlap.
+ */
+int sys_copy_file_range(int fd_in, int fd_out, int sz)
+{
+	int res;
+	struct file *fin, *fout;
+
+	if(!(fin = get_file(fd_in)) || !(fout = get_file(fd_out))) {
+		return -EBADF;
+	}
+	if(fin->fs == fout->fs && fin->inode->ino == fout->inode->ino) {
+		/* a forward copy would overwrite the end of the source before reading
+		 * it, if the destination starts inside the source range
+		 */
+		if(fout->ptr > fin->ptr && fout->ptr - fin->ptr < sz) {
+			res = copy_backward(fout, fin, sz);
+		} else {
+			res = copy_generic(fout, fin, sz);
+		}
+	} else if(fin->fs == fout->fs && fin->fs->fsop == &diskfs_ops) {
+		res = copy_file(fin->fs, fout->inode, fout->ptr, fin->inode, fin->ptr, sz);
+	} else {
+		res = copy_generic(fout, fin, sz);
+	}
+	if(res > 0) {
+		fin->ptr += res;
+		fout->ptr += res;
+	}
+	return res;
+}
+
+/* reserve contiguous disk space for the byte range [offs, offs + len) of an
+ * open file. The file size is not changed (like FALLOC_FL_KEEP_SIZE), the
+ * reserved blocks become part of the file as it grows, and read as zeros
+ * until written.
+ */
+int sys_fallocate(int fd, long offs, long len)
+{
+	struct file *file;
+
+	if(!(file = get_file(fd))) {
+		return -EBADF;
+	}
+	return file->fs->fsop->prealloc(file->fs, file->inode, offs, len);
+}
+
+/* copy between files of different filesystems, or forward within the same
+ * file, through a bounce buffer
+ */
+static int copy_generic(struct file *fout, struct file *fin, int sz)
+{
+	int rd, wr, res = 0;
+	char *buf;
+
+	if(!(buf = malloc(COPY_BUF_SIZE))) {
+		return -ENOMEM;
+	}
+
+	while(sz > 0) {
+		rd = sz < COPY_BUF_SIZE ? sz : COPY_BUF_SIZE;
+		if((rd = fin->fs->fsop->read(fin->fs, fin->inode, fin->ptr + res, buf, rd)) <= 0) {
+			break;
+		}
+		if((wr = fout->fs->fsop->write(fout->fs, fout->inode, fout->ptr + res, buf, rd)) <= 0) {
+			if(!res) res = wr;
+			break;
+		}
+		res += wr;
+		sz -= wr;
+		if(wr < rd) break;
+	}
+
+	free(buf);
+	return res;
+}
+
+/* copy within the same file through a bounce buffer, starting from the end,
+ * for destination ranges which overlap the end of the source range. Since the
+ * end is copied first, a failure part way leaves no meaningful short count,
+ * and returns an error instead.
+ */
+static int copy_backward(struct file *fout, struct file *fin, int sz)
+{
+	int len, res;
+	long offs;
+	char *buf;
+
+	/* there's nothing to copy past the end of the file */
+	if(fin->ptr >= fin->inode->size) {
+		return 0;
+	}
+	if(sz > fin->inode->size - fin->ptr) {
+		sz = fin->inode->size - fin->ptr;
+	}
+
+	if(!(buf = malloc(COPY_BUF_SIZE))) {
+		return -ENOMEM;
+	}
+
+	offs = sz;
+	while(offs > 0) {
+		len = offs < COPY_BUF_SIZE ? offs : COPY_BUF_SIZE;
+		offs -= len;
+
+		if((res = fin->fs->fsop->read(fin->fs, fin->inode, fin->ptr + offs, buf, len)) == len) {
+			res = fout->fs->fsop->write(fout->fs, fout->inode, fout->ptr + offs, buf, len);
+		}
+		if(res != len) {
+			sz = res < 0 ? res : -EIO;
+			break;
+		}
+	}
+
+	free(buf);
+	return sz;
+}
+
+/* Sequential read-ahead, called after reading file blocks [first, last].
+ *
+ * If the read continues where the previous one left off, the access pattern is
+ * considered sequential and a read-ahead window is kept in front of the reader:
+ * it starts at READAHEAD_MIN blocks past the end of the read, and every time
+ * the reader reaches into the current window, the next one is issued right
+ * after it, twice as large (up to READAHEAD_MAX). Any other access pattern
+ * collapses the window. The blocks are mapped to disk block runs through the
+ * inode, and each run goes to blk_prefetch as a single multi-block request.
+ *
+ * It's only issued once the read itself has been copied out, so that the
+ * blocks the reader is waiting for come first, and nothing is prefetched past
+ * the end of a short read. The disk driver polls, so the prefetch still runs
+ * before the system call returns.
+ */
+static void readahead(struct file *file, int first, int last)
+{
+	int i, n, start, size, run;
+	blkid blist[READAHEAD_MAX];
+
+	if(first != file->ra_next && first != file->ra_next - 1) {
+		/* not sequential */
+		file->ra_size = 0;
+		file->ra_next = last + 1;
+		return;
+	}
+	file->ra_next = last + 1;
+
+	if(!file->ra_size) {
+		/* just detected a sequential reader, start with a small window */
+		start = last + 1;
+		size = READAHEAD_MIN;
+	} else if(last >= file->ra_start) {
+		/* the reader caught up with the current window, issue the next one */
+		start = file->ra_start + file->ra_size;
+		if(start <= last) {
+			start = last + 1;
+		}
+		size = file->ra_size * 2;
+		if(size > READAHEAD_MAX) {
+			size = READAHEAD_MAX;
+		}
+	} else {
+		/* still consuming the current window */
+		return;
+	}
+
+	if(get_file_blocks(file->fs, file->inode, start, size, blist) == -1) {
+		return;
+	}
+	file->ra_start = start;
+	file->ra_size = size;
+
+	/* prefetch every physically contiguous run with a single request */
+	for(i=0; i<size; i+=n) {
+		n = 1;
+		if(!blist[i]) continue;
+
+		run = 1;
+		while(i + run < size && blist[i + run] == blist[i] + run) {
+			run++;
+		}
+		blk_prefetch(file->fs->bdev, blist[i], run);
+		n = run;
+	}
+}
+
+static struct filesys *find_mount(const char *mtpt)
+{
+	struct filesys *fs = fslist;
+
+	while(fs) {
+		if(strcmp(fs->mtpt, mtpt) == 0) {
+			return fs;
+		}
+		fs = fs->next;
+	}
+	return 0;
+}
+
+/* returns non-zero if any process has open files on fs */
+static int fs_busy(struct filesys *fs)
+{
+	int i;
+	struct process *p = 0;
+
+	while((p = next_process(p))) {
+		for(i=0; i<MAX_FD; i++) {
+			if(p->files[i].inode && p->files[i].fs == fs) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* returns the open file corresponding to fd in the current process */
+static struct file *get_file(int fd)
+{
+	struct process *p = get_current_proc();
+
+	if(!p || fd < 0 || fd >= MAX_FD || !p->files[fd].inode || !p->files[fd].fs) {
+		return 0;
+	}
+	return p->files + fd;
 }
 
 #define PART_TYPE	0xcc
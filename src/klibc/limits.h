@@ -0,0 +1,22 @@
+#ifndef LIMITS_H_
+#define LIMITS_H_
+
+#define CHAR_BIT	8
+
+#define SCHAR_MIN	(-128)
+#define SCHAR_MAX	127
+#define UCHAR_MAX	255
+
+#define SHRT_MIN	(-32768)
+#define SHRT_MAX	32767
+#define USHRT_MAX	65535
+
+#define INT_MIN		(-INT_MAX - 1)
+#define INT_MAX		2147483647
+#define UINT_MAX	4294967295u
+
+#define LONG_MIN	(-LONG_MAX - 1)
+#define LONG_MAX	2147483647l
+#define ULONG_MAX	4294967295ul
+
+#endif	/* LIMITS_H_ */
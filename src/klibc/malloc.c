@@ -1,209 +1,167 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include "intr.h"
 #include "vm.h"
 #include "panic.h"
+#include "slab.h"
 
 #define MAGIC	0xbaadbeef
 
-struct mem_range {
-	uint32_t start;
-	size_t size;
-	struct mem_range *next;
-};
-
+/* Every allocation starts with an allocation descriptor. Small allocations
+ * (descriptor included) are rounded up to one of the size classes below, and
+ * come from the object cache of that class. Anything larger gets its own run
+ * of pages from pgalloc, which is given back with pgfree when it's freed.
+ *
+ * The requested size in the descriptor determines where a block came from,
+ * so free is O(1), and pages of the size class caches which become entirely
+ * free are returned by the slab allocator.
+ */
 struct alloc_desc {
 	size_t size;
 	uint32_t magic;
 };
 
-static void add_range(struct mem_range *rng);
-static void coalesce(struct mem_range *low, struct mem_range *mid, struct mem_range *high);
-static struct mem_range *alloc_node(void);
-static void free_node(struct mem_range *node);
+#define NUM_CLASSES		(sizeof size_class / sizeof *size_class)
+#define MAX_SMALL		1024
+
+static struct kmem_cache size_class[] = {
+	KMEM_CACHE_INIT("malloc-16", 16, 0),
+	KMEM_CACHE_INIT("malloc-32", 32, 0),
+	KMEM_CACHE_INIT("malloc-48", 48, 0),
+	KMEM_CACHE_INIT("malloc-64", 64, 0),
+	KMEM_CACHE_INIT("malloc-96", 96, 0),
+	KMEM_CACHE_INIT("malloc-128", 128, 0),
+	KMEM_CACHE_INIT("malloc-192", 192, 0),
+	KMEM_CACHE_INIT("malloc-256", 256, 0),
+	KMEM_CACHE_INIT("malloc-384", 384, 0),
+	KMEM_CACHE_INIT("malloc-512", 512, 0),
+	KMEM_CACHE_INIT("malloc-768", 768, 0),
+	KMEM_CACHE_INIT("malloc-1024", MAX_SMALL, 0)
+};
+
+static struct kmem_cache *find_class(size_t alloc_size);
 
-struct mem_range *free_list;
-struct mem_range *node_pool;
+/* usage statistics */
+static unsigned long num_alloc, num_large;
+static unsigned long bytes_req, bytes_alloc, pages_large;
 
 
 void *malloc(size_t sz)
 {
-	void *res = 0;
-	struct mem_range *node, *prev, dummy;
-	int intr_state;
+	int pg, npages, intr_state;
 	struct alloc_desc *desc;
+	struct kmem_cache *cache;
 	size_t alloc_size = sz + sizeof *desc;
 
-	if(!sz) {
+	if(!sz || alloc_size < sz) {
 		return 0;
 	}
 
-	/* entering the critical section, do not disturb */
-	intr_state = get_intr_state();
-	disable_intr();
-
-find_range:
-	prev = &dummy;
-	dummy.next = node = free_list;
-	while(node) {
-		/* find a node in the free_list with enough space ... */
-		if(node->size >= alloc_size) {
-			/* insert the allocation descriptor at the beginning */
-			desc = (void*)node->start;
-			desc->size = alloc_size;
-			desc->magic = MAGIC;
-			res = desc + 1; /* that's what we'll return to the user */
-
-			/* modify the node to reflect the new range after we
-			 * grabbed a part at the beginning...
-			 */
-			node->size -= alloc_size;
-			node->start += alloc_size;
-
-			/* if the range represented by this node now has zero size,
-			 * remove and free the node (it goes into the node_pool)
-			 */
-			if(!node->size) {
-				prev->next = node->next;
-				if(free_list == node) {
-					free_list = node->next;
-				}
-				free_node(node);
-			}
-			break;
+	if((cache = find_class(alloc_size))) {
+		if(!(desc = kmem_cache_alloc(cache))) {
+			return 0;
 		}
-		prev = node;
-		node = node->next;
-	}
-
-	/* we didn't find a range big enough in the free_list. In that case
-	 * we need to allocate some pages, add them to the free_list and try
-	 * again.
-	 */
-	if(!res) {
-		struct mem_range *range;
-		int pg, pgcount = (PGSIZE - 1 + alloc_size) / PGSIZE;
-
-		if((pg = pgalloc(pgcount, MEM_KERNEL)) == -1) {
-			set_intr_state(intr_state);
+		alloc_size = cache->size;
+	} else {
+		npages = (alloc_size + PGSIZE - 1) / PGSIZE;
+		if((pg = pgalloc(npages, MEM_KERNEL)) == -1) {
 			return 0;
 		}
+		desc = (struct alloc_desc*)PAGE_TO_ADDR(pg);
+		alloc_size = npages * PGSIZE;
+	}
+	desc->size = sz;
+	desc->magic = MAGIC;
+
+	intr_state = get_intr_state();
+	disable_intr();
 
-		range = alloc_node();
-		range->start = PAGE_TO_ADDR(pg);
-		range->size = pgcount * PGSIZE;
-		add_range(range);
-		goto find_range;
+	num_alloc++;
+	bytes_req += sz;
+	bytes_alloc += alloc_size;
+	if(!cache) {
+		num_large++;
+		pages_large += alloc_size / PGSIZE;
 	}
 
 	set_intr_state(intr_state);
-	return res;
+	return desc + 1;
 }
 
 void free(void *ptr)
 {
-	int intr_state;
+	int npages, intr_state;
+	size_t sz, alloc_size;
 	struct alloc_desc *desc;
-	struct mem_range *rng;
+	struct kmem_cache *cache;
 
 	if(!ptr) return;
 
-	intr_state = get_intr_state();
-	disable_intr();
-
 	desc = (struct alloc_desc*)ptr - 1;
 	if(desc->magic != MAGIC) {
 		panic("free(%x) magic missmatch, invalid address.\n", (unsigned int)ptr);
 	}
+	desc->magic = 0;	/* catch double frees */
+	sz = desc->size;
 
-	rng = alloc_node();
-	rng->start = (uint32_t)desc;
-	rng->size = desc->size;
-	add_range(rng);
-
-	set_intr_state(intr_state);
-}
-
-static void add_range(struct mem_range *rng)
-{
-	struct mem_range *node, *prev = 0;
+	if((cache = find_class(sz + sizeof *desc))) {
+		alloc_size = cache->size;
+		kmem_cache_free(cache, desc);
+	} else {
+		npages = (sz + sizeof *desc + PGSIZE - 1) / PGSIZE;
+		alloc_size = npages * PGSIZE;
+		pgfree(ADDR_TO_PAGE(desc), npages);
+	}
 
-	if(!free_list || free_list->start > rng->start) {
-		rng->next = free_list;
-		free_list = rng;
+	intr_state = get_intr_state();
+	disable_intr();
 
-	} else {
-		node = free_list;
-
-		while(node) {
-			if(!node->next || node->next->start > rng->start) {
-				rng->next = node->next;
-				node->next = rng;
-				prev = node;	/* needed by coalesce after the loop */
-				break;
-			}
-
-			prev = node;
-			node = node->next;
-		}
+	num_alloc--;
+	bytes_req -= sz;
+	bytes_alloc -= alloc_size;
+	if(!cache) {
+		num_large--;
+		pages_large -= alloc_size / PGSIZE;
 	}
 
-	coalesce(prev, rng, rng->next);
+	set_intr_state(intr_state);
 }
 
-static void coalesce(struct mem_range *low, struct mem_range *mid, struct mem_range *high)
+/* print usage and fragmentation statistics. Internal fragmentation is the
+ * space lost by rounding allocations up to their size class or to whole
+ * pages, and the size class caches report how full their pages are.
+ */
+void malloc_stats(void)
 {
-	if(high) {
-		if(mid->start + mid->size >= high->start) {
-			mid->size = high->size - mid->start;
-			mid->next = high->next;
-			free_node(high);
-		}
-	}
+	int i, frag, slab_bytes = 0, slab_used = 0;
+	struct kmem_cache *c;
 
-	if(low) {
-		if(low->start + low->size >= mid->start) {
-			low->size = mid->size - low->start;
-			low->next = mid->next;
-			free_node(mid);
-		}
+	for(i=0; i<NUM_CLASSES; i++) {
+		c = size_class + i;
+		slab_bytes += c->nslabs * PGSIZE;
+		slab_used += c->nobj * c->size;
 	}
+	frag = bytes_alloc ? (bytes_alloc - bytes_req) * 100 / bytes_alloc : 0;
+
+	printf("malloc: %lu blocks (%lu large), %lu bytes requested, %lu allocated\n",
+			num_alloc, num_large, bytes_req, bytes_alloc);
+	printf("  internal fragmentation: %d%%\n", frag);
+	printf("  size classes: %d pages, %d%% used\n", slab_bytes / PGSIZE,
+			slab_bytes ? slab_used * 100 / slab_bytes : 0);
+	printf("  large blocks: %lu pages\n", pages_large);
 }
 
-static struct mem_range *alloc_node(void)
+static struct kmem_cache *find_class(size_t alloc_size)
 {
-	struct mem_range *node;
-
-	/* no nodes available for reuse...
-	 * grab a page, slice it into nodes, link them up and hang them in the pool
-	 */
-	if(!node_pool) {
-		int i, num_nodes, pg;
-		struct mem_range *nodepage;
-
-		pg = pgalloc(1, MEM_KERNEL);
-		if(pg == -1) {
-			panic("failed to allocate page for the malloc node pool\n");
-			return 0;	/* unreachable */
-		}
+	int i;
 
-		nodepage = (struct mem_range*)PAGE_TO_ADDR(pg);
-		num_nodes = PGSIZE / sizeof *nodepage;
-
-		for(i=1; i<num_nodes; i++) {
-			nodepage[i - 1].next = nodepage + i;
+	if(alloc_size > MAX_SMALL) {
+		return 0;
+	}
+	for(i=0; i<NUM_CLASSES; i++) {
+		if(size_class[i].size >= alloc_size) {
+			return size_class + i;
 		}
-		nodepage[i - 1].next = 0;
-		node_pool = nodepage;
 	}
-
-	node = node_pool;
-	node_pool = node->next;
-	node->next = 0;
-	return node;
-}
-
-static void free_node(struct mem_range *node)
-{
-	node->next = node_pool;
-	node_pool = node;
+	return 0;
 }
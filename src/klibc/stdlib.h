@@ -16,5 +16,6 @@ void utoa(unsigned int val, char *buf, int base);
 /* defined in malloc.c */
 void *malloc(size_t sz);
 void free(void *ptr);
+void malloc_stats(void);
 
 #endif	/* STDLIB_H_ */
@@ -1,8 +1,49 @@
 #include <string.h>
+#include <inttypes.h>
+
+/* The memory functions do the bulk of their work a 32bit word at a time with
+ * the string instructions (rep stosl/movsl), after writing enough single bytes
+ * to align the destination. Anything shorter than MIN_WORDOP bytes isn't worth
+ * the setup, and is done a byte at a time.
+ *
+ * The string functions scan a word at a time too, once the pointer is
+ * aligned: aligned words never cross a page boundary, so reading past the
+ * terminating zero can't fault. HAS_ZERO(x) is non-zero if any byte of x is
+ * zero, and the first one is found by going through the bytes of the word.
+ */
+#define MIN_WORDOP	16
+
+#define ONES		0x01010101
+#define HIGHS		0x80808080
+#define HAS_ZERO(x)	(((x) - ONES) & ~(x) & HIGHS)
+
+#define ALIGNED(p)	(((uint32_t)(p) & 3) == 0)
+
+/* aligned string words can be accessed through any type */
+typedef uint32_t __attribute__ ((may_alias)) word_t;
 
 void memset(void *s, int c, size_t n)
 {
 	char *ptr = s;
+	uint32_t val;
+	size_t nwords;
+
+	if(n >= MIN_WORDOP) {
+		while(!ALIGNED(ptr)) {
+			*ptr++ = c;
+			n--;
+		}
+
+		val = (c & 0xff) * ONES;
+		nwords = n >> 2;
+		asm volatile(
+			"rep stosl\n\t"
+			: "+D" (ptr), "+c" (nwords)
+			: "a" (val)
+			: "memory");
+		n &= 3;
+	}
+
 	while(n--) {
 		*ptr++ = c;
 	}
@@ -13,7 +54,27 @@ void memset(void *s, int c, size_t n)
  */
 void memset16(void *s, int c, size_t n)
 {
-	short *ptr = s;
+	uint16_t *ptr = s;
+	uint32_t val;
+	size_t nwords;
+
+	/* pairs of values at a time, unless they're not even 16bit aligned */
+	if(n >= MIN_WORDOP / 2 && ((uint32_t)ptr & 1) == 0) {
+		if(!ALIGNED(ptr)) {
+			*ptr++ = c;
+			n--;
+		}
+
+		val = (c & 0xffff) | ((uint32_t)c << 16);
+		nwords = n >> 1;
+		asm volatile(
+			"rep stosl\n\t"
+			: "+D" (ptr), "+c" (nwords)
+			: "a" (val)
+			: "memory");
+		n &= 1;
+	}
+
 	while(n--) {
 		*ptr++ = c;
 	}
@@ -23,6 +84,21 @@ void *memcpy(void *dest, const void *src, size_t n)
 {
 	char *dptr = dest;
 	const char *sptr = src;
+	size_t count;
+
+	if(n >= MIN_WORDOP) {
+		while(!ALIGNED(dptr)) {
+			*dptr++ = *sptr++;
+			n--;
+		}
+
+		count = n >> 2;
+		asm volatile(
+			"rep movsl\n\t"
+			: "+D" (dptr), "+S" (sptr), "+c" (count)
+			:: "memory");
+		n &= 3;
+	}
 
 	while(n--) {
 		*dptr++ = *sptr++;
@@ -32,45 +108,91 @@ void *memcpy(void *dest, const void *src, size_t n)
 
 void *memmove(void *dest, const void *src, size_t n)
 {
-	int i;
 	char *dptr;
 	const char *sptr;
+	word_t *wdptr;
+	const word_t *wsptr;
 
-	if(dest <= src) {
-		/* forward copy */
-		dptr = dest;
-		sptr = src;
-		for(i=0; i<n; i++) {
-			*dptr++ = *sptr++;
-		}
-	} else {
-		/* backwards copy */
-		dptr = dest + n - 1;
-		sptr = src + n - 1;
-		for(i=0; i<n; i++) {
-			*dptr-- = *sptr--;
-		}
+	if((char*)dest <= (char*)src || (char*)dest >= (char*)src + n) {
+		/* copying forward is safe, each word is read before it's overwritten */
+		return memcpy(dest, src, n);
 	}
 
+	/* backwards copy: the odd bytes at the end first, then whole words. This
+	 * isn't done with std; rep movsl, because string instructions going
+	 * backwards are much slower than a plain loop.
+	 */
+	dptr = (char*)dest + n;
+	sptr = (const char*)src + n;
+
+	while(n & 3) {
+		*--dptr = *--sptr;
+		n--;
+	}
+
+	wdptr = (word_t*)dptr;
+	wsptr = (const word_t*)sptr;
+	n >>= 2;
+	while(n--) {
+		*--wdptr = *--wsptr;
+	}
 	return dest;
 }
 
 size_t strlen(const char *s)
 {
-	size_t len = 0;
-	while(*s++) len++;
-	return len;
+	const char *ptr = s;
+	const word_t *wptr;
+
+	while(!ALIGNED(ptr)) {
+		if(!*ptr) return ptr - s;
+		ptr++;
+	}
+
+	wptr = (const word_t*)ptr;
+	while(!HAS_ZERO(*wptr)) {
+		wptr++;
+	}
+
+	ptr = (const char*)wptr;
+	while(*ptr) ptr++;
+	return ptr - s;
 }
 
 char *strchr(const char *s, int c)
 {
-	while(*s) {
+	uint32_t word, cmask;
+	const word_t *wptr;
+
+	c = (char)c;
+
+	while(!ALIGNED(s)) {
 		if(*s == c) {
 			return (char*)s;
 		}
+		if(!*s) return 0;
+		s++;
+	}
+
+	/* skip whole words which contain neither c nor the terminator */
+	cmask = (c & 0xff) * ONES;
+	wptr = (const word_t*)s;
+	for(;;) {
+		word = *wptr;
+		if(HAS_ZERO(word) || HAS_ZERO(word ^ cmask)) {
+			break;
+		}
+		wptr++;
+	}
+
+	s = (const char*)wptr;
+	for(;;) {
+		if(*s == c) {
+			return (char*)s;
+		}
+		if(!*s) return 0;
 		s++;
 	}
-	return 0;
 }
 
 char *strrchr(const char *s, int c)
@@ -109,6 +231,28 @@ char *strstr(const char *str, const char *substr)
 
 int strcmp(const char *s1, const char *s2)
 {
+	const word_t *w1, *w2;
+
+	/* words can only be compared if both strings are aligned the same way */
+	if(((uint32_t)s1 & 3) == ((uint32_t)s2 & 3)) {
+		while(!ALIGNED(s1)) {
+			if(!*s1 || *s1 != *s2) {
+				return *s1 - *s2;
+			}
+			s1++;
+			s2++;
+		}
+
+		w1 = (const word_t*)s1;
+		w2 = (const word_t*)s2;
+		while(*w1 == *w2 && !HAS_ZERO(*w1)) {
+			w1++;
+			w2++;
+		}
+		s1 = (const char*)w1;
+		s2 = (const char*)w2;
+	}
+
 	while(*s1 && *s1 == *s2) {
 		s1++;
 		s2++;
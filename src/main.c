@@ -12,6 +12,7 @@
 #include "mem.h"
 #include "vm.h"
 #include "proc.h"
+#include "swap.h"
 
 
 void kmain(struct mboot_info *mbinf)
@@ -39,6 +40,8 @@ void kmain(struct mboot_info *mbinf)
 
 	/* initialize ATA disks */
 	init_ata();
+	/* start paging out to the first swap partition, if there is one */
+	init_swap();
 	/* initialize the filesystem */
 	/*init_fs();*/
 
@@ -4,6 +4,7 @@
 #include "panic.h"
 #include "vm.h"
 #include "intr.h"
+#include "config.h"
 
 #define FREE		0
 #define USED		1
@@ -13,176 +14,332 @@
 
 #define IS_FREE(pg) ((bitmap[BM_IDX(pg)] & (1 << BM_BIT(pg))) == 0)
 
+/* buddy of the order-sized block starting at page pg */
+#define BUDDY(pg, order)	((pg) ^ (1 << (order)))
+
+#define PAGE_ZONE(pg)		((pg) >= HIGHMEM_START_PAGE ? ZONE_HIGH : ZONE_LOW)
+
+#define NEXT_MMAP(m)	((struct mboot_mmap*)((char*)(m) + (m)->skip + sizeof (m)->skip))
+
+static int mmap_range(struct mboot_mmap *mem, uint64_t *start, uint64_t *end);
+static void print_range(const char *type, uint64_t start, uint64_t end);
+static uint32_t find_db_space(struct mboot_info *mb, uint32_t start, uint32_t size);
 static void mark_page(int pg, int free);
-static void add_memory(uint32_t start, size_t size);
+static void lock_pages(uint32_t start, uint32_t end);
+static void add_memory(uint64_t start, uint64_t end);
+static void init_buddy(void);
+static int alloc_block(int zone, int order);
+static void free_block(int pg, int order);
+static void add_free_block(int pg, int order);
+static void rm_free_block(int pg);
+static uint32_t take_pooled_page(void);
 
 /* end of kernel image */
 extern int _end;
 
-/* A bitmap is used to track which physical memory pages are used or available
- * for allocation by alloc_phys_page.
+/* A bitmap is used to track which physical memory pages are used or available,
+ * and on top of it a binary buddy allocator hands out blocks of 2^order
+ * contiguous pages.
  *
- * last_alloc_idx keeps track of the last 32bit element in the bitmap array
- * where a free page was found. It's guaranteed that all the elements before
- * this have no free pages, but it doesn't imply that there will be another
- * free page there. So it's used as a starting point for the search.
+ * Memory above 4gb (high memory, only reachable through PAE page tables) has
+ * its own free lists. Physical addresses there don't fit in 32 bits, and the
+ * kernel can't access them without mapping them first, so the functions
+ * dealing in physical addresses only ever allocate memory below 4gb. High
+ * memory is only handed out by alloc_page_frame, which deals in page numbers,
+ * and the VM code uses it for user memory.
+ *
+ * Everything else we know about each physical page is kept in the frame
+ * database: an array of struct page (see mem.h) indexed by page number, sized
+ * for the memory reported by the boot loader. It can get quite large (24
+ * bytes per page of physical memory), so together with the bitmap it goes in
+ * the first available memory region after the kernel image large enough to
+ * hold them.
+ *
+ * Every free block is the head of a doubly linked list of blocks of the same
+ * order (free_list), and the links live in the struct page of its first page,
+ * since the free pages themselves are not mapped anywhere once paging is
+ * enabled. The order field of a page is the order of the free block starting
+ * at that page, or -1 if it's not the start of a free block. Freeing a block
+ * merges it with its buddy, for as long as the buddy is also free and of the
+ * same order.
  */
 static uint32_t *bitmap;
-static int bmsize, last_alloc_idx;
+static int bmsize, max_pages;
+
+static struct page *frames;
+static int free_list[NUM_ZONES][PHYS_MAX_ORDER + 1];
+
+/* Pages which are already zero-filled, handed out by alloc_phys_page_flags
+ * with PHYS_ZEROED. The pool is refilled by the idle loop, so that clearing
+ * pages happens when the CPU would otherwise be halted, instead of in the
+ * page fault path. The pages in the pool are marked as used, so when the free
+ * lists run dry, single page allocations fall back to taking them from the
+ * pool, rather than failing (or swapping) with perfectly good pages idle.
+ */
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_count;
 
 
 void init_mem(struct mboot_info *mb)
 {
-	int i, num_pages, max_pg = 0;
-	uint32_t used_end;
+	int max_pg = 0;
+	uint32_t img_end, db_start, db_size;
+	uint64_t start, end;
+	struct mboot_mmap *mem, *mmap_end = 0;
 
-	num_pages = 0;
-	last_alloc_idx = 0;
+	if(mb->flags & MB_MMAP) {
+		/* find the end of memory first, which determines the size of the
+		 * bitmap and the frame database
+		 */
+		mmap_end = (struct mboot_mmap*)((char*)mb->mmap + mb->mmap_len);
+		for(mem = mb->mmap; mem < mmap_end; mem = NEXT_MMAP(mem)) {
+			if(mem->type == MB_MEM_VALID && mmap_range(mem, &start, &end) != -1) {
+				if(max_pg < (int)(end >> 12)) {
+					max_pg = end >> 12;
+				}
+			}
+		}
+	} else if(mb->flags & MB_MEM) {
+		max_pg = ADDR_TO_PAGE(0x100000) + mb->mem_upper / 4;
+	} else {
+		/* I don't think this should ever happen with a multiboot-compliant boot loader */
+		panic("didn't get any memory info from the boot loader, I give up\n");
+	}
 
-	/* the allocation bitmap starts right at the end of the ELF image */
-	bitmap = (uint32_t*)&_end;
+	max_pages = max_pg;
+	bmsize = (max_pg + 31) / 32 * 4;	/* size of the useful bitmap in bytes */
 
-	/* start by marking all posible pages (2**20) as used. We do not "reserve"
-	 * all this space. Pages beyond the end of the useful bitmap area
-	 * ((char*)bitmap + bmsize), which will be determined after we traverse the
-	 * memory map, are going to be marked as available for allocation.
+	/* the allocation bitmap is followed by the frame database, at the next
+	 * page boundary, both past the end of the ELF image
 	 */
-	memset(bitmap, 0xff, 1024 * 1024 / 8);
+	img_end = ((uint32_t)&_end + PGOFFS_MASK) & ~PGOFFS_MASK;
+	db_size = ((bmsize + PGOFFS_MASK) & ~PGOFFS_MASK) + max_pg * sizeof *frames;
+	if(!(db_start = find_db_space(mb, img_end, db_size))) {
+		panic("no room for the frame database (%u bytes) in the memory map\n", db_size);
+	}
+	bitmap = (uint32_t*)db_start;
+	frames = (struct page*)(db_start + ((bmsize + PGOFFS_MASK) & ~PGOFFS_MASK));
 
-	/* if the bootloader gave us an available memory map, traverse it and mark
-	 * all the corresponding pages as free.
+	/* Start by marking all pages as used, and then mark the available ones as
+	 * free as we traverse the memory map.
 	 */
-	if(mb->flags & MB_MMAP) {
-		struct mboot_mmap *mem, *mmap_end;
-
-		mem = mb->mmap;
-		mmap_end = (struct mboot_mmap*)((char*)mb->mmap + mb->mmap_len);
+	memset(bitmap, 0xff, bmsize);
 
+	if(mb->flags & MB_MMAP) {
 		printf("memory map:\n");
-		while(mem < mmap_end) {
-			/* ignore memory ranges that start beyond the 4gb mark */
-			if(mem->base_high == 0 && mem->base_low != 0xffffffff) {
-				char *type;
-				unsigned int end, rest = 0xffffffff - mem->base_low;
-
-				/* make sure the length does not extend beyond 4gb */
-				if(mem->length_high || mem->length_low > rest) {
-					mem->length_low = rest;
-				}
-				end	= mem->base_low + mem->length_low;
-
-				if(mem->type == MB_MEM_VALID) {
-					type = "free:";
-					add_memory(mem->base_low, mem->length_low);
-
-					num_pages = ADDR_TO_PAGE(mem->base_low + mem->length_low);
-					if(max_pg < num_pages) {
-						max_pg = num_pages;
-					}
-				} else {
-					type = "hole:";
-				}
-
-				printf("  %s %x - %x (%u bytes)\n", type, mem->base_low, end, mem->length_low);
+		for(mem = mb->mmap; mem < mmap_end; mem = NEXT_MMAP(mem)) {
+			if(mmap_range(mem, &start, &end) == -1) {
+				continue;
 			}
-			mem = (struct mboot_mmap*)((char*)mem + mem->skip + sizeof mem->skip);
+			if(mem->type == MB_MEM_VALID) {
+				add_memory(start, end);
+			}
+			print_range(mem->type == MB_MEM_VALID ? "free:" : "hole:", start, end);
 		}
-	} else if(mb->flags & MB_MEM) {
+	} else {
 		/* if we don't have a detailed memory map, just use the lower and upper
 		 * memory block sizes to determine which pages should be available.
 		 */
-		add_memory(0, mb->mem_lower);
-		add_memory(0x100000, mb->mem_upper * 1024);
-		max_pg = mb->mem_upper / 4;
+		add_memory(0, mb->mem_lower * 1024);
+		add_memory(0x100000, 0x100000 + mb->mem_upper * 1024);
 
 		printf("lower memory: %ukb, upper mem: %ukb\n", mb->mem_lower, mb->mem_upper);
-	} else {
-		/* I don't think this should ever happen with a multiboot-compliant boot loader */
-		panic("didn't get any memory info from the boot loader, I give up\n");
 	}
 
-	bmsize = max_pg / 8;	/* size of the useful bitmap in bytes */
+	if(max_pg > HIGHMEM_START_PAGE) {
+		printf("high memory: %d pages above 4gb\n", max_pg - HIGHMEM_START_PAGE);
+	}
+
+	memset(frames, 0, max_pg * sizeof *frames);
+
+	/* the low memory, the kernel image, and the bitmap and frame database
+	 * are used, and never go away
+	 */
+	printf("frame database: %x - %x\n", db_start, db_start + db_size);
+	lock_pages(0, img_end);
+	lock_pages(db_start, db_start + db_size);
 
-	/* mark all the used pages as ... well ... used */
-	used_end = ((uint32_t)bitmap + bmsize - 1);
+	init_buddy();
+}
 
-	printf("marking pages up to %x ", used_end);
-	used_end = ADDR_TO_PAGE(used_end);
-	printf("(page: %d) inclusive as used\n", used_end);
+/* alloc_phys_pages allocates a block of 2^order physically contiguous pages
+ * below 4gb, aligned to its size, and returns its address. The smallest free
+ * block that fits is split in halves as many times as necessary, and the
+ * unused halves go to the free lists of the lower orders. If there's no free
+ * block large enough, 0 is returned, except for single pages, which are then
+ * taken from the zero pool as a last resort.
+ */
+uint32_t alloc_phys_pages(int order)
+{
+	int pg;
 
-	for(i=0; i<=used_end; i++) {
-		mark_page(i, USED);
+	if(order < 0 || order > PHYS_MAX_ORDER) {
+		return 0;
+	}
+	if((pg = alloc_block(ZONE_LOW, order)) == -1) {
+		return order == 0 ? take_pooled_page() : 0;
 	}
+	return PAGE_TO_ADDR(pg);
 }
 
-/* alloc_phys_page finds the first available page of physical memory,
- * marks it as used in the bitmap, and returns its address. If there's
- * no unused physical page, 0 is returned.
+/* alloc_phys_page allocates a single page of physical memory, and returns its
+ * address. If there's no unused physical page, 0 is returned.
  */
 uint32_t alloc_phys_page(void)
 {
-	int i, idx, max, intr_state;
+	return alloc_phys_pages(0);
+}
 
-	intr_state = get_intr_state();
-	disable_intr();
+/* free_phys_pages returns a block of 2^order pages, previously allocated with
+ * alloc_phys_pages, to the free lists, merging it with its buddies.
+ *
+ * It's also fine to free the pages of a block one at a time, or in smaller
+ * aligned blocks, they will be merged back together as they're freed.
+ *
+ * Freeing a locked page (the kernel image, the frame database, the zero page)
+ * is a bug, and panics. CAUTION: otherwise no checks are done that this page
+ * should actually be freed or not. If you call free_phys_page with the address
+ * of some part of memory that was originally reserved due to it being in a
+ * memory hole, it will be subsequently allocatable by alloc_phys_page.
+ */
+void free_phys_pages(uint32_t addr, int order)
+{
+	free_block(ADDR_TO_PAGE(addr), order);
+}
 
-	idx = last_alloc_idx;
-	max = bmsize / 4;
+void free_phys_page(uint32_t addr)
+{
+	free_block(ADDR_TO_PAGE(addr), 0);
+}
 
-	while(idx <= max) {
-		/* if at least one bit is 0 then we have at least
-		 * one free page. find it and allocate it.
-		 */
-		if(bitmap[idx] != 0xffffffff) {
-			for(i=0; i<32; i++) {
-				int pg = idx * 32 + i;
+/* alloc_page_frame allocates a single page anywhere in physical memory, and
+ * returns its page number, or -1 if we're out of memory. High memory is used
+ * first, to leave the memory below 4gb for everything else.
+ */
+int alloc_page_frame(void)
+{
+	int pg;
+	uint32_t addr;
+
+	if((pg = alloc_block(ZONE_HIGH, 0)) == -1 && (pg = alloc_block(ZONE_LOW, 0)) == -1) {
+		if((addr = take_pooled_page())) {
+			pg = ADDR_TO_PAGE(addr);
+		}
+	}
+	return pg;
+}
+
+/* free a page allocated with alloc_page_frame, or any other single page */
+void free_page_frame(int pg)
+{
+	free_block(pg, 0);
+}
 
-				if(IS_FREE(pg)) {
-					mark_page(pg, USED);
+/* alloc_phys_page_flags allocates a single page like alloc_phys_page. With
+ * PHYS_ZEROED the page is zero-filled: it's taken from the pool of pre-zeroed
+ * pages if possible, otherwise it's cleared on the spot through a temporary
+ * mapping. PHYS_POOL_ONLY makes it return 0 instead of clearing the page, for
+ * callers which can clear a page cheaper themselves, when it's mapped.
+ */
+uint32_t alloc_phys_page_flags(unsigned int flags)
+{
+	uint32_t addr;
+	int intr_state;
 
-					last_alloc_idx = idx;
+	if(!(flags & PHYS_ZEROED)) {
+		return alloc_phys_pages(0);
+	}
 
-					/*printf("alloc_phys_page() -> %x (page: %d)\n", PAGE_TO_ADDR(pg), pg);*/
+	intr_state = get_intr_state();
+	disable_intr();
 
-					set_intr_state(intr_state);
-					return PAGE_TO_ADDR(pg);
-				}
-			}
-			panic("can't happen: alloc_phys_page (mem.c)\n");
-		}
-		idx++;
+	if(zero_pool_count > 0) {
+		addr = zero_pool[--zero_pool_count];
+	} else if(flags & PHYS_POOL_ONLY) {
+		addr = 0;
+	} else if((addr = alloc_phys_pages(0))) {
+		zero_phys_page(addr);
 	}
 
 	set_intr_state(intr_state);
-	return 0;
+	return addr;
 }
 
-/* free_phys_page marks the physical page which corresponds to the specified
- * address as free in the allocation bitmap.
- *
- * CAUTION: no checks are done that this page should actually be freed or not.
- * If you call free_phys_page with the address of some part of memory that was
- * originally reserved due to it being in a memory hole or part of the kernel
- * image or whatever, it will be subsequently allocatable by alloc_phys_page.
+/* called repeatedly by the idle loop, clears one more page and adds it to the
+ * pool of pre-zeroed pages. Each call does a small, bounded amount of work,
+ * with interrupts disabled only for its duration. Returns 1 if a page was
+ * added, 0 if the pool is full or there's no free memory.
  */
-void free_phys_page(uint32_t addr)
+int refill_zero_pool(void)
 {
-	int pg = ADDR_TO_PAGE(addr);
-	int bmidx = BM_IDX(pg);
-
+	uint32_t addr;
+	int pg, res = 0;
 	int intr_state = get_intr_state();
 	disable_intr();
 
-	if(IS_FREE(pg)) {
-		panic("free_phys_page(%d): I thought that was already free!\n", pg);
+	/* straight from the free lists, alloc_phys_pages could hand us a pool page */
+	if(zero_pool_count < ZERO_POOL_SIZE && (pg = alloc_block(ZONE_LOW, 0)) != -1) {
+		addr = PAGE_TO_ADDR(pg);
+		zero_phys_page(addr);
+		zero_pool[zero_pool_count++] = addr;
+		res = 1;
 	}
 
-	mark_page(pg, FREE);
-	if(bmidx < last_alloc_idx) {
-		last_alloc_idx = bmidx;
+	set_intr_state(intr_state);
+	return res;
+}
+
+/* pops a page from the pre-zeroed pool, or returns 0 if it's empty */
+static uint32_t take_pooled_page(void)
+{
+	uint32_t addr = 0;
+	int intr_state = get_intr_state();
+	disable_intr();
+
+	if(zero_pool_count > 0) {
+		addr = zero_pool[--zero_pool_count];
 	}
 
 	set_intr_state(intr_state);
+	return addr;
+}
+
+/* returns the frame database entry of physical page pg, or 0 if it's beyond
+ * the end of memory
+ */
+struct page *get_page_frame(int pg)
+{
+	return pg >= 0 && pg < max_pages ? frames + pg : 0;
+}
+
+/* User pages can be mapped by more than one page table after fork, so they
+ * carry a reference count: the number of user page table entries pointing to
+ * them. It's maintained by the VM code as it writes and clears user page
+ * table entries, and a page is freed when its count drops to 0.
+ */
+int get_page_ref(int pg)
+{
+	return pg >= 0 && pg < max_pages ? frames[pg].nref : 0;
+}
+
+void ref_page(int pg)
+{
+	if(pg >= 0 && pg < max_pages) {
+		frames[pg].nref++;
+		frames[pg].flags |= PAGE_USER;
+	}
+}
+
+/* returns the new reference count */
+int unref_page(int pg)
+{
+	if(pg < 0 || pg >= max_pages) {
+		return 0;
+	}
+	if(!frames[pg].nref) {
+		panic("unref_page(%d): page not referenced\n", pg);
+	}
+	return --frames[pg].nref;
 }
 
 /* this is only ever used by the VM init code to find out what the extends of
@@ -194,7 +351,7 @@ void get_kernel_mem_range(uint32_t *start, uint32_t *end)
 		*start = 0x100000;
 	}
 	if(end) {
-		uint32_t e = (uint32_t)bitmap + bmsize;
+		uint32_t e = (uint32_t)(frames + max_pages);
 
 		if(e & PGOFFS_MASK) {
 			*end = (e + 4096) & ~PGOFFS_MASK;
@@ -204,17 +361,83 @@ void get_kernel_mem_range(uint32_t *start, uint32_t *end)
 	}
 }
 
+/* find the lowest address, at or after start, where size bytes fit in a
+ * single available region of memory, and which is still identity mapped
+ * below the kernel address space. Returns the page-aligned address, or 0 if
+ * there isn't any.
+ */
+static uint32_t find_db_space(struct mboot_info *mb, uint32_t start, uint32_t size)
+{
+	uint64_t rstart, rend, best = 0;
+	struct mboot_mmap *mem, *mmap_end;
+
+	if(!(mb->flags & MB_MMAP)) {
+		rend = 0x100000 + (uint64_t)mb->mem_upper * 1024;
+		rstart = (uint64_t)start + size;
+		return rstart <= rend && rstart <= KMEM_START ? start : 0;
+	}
+
+	mmap_end = (struct mboot_mmap*)((char*)mb->mmap + mb->mmap_len);
+	for(mem = mb->mmap; mem < mmap_end; mem = NEXT_MMAP(mem)) {
+		if(mem->type != MB_MEM_VALID || mmap_range(mem, &rstart, &rend) == -1) {
+			continue;
+		}
+		rstart = (rstart + PGOFFS_MASK) & ~(uint64_t)PGOFFS_MASK;
+		if(rstart < start) {
+			rstart = start;
+		}
+		if(rstart + size <= rend && rstart + size <= KMEM_START && (!best || rstart < best)) {
+			best = rstart;
+		}
+	}
+	return (uint32_t)best;
+}
+
+/* the range of a memory map entry, clipped to the memory we can use.
+ * Returns -1 if none of it is usable.
+ */
+static int mmap_range(struct mboot_mmap *mem, uint64_t *start, uint64_t *end)
+{
+	uint64_t limit = (uint64_t)MAX_PHYS_PAGES << 12;
+
+	*start = ((uint64_t)mem->base_high << 32) | mem->base_low;
+	*end = *start + (((uint64_t)mem->length_high << 32) | mem->length_low);
+
+	if(*start >= limit || *end <= *start) {
+		return -1;
+	}
+	if(*end > limit) {
+		*end = limit;
+	}
+	return 0;
+}
+
+static void print_range(const char *type, uint64_t start, uint64_t end)
+{
+	if(end >> 32) {
+		printf("  %s %x%08x - %x%08x (%ukb)\n", type, (unsigned int)(start >> 32),
+				(unsigned int)start, (unsigned int)(end >> 32), (unsigned int)end,
+				(unsigned int)((end - start) >> 10));
+	} else {
+		printf("  %s %x - %x (%u bytes)\n", type, (unsigned int)start, (unsigned int)end,
+				(unsigned int)(end - start));
+	}
+}
+
 /* adds a range of physical memory to the available pool. used during init_mem
  * when traversing the memory map.
  */
-static void add_memory(uint32_t start, size_t sz)
+static void add_memory(uint64_t start, uint64_t end)
 {
-	int i, szpg, pg;
+	int pg, end_pg;
 
-	szpg = ADDR_TO_PAGE(sz);
-	pg = ADDR_TO_PAGE(start);
+	pg = start >> 12;
+	end_pg = end >> 12;
+	if(end_pg > max_pages) {
+		end_pg = max_pages;
+	}
 
-	for(i=0; i<szpg; i++) {
+	while(pg < end_pg) {
 		mark_page(pg++, FREE);
 	}
 }
@@ -232,3 +455,156 @@ static void mark_page(int pg, int used)
 	}
 }
 
+/* marks the pages of a range of physical memory as used, and locked in the
+ * frame database, during init_mem
+ */
+static void lock_pages(uint32_t start, uint32_t end)
+{
+	int pg, end_pg;
+
+	end_pg = ADDR_TO_PAGE(end + PGOFFS_MASK);
+	for(pg=ADDR_TO_PAGE(start); pg<end_pg && pg<max_pages; pg++) {
+		mark_page(pg, USED);
+		frames[pg].flags = PAGE_LOCKED;
+	}
+}
+
+/* builds the free lists out of the allocation bitmap, by splitting every run
+ * of free pages into the largest naturally aligned blocks possible.
+ */
+static void init_buddy(void)
+{
+	int i, pg, run, order;
+
+	for(i=0; i<=PHYS_MAX_ORDER; i++) {
+		free_list[ZONE_LOW][i] = free_list[ZONE_HIGH][i] = -1;
+	}
+	for(i=0; i<max_pages; i++) {
+		frames[i].order = -1;
+	}
+
+	pg = 0;
+	while(pg < max_pages) {
+		if(!IS_FREE(pg)) {
+			pg++;
+			continue;
+		}
+		/* runs are split at the 4gb mark, blocks never cross zones */
+		run = 1;
+		while(pg + run < max_pages && IS_FREE(pg + run) && pg + run != HIGHMEM_START_PAGE) {
+			run++;
+		}
+
+		while(run > 0) {
+			order = 0;
+			while(order < PHYS_MAX_ORDER && !(pg & (1 << order)) &&
+					(2 << order) <= run) {
+				order++;
+			}
+			add_free_block(pg, order);
+			pg += 1 << order;
+			run -= 1 << order;
+		}
+	}
+}
+
+/* allocate a block of 2^order pages from one of the zones, returns its first
+ * page, or -1 if there's no free block large enough
+ */
+static int alloc_block(int zone, int order)
+{
+	int i, pg, k, intr_state;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	for(k=order; k<=PHYS_MAX_ORDER; k++) {
+		if(free_list[zone][k] != -1) break;
+	}
+	if(k > PHYS_MAX_ORDER) {
+		set_intr_state(intr_state);
+		return -1;
+	}
+
+	pg = free_list[zone][k];
+	rm_free_block(pg);
+
+	/* split it, keeping the lower half each time */
+	while(k > order) {
+		k--;
+		add_free_block(pg + (1 << k), k);
+	}
+
+	for(i=0; i<(1 << order); i++) {
+		mark_page(pg + i, USED);
+	}
+
+	set_intr_state(intr_state);
+	return pg;
+}
+
+static void free_block(int pg, int order)
+{
+	int i, bud;
+
+	int intr_state = get_intr_state();
+	disable_intr();
+
+	if(pg + (1 << order) > max_pages) {
+		panic("free_phys_pages(%d, %d): beyond the end of memory\n", pg, order);
+	}
+	for(i=0; i<(1 << order); i++) {
+		if(IS_FREE(pg + i)) {
+			panic("free_phys_pages(%d, %d): I thought that was already free!\n", pg + i, order);
+		}
+		if(frames[pg + i].flags & PAGE_LOCKED) {
+			panic("free_phys_pages(%d, %d): page %d is locked\n", pg, order, pg + i);
+		}
+		mark_page(pg + i, FREE);
+		frames[pg + i].flags = 0;
+		frames[pg + i].nref = 0;
+	}
+
+	while(order < PHYS_MAX_ORDER) {
+		bud = BUDDY(pg, order);
+		if(bud >= max_pages || frames[bud].order != order) {
+			break;
+		}
+		rm_free_block(bud);
+		if(bud < pg) {
+			pg = bud;
+		}
+		order++;
+	}
+	add_free_block(pg, order);
+
+	set_intr_state(intr_state);
+}
+
+static void add_free_block(int pg, int order)
+{
+	int *list = free_list[PAGE_ZONE(pg)] + order;
+
+	frames[pg].order = order;
+	frames[pg].prev = -1;
+	frames[pg].next = *list;
+	if(*list != -1) {
+		frames[*list].prev = pg;
+	}
+	*list = pg;
+}
+
+static void rm_free_block(int pg)
+{
+	struct page *b = frames + pg;
+
+	if(b->prev != -1) {
+		frames[b->prev].next = b->next;
+	} else {
+		free_list[PAGE_ZONE(pg)][b->order] = b->next;
+	}
+	if(b->next != -1) {
+		frames[b->next].prev = b->prev;
+	}
+	b->order = -1;
+}
@@ -3,11 +3,57 @@
 
 #include "mboot.h"
 
+/* largest block of the physical page allocator: 2^10 pages (4mb) */
+#define PHYS_MAX_ORDER	10
+
+/* physical memory zones: memory below 4gb, and high memory above it */
+enum { ZONE_LOW, ZONE_HIGH, NUM_ZONES };
+#define HIGHMEM_START_PAGE	0x100000
+
+/* alloc_phys_page_flags flags */
+#define PHYS_ZEROED		1	/* return a zero-filled page */
+#define PHYS_POOL_ONLY	2	/* with PHYS_ZEROED: only from the pre-zeroed pool */
+
+/* struct page flags */
+#define PAGE_USER		1	/* mapped in user space, nref counts the mappings */
+#define PAGE_LOCKED		2	/* must never be freed or reclaimed */
+
+/* frame database entry, one for every physical page (see get_page_frame) */
+struct page {
+	unsigned short flags;
+	short order;		/* buddy allocator: order of the free block starting here, or -1 */
+	int nref;			/* number of user page table entries mapping it */
+	int next, prev;		/* buddy allocator free list links */
+
+	/* address space (physical address of its page directory pointer table)
+	 * and virtual page of the first user mapping of the page
+	 */
+	uint32_t owner;
+	int vpage;
+};
+
 void init_mem(struct mboot_info *mb);
 
 uint32_t alloc_phys_page(void);
 void free_phys_page(uint32_t addr);
 
+uint32_t alloc_phys_pages(int order);
+void free_phys_pages(uint32_t addr, int order);
+
+uint32_t alloc_phys_page_flags(unsigned int flags);
+
+/* single pages anywhere in physical memory, by page number */
+int alloc_page_frame(void);
+void free_page_frame(int pg);
+
+int refill_zero_pool(void);
+
+struct page *get_page_frame(int pg);
+
+int get_page_ref(int pg);
+void ref_page(int pg);
+int unref_page(int pg);
+
 void get_kernel_mem_range(uint32_t *start, uint32_t *end);
 
 #endif	/* MEM_H_ */
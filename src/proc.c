@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
@@ -17,6 +18,12 @@
 #define	FLAGS_INTR_BIT	(1 << 9)
 
 static void start_first_proc(void);
+static void start_spawned(void *img, int size);
+static void enter_user(uint32_t entry, uint32_t stack_top);
+static struct process *alloc_proc(struct process *parent);
+static void add_child(struct process *parent, struct process *p);
+static void copy_fork_frame(struct process *p);
+static void return_vm(struct process *p);
 
 /* defined in proc-asm.S */
 uint32_t switch_stack(uint32_t new_stack, uint32_t *old_stack);
@@ -70,7 +77,6 @@ static void start_first_proc(void)
 	struct process *p;
 	int proc_size_pg, img_start_pg, stack_pg;
 	uint32_t img_start_addr;
-	struct intr_frame ifrm;
 
 	/* prepare the first process */
 	p = proc + 1;
@@ -85,6 +91,15 @@ static void start_first_proc(void)
 	/* the first process may keep this existing page table */
 	p->ctx.pgtbl_paddr = get_pgdir_addr();
 
+	/* add it to the scheduler queues, and make it current. User memory is
+	 * allocated in the address space of the current process.
+	 */
+	add_proc(p->id);
+	set_current_pid(p->id);
+
+	/* there are no user mappings yet, this starts out with an empty vm map */
+	cons_vmmap(&p->vmmap);
+
 	/* allocate a chunk of memory for the process image
 	 * and copy the code of test_proc there.
 	 */
@@ -96,11 +111,21 @@ static void start_first_proc(void)
 	memcpy((void*)img_start_addr, test_proc, proc_size_pg * PGSIZE);
 	printf("copied init process at: %x\n", img_start_addr);
 
+	if(add_vm_area(p, img_start_pg, img_start_pg + proc_size_pg, PG_USER | PG_WRITABLE, VMA_MEM) == -1) {
+		panic("failed to add the init process image vm_area\n");
+	}
+
+	/* the heap starts out empty, right after the image */
+	p->heap_start = p->heap_end = PAGE_TO_ADDR(img_start_pg + proc_size_pg);
+
 	/* allocate the first page of the user stack */
 	stack_pg = ADDR_TO_PAGE(KMEM_START) - 1;
-	if(pgalloc_vrange(stack_pg, 1) == -1) {
+	if(pgreserve_vrange(stack_pg, 1) == -1 || map_page_range(stack_pg, 1, -1, USTACK_ATTR) == -1) {
 		panic("failed to allocate user stack page\n");
 	}
+	if(add_vm_area(p, stack_pg, stack_pg + 1, USTACK_ATTR, VMA_MEM) == -1) {
+		panic("failed to add the user stack vm_area\n");
+	}
 	p->user_stack_pg = stack_pg;
 
 	/* allocate a kernel stack for this process */
@@ -114,106 +139,201 @@ static void start_first_proc(void)
 	 */
 	tss->esp0 = PAGE_TO_ADDR(p->kern_stack_pg) + KERN_STACK_SIZE;
 
+	enter_user(img_start_addr, PAGE_TO_ADDR(stack_pg) + PGSIZE);
+}
+
+/* spawned processes start here, in their own (empty) address space, when
+ * they're first switched to. The image was copied to a kernel buffer by
+ * sys_spawn, because the parent's address space isn't accessible from here.
+ */
+static void start_spawned(void *img, int size)
+{
+	int img_pg, img_npages, stack_pg;
+	struct process *p = get_current_proc();
+
+	img_npages = (size + PGSIZE - 1) / PGSIZE;
+	if((img_pg = pgalloc(img_npages, MEM_USER)) == -1) {
+		printf("spawn: failed to allocate space for the process image\n");
+		free(img);
+		goto fail;
+	}
+	/* user pages are zeroed, no need to clear the rest of the last page */
+	memcpy((void*)PAGE_TO_ADDR(img_pg), img, size);
+	free(img);
+
+	if(add_vm_area(p, img_pg, img_pg + img_npages, PG_USER | PG_WRITABLE, VMA_MEM) == -1) {
+		printf("spawn: failed to add the image vm_area\n");
+		goto fail;
+	}
+
+	p->heap_start = p->heap_end = PAGE_TO_ADDR(img_pg + img_npages);
+
+	/* the user stack goes at the top of user space, like in every process */
+	stack_pg = ADDR_TO_PAGE(KMEM_START) - 1;
+	if(map_page_range(stack_pg, 1, -1, USTACK_ATTR) == -1) {
+		printf("spawn: failed to allocate user stack page\n");
+		goto fail;
+	}
+	if(add_vm_area(p, stack_pg, stack_pg + 1, USTACK_ATTR, VMA_MEM) == -1) {
+		printf("spawn: failed to add the stack vm_area\n");
+		goto fail;
+	}
+	p->user_stack_pg = stack_pg;
+
+	enter_user(PAGE_TO_ADDR(img_pg), PAGE_TO_ADDR(stack_pg) + PGSIZE);
+
+fail:
+	sys_exit(127);
+	schedule();	/* never returns, we're not in the runqueue anymore */
+}
+
+/* switch to user space, starting at entry with an empty stack, by executing
+ * a fake return from interrupt. Never returns.
+ */
+static void enter_user(uint32_t entry, uint32_t stack_top)
+{
+	struct intr_frame ifrm;
 
 	/* now we need to fill in the fake interrupt stack frame */
 	memset(&ifrm, 0, sizeof ifrm);
 	/* after the priviledge switch, this ss:esp will be used in userspace */
-	ifrm.esp = PAGE_TO_ADDR(stack_pg) + PGSIZE;
+	ifrm.esp = stack_top;
 	ifrm.ss = selector(SEGM_UDATA, 3);
 	/* instruction pointer at the beginning of the process image */
-	ifrm.eip = img_start_addr;
+	ifrm.eip = entry;
 	ifrm.cs = selector(SEGM_UCODE, 3);
 	/* make sure the user will run with interrupts enabled */
 	ifrm.eflags = FLAGS_INTR_BIT;
 	/* user data selectors should all be the same */
 	ifrm.ds = ifrm.es = ifrm.fs = ifrm.gs = ifrm.ss;
 
-	/* add it to the scheduler queues */
-	add_proc(p->id);
-
-	/* make it current */
-	set_current_pid(p->id);
-
-	/* build the current vm map */
-	cons_vmmap(&p->vmmap);
-
 	/* execute a fake return from interrupt with the fake stack frame */
 	intr_ret(ifrm);
 }
 
 int sys_fork(void)
 {
-	int i, pid;
 	struct process *p, *parent;
 
 	disable_intr();
 
-	/* find a free process slot */
-	/* TODO don't search up to MAX_PROC if uid != 0 */
-	pid = -1;
-	for(i=1; i<MAX_PROC; i++) {
-		if(proc[i].id == 0) {
-			pid = i;
-			break;
-		}
-	}
-
-	if(pid == -1) {
-		/* process table full */
+	parent = get_current_proc();
+	if(!(p = alloc_proc(parent))) {
 		return -EAGAIN;
 	}
+	copy_fork_frame(p);
+	add_child(parent, p);
 
+	/* will be copied on write */
+	p->user_stack_pg = parent->user_stack_pg;
+	p->heap_start = parent->heap_start;
+	p->heap_end = parent->heap_end;
+	/* and so are the page tables with the swapped out pages */
+	p->swap_pages = parent->swap_pages;
 
-	p = proc + pid;
-	parent = get_current_proc();
+	/* clone the parent's virtual memory */
+	clone_vm(p, parent, CLONE_COW);
 
-	/* copy file table */
-	memcpy(p->files, parent->files, sizeof p->files);
+	/* done, now let's add it to the scheduler runqueue */
+	add_proc(p->id);
 
-	p->umask = parent->umask;
+	return p->id;
+}
 
-	/* allocate a kernel stack for the new process */
-	if((p->kern_stack_pg = pgalloc(KERN_STACK_SIZE / PGSIZE, MEM_KERNEL)) == -1) {
+/* like fork, but instead of getting a copy of the address space, the child
+ * borrows the parent's, and the parent is suspended until the child gives it
+ * back when it exits. Nothing is marked copy-on-write, and the child runs on
+ * the parent's stack, so it should do little more than spawn or exit.
+ */
+int sys_vfork(void)
+{
+	int pid;
+	struct process *p, *parent;
+
+	disable_intr();
+
+	parent = get_current_proc();
+	if(!(p = alloc_proc(parent))) {
 		return -EAGAIN;
 	}
-	p->ctx.stack_ptr = PAGE_TO_ADDR(p->kern_stack_pg) + KERN_STACK_SIZE;
-	/* we need to copy the current interrupt frame to the new kernel stack so
-	 * that the new process will return to the same point as the parent, just
-	 * after the fork syscall.
-	 */
-	p->ctx.stack_ptr -= sizeof(struct intr_frame);
-	memcpy((void*)p->ctx.stack_ptr, get_intr_frame(), sizeof(struct intr_frame));
-	/* child's return from fork returns 0 */
-	((struct intr_frame*)p->ctx.stack_ptr)->regs.eax = 0;
+	copy_fork_frame(p);
+	add_child(parent, p);
 
-	/* we also need the address of just_forked in the stack, so that switch_stacks
-	 * called from context_switch, will return to just_forked when we first switch
-	 * to a newly forked process. just_forked then just calls intr_ret to return to
-	 * userspace with the already constructed interrupt frame (see above).
+	/* same page directory, and the vmmap moves over to the child until
+	 * return_vm moves it back
 	 */
-	p->ctx.stack_ptr -= 4;
-	*(uint32_t*)p->ctx.stack_ptr = (uint32_t)just_forked;
+	p->ctx.pgtbl_paddr = parent->ctx.pgtbl_paddr;
+	p->vmmap = parent->vmmap;
+	p->user_stack_pg = parent->user_stack_pg;
+	p->heap_start = parent->heap_start;
+	p->heap_end = parent->heap_end;
+	p->swap_pages = parent->swap_pages;
+	p->vfork_parent = parent->id;
 
-	/* initialize the rest of the process structure */
-	p->id = pid;
-	p->parent = parent->id;
-	p->child_list = 0;
-	p->next = p->prev = 0;
+	pid = p->id;
+	add_proc(pid);
 
-	/* add to the child list */
-	p->sib_next = parent->child_list;
-	parent->child_list = p;
+	while(p->vfork_parent) {
+		wait(p);
+	}
+	return pid;
+}
 
-	/* will be copied on write */
-	p->user_stack_pg = parent->user_stack_pg;
+/* create a new process running the flat executable image img (size bytes
+ * long), loaded at the start of a fresh address space. Unlike fork + exec,
+ * nothing of the parent's address space is copied or shared.
+ */
+int sys_spawn(void *img, int size)
+{
+	void *buf;
+	uint32_t *sp;
+	struct process *p, *parent = get_current_proc();
 
-	/* clone the parent's virtual memory */
-	clone_vm(p, parent, CLONE_COW);
+	if(size <= 0) {
+		return -EINVAL;
+	}
+	if(size > SPAWN_MAX_SIZE) {
+		return -E2BIG;
+	}
+	/* the image must be in the caller's memory. Pages of it which aren't
+	 * present (demand-zero or swapped out) are faulted in by the copy.
+	 */
+	if(check_user_range(parent, (uint32_t)img, size) == -1) {
+		return -EFAULT;
+	}
 
-	/* done, now let's add it to the scheduler runqueue */
+	/* keep a copy in kernel memory, for start_spawned to load */
+	if(!(buf = malloc(size))) {
+		return -ENOMEM;
+	}
+	memcpy(buf, img, size);
+
+	disable_intr();
+
+	if(!(p = alloc_proc(parent))) {
+		free(buf);
+		return -EAGAIN;
+	}
+	if(create_vm(p) == -1) {
+		pgfree(p->kern_stack_pg, KERN_STACK_SIZE / PGSIZE);
+		free(buf);
+		return -ENOMEM;
+	}
+
+	/* the first context switch to the new process "returns" to start_spawned
+	 * with the arguments following the (unused) return address
+	 */
+	sp = (uint32_t*)(PAGE_TO_ADDR(p->kern_stack_pg) + KERN_STACK_SIZE);
+	*--sp = size;
+	*--sp = (uint32_t)buf;
+	*--sp = 0;
+	*--sp = (uint32_t)start_spawned;
+	p->ctx.stack_ptr = (uint32_t)sp;
+
+	add_child(parent, p);
 	add_proc(p->id);
 
-	return pid;
+	return p->id;
 }
 
 int sys_exit(int status)
@@ -233,7 +353,12 @@ int sys_exit(int status)
 		child = child->sib_next;
 	}
 
-	cleanup_vm(p);
+	if(p->vfork_parent) {
+		/* the address space is borrowed, give it back to the parent */
+		return_vm(p);
+	} else {
+		cleanup_vm(p);
+	}
 
 	/* remove it from the runqueue */
 	remove_proc(p->id);
@@ -289,13 +414,14 @@ restart:
 		/* remove it from our children list */
 		dummy.sib_next = p->child_list;
 		prev = &dummy;
-		while(prev->next) {
-			if(prev->next == child) {
-				prev->next = child->next;
+		while(prev->sib_next) {
+			if(prev->sib_next == child) {
+				prev->sib_next = child->sib_next;
 				break;
 			}
+			prev = prev->sib_next;
 		}
-		p->child_list = dummy.next;
+		p->child_list = dummy.sib_next;
 
 		/* invalidate the id */
 		child->id = 0;
@@ -317,6 +443,98 @@ restart:
 	return 0;	/* he's not dead jim */
 }
 
+/* find a free process slot, and allocate a kernel stack for a new child of
+ * parent. The slot isn't taken until add_child is called, so this must be
+ * called with interrupts disabled.
+ */
+static struct process *alloc_proc(struct process *parent)
+{
+	int i, pid;
+	struct process *p;
+
+	/* find a free process slot */
+	/* TODO don't search up to MAX_PROC if uid != 0 */
+	pid = -1;
+	for(i=1; i<MAX_PROC; i++) {
+		if(proc[i].id == 0) {
+			pid = i;
+			break;
+		}
+	}
+
+	if(pid == -1) {
+		/* process table full */
+		return 0;
+	}
+	p = proc + pid;
+
+	/* allocate a kernel stack for the new process */
+	if((p->kern_stack_pg = pgalloc(KERN_STACK_SIZE / PGSIZE, MEM_KERNEL)) == -1) {
+		return 0;
+	}
+	p->ctx.stack_ptr = PAGE_TO_ADDR(p->kern_stack_pg) + KERN_STACK_SIZE;
+
+	/* copy file table */
+	memcpy(p->files, parent->files, sizeof p->files);
+
+	p->umask = parent->umask;
+
+	p->child_list = 0;
+	p->next = p->prev = 0;
+	p->vfork_parent = 0;
+	p->swap_pages = 0;
+	return p;
+}
+
+static void add_child(struct process *parent, struct process *p)
+{
+	p->id = p - proc;
+	p->parent = parent->id;
+
+	/* add to the child list */
+	p->sib_next = parent->child_list;
+	parent->child_list = p;
+}
+
+/* set up the kernel stack of a forked process to return to user space at the
+ * same point as the parent, just after the fork syscall.
+ */
+static void copy_fork_frame(struct process *p)
+{
+	/* we need to copy the current interrupt frame to the new kernel stack so
+	 * that the new process will return to the same point as the parent, just
+	 * after the fork syscall.
+	 */
+	p->ctx.stack_ptr -= sizeof(struct intr_frame);
+	memcpy((void*)p->ctx.stack_ptr, get_intr_frame(), sizeof(struct intr_frame));
+	/* child's return from fork returns 0 */
+	((struct intr_frame*)p->ctx.stack_ptr)->regs.eax = 0;
+
+	/* we also need the address of just_forked in the stack, so that switch_stacks
+	 * called from context_switch, will return to just_forked when we first switch
+	 * to a newly forked process. just_forked then just calls intr_ret to return to
+	 * userspace with the already constructed interrupt frame (see above).
+	 */
+	p->ctx.stack_ptr -= 4;
+	*(uint32_t*)p->ctx.stack_ptr = (uint32_t)just_forked;
+}
+
+/* give the address space borrowed by vfork back to the parent, and let the
+ * parent continue
+ */
+static void return_vm(struct process *p)
+{
+	struct process *parent = get_process(p->vfork_parent);
+
+	parent->vmmap = p->vmmap;
+	parent->user_stack_pg = p->user_stack_pg;
+	parent->heap_end = p->heap_end;
+	parent->swap_pages = p->swap_pages;
+
+	p->vfork_parent = 0;
+	wakeup(p);
+}
+
 void context_switch(int pid)
 {
 	static struct process *prev, *new;
@@ -384,6 +602,22 @@ struct process *get_process(int pid)
 	return p;
 }
 
+/* iterate over all existing processes: returns the first one if p is null,
+ * otherwise the one after p, or null after the last one.
+ */
+struct process *next_process(struct process *p)
+{
+	int i = p ? p - proc + 1 : 1;
+
+	while(i < MAX_PROC) {
+		if(proc[i].id) {
+			return proc + i;
+		}
+		i++;
+	}
+	return 0;
+}
+
 int sys_getpid(void)
 {
 	return cur_pid;
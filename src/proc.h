@@ -14,7 +14,7 @@ struct context {
 	/*uint32_t instr_ptr;*/		/* saved eip */
 	uint32_t stack_ptr;		/* saved esp */
 	/*uint32_t flags;*/			/* saved eflags */
-	uint32_t pgtbl_paddr;	/* physical address of the page table */
+	uint32_t pgtbl_paddr;	/* physical address of the page directory pointer table */
 	/* TODO add FPU state */
 };
 
@@ -36,10 +36,16 @@ struct process {
 
 	int ticks_left;
 
-	/* process vm map */
+	/* process vm map, the vm_areas of the user address space */
 	struct rbtree vmmap;
 
-	/* extends of the process heap, increased by sbrk */
+	/* extents of the process heap, increased by sbrk. heap_end is the
+	 * current break, the pages up to it are only allocated when touched.
+	 */
+	uint32_t heap_start, heap_end;
+
+	/* number of pages of the process currently in swap */
+	int swap_pages;
 
 	/* first page of the user stack, extends up to KMEM_START */
 	int user_stack_pg;
@@ -55,6 +61,9 @@ struct process {
 
 	struct process *child_list;
 
+	/* pid of the parent lending us its address space (vfork), or 0 */
+	int vfork_parent;
+
 	struct process *next, *prev;	/* for the scheduler queues */
 	struct process *sib_next;		/* for the sibling list */
 };
@@ -62,6 +71,8 @@ struct process {
 void init_proc(void);
 
 int sys_fork(void);
+int sys_vfork(void);
+int sys_spawn(void *img, int size);
 int sys_exit(int status);
 int sys_waitpid(int pid, int *status, int opt);
 
@@ -71,6 +82,7 @@ void set_current_pid(int pid);
 int get_current_pid(void);
 struct process *get_current_proc(void);
 struct process *get_process(int pid);
+struct process *next_process(struct process *p);
 
 int sys_getpid(void);
 int sys_getppid(void);
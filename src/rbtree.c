@@ -3,6 +3,7 @@
 #include <string.h>
 #include "rbtree.h"
 #include "panic.h"
+#include "slab.h"
 
 #define INT2PTR(x)	((void*)(x))
 #define PTR2INT(x)	((int)(x))
@@ -10,11 +11,18 @@
 static int cmpaddr(void *ap, void *bp);
 static int cmpint(void *ap, void *bp);
 
+static void *alloc_node(size_t sz);
+static void free_node(void *node);
+
 static int count_nodes(struct rbnode *node);
-static void del_tree(struct rbnode *node, void (*delfunc)(struct rbnode*, void*), void *cls);
+static void del_tree(struct rbtree *rb, struct rbnode *node);
 static struct rbnode *insert(struct rbtree *rb, struct rbnode *tree, void *key, void *data);
 static struct rbnode *delete(struct rbtree *rb, struct rbnode *tree, void *key);
 static void traverse(struct rbnode *node, void (*func)(struct rbnode*, void*), void *cls);
+static int is_red(struct rbnode *tree);
+
+/* the default node allocator uses this object cache */
+static struct kmem_cache node_cache = KMEM_CACHE_INIT("rbnode", sizeof(struct rbnode), 0);
 
 struct rbtree *rb_create(rb_cmp_func_t cmp_func)
 {
@@ -49,19 +57,19 @@ int rb_init(struct rbtree *rb, rb_cmp_func_t cmp_func)
 		rb->cmp = cmpaddr;
 	}
 
-	rb->alloc = malloc;
-	rb->free = free;
+	rb->alloc = alloc_node;
+	rb->free = free_node;
 	return 0;
 }
 
 void rb_destroy(struct rbtree *rb)
 {
-	del_tree(rb->root, rb->del, rb->del_cls);
+	del_tree(rb, rb->root);
 }
 
 void rb_clear(struct rbtree *rb)
 {
-	del_tree(rb->root, rb->del, rb->del_cls);
+	del_tree(rb, rb->root);
 	rb->root = 0;
 }
 
@@ -120,16 +128,27 @@ int rb_inserti(struct rbtree *rb, int key, void *data)
 
 int rb_delete(struct rbtree *rb, void *key)
 {
-	rb->root = delete(rb, rb->root, key);
-	rb->root->red = 0;
+	/* delete assumes the key is in the tree */
+	if(!rb_find(rb, key)) {
+		return -1;
+	}
+
+	/* if both children of the root are black, make it red so that delete
+	 * has a red link to push down
+	 */
+	if(!is_red(rb->root->left) && !is_red(rb->root->right)) {
+		rb->root->red = 1;
+	}
+
+	if((rb->root = delete(rb, rb->root, key))) {
+		rb->root->red = 0;
+	}
 	return 0;
 }
 
 int rb_deletei(struct rbtree *rb, int key)
 {
-	rb->root = delete(rb, rb->root, INT2PTR(key));
-	rb->root->red = 0;
-	return 0;
+	return rb_delete(rb, INT2PTR(key));
 }
 
 
@@ -228,7 +247,7 @@ static struct rbnode *rot_left(struct rbnode *a);
 static struct rbnode *rot_right(struct rbnode *a);
 static struct rbnode *find_min(struct rbnode *tree);
 static struct rbnode *del_min(struct rbtree *rb, struct rbnode *tree);
-/*static struct rbnode *move_red_right(struct rbnode *tree);*/
+static struct rbnode *move_red_right(struct rbnode *tree);
 static struct rbnode *move_red_left(struct rbnode *tree);
 static struct rbnode *fix_up(struct rbnode *tree);
 
@@ -240,18 +259,28 @@ static int count_nodes(struct rbnode *node)
 	return 1 + count_nodes(node->left) + count_nodes(node->right);
 }
 
-static void del_tree(struct rbnode *node, rb_del_func_t delfunc, void *cls)
+static void del_tree(struct rbtree *rb, struct rbnode *node)
 {
 	if(!node)
 		return;
 
-	del_tree(node->left, delfunc, cls);
-	del_tree(node->right, delfunc, cls);
+	del_tree(rb, node->left);
+	del_tree(rb, node->right);
 
-	if(delfunc) {
-		delfunc(node, cls);
+	if(rb->del) {
+		rb->del(node, rb->del_cls);
 	}
-	free(node);
+	rb->free(node);
+}
+
+static void *alloc_node(size_t sz)
+{
+	return kmem_cache_alloc(&node_cache);
+}
+
+static void free_node(void *node)
+{
+	kmem_cache_free(&node_cache, node);
 }
 
 static struct rbnode *insert(struct rbtree *rb, struct rbnode *tree, void *key, void *data)
@@ -318,8 +347,11 @@ static struct rbnode *delete(struct rbtree *rb, struct rbnode *tree, void *key)
 			tree = rot_right(tree);
 		}
 
-		/* found it at the bottom (XXX what certifies left is null?) */
-		if(cmp == 0 && !tree->right) {
+		/* found it at the bottom. The left child must be null, since a
+		 * left-leaning tree can't have a lone (black) left child, and a red
+		 * one would have been rotated right above.
+		 */
+		if(rb->cmp(key, tree->key) == 0 && !tree->right) {
 			if(rb->del) {
 				rb->del(tree, rb->del_cls);
 			}
@@ -328,11 +360,18 @@ static struct rbnode *delete(struct rbtree *rb, struct rbnode *tree, void *key)
 		}
 
 		if(!is_red(tree->right) && !is_red(tree->right->left)) {
-			tree = move_red_left(tree);
+			tree = move_red_right(tree);
 		}
 
-		if(key == tree->key) {
+		if(rb->cmp(key, tree->key) == 0) {
+			/* replace it with its successor, and delete that from the right
+			 * subtree instead
+			 */
 			struct rbnode *rmin = find_min(tree->right);
+
+			if(rb->del) {
+				rb->del(tree, rb->del_cls);
+			}
 			tree->key = rmin->key;
 			tree->data = rmin->data;
 			tree->right = del_min(rb, tree->right);
@@ -403,7 +442,7 @@ static struct rbnode *rot_right(struct rbnode *a)
 
 static struct rbnode *find_min(struct rbnode *tree)
 {
-	struct rbnode *node;
+	struct rbnode *node = tree;
 
 	if(!tree)
 		return 0;
@@ -414,13 +453,13 @@ static struct rbnode *find_min(struct rbnode *tree)
 	return node;
 }
 
+/* only used by delete to remove the successor of a deleted node, after its
+ * key and data have been moved up, so the delete callback isn't called
+ */
 static struct rbnode *del_min(struct rbtree *rb, struct rbnode *tree)
 {
 	if(!tree->left) {
-		if(rb->del) {
-			rb->del(tree->left, rb->del_cls);
-		}
-		rb->free(tree->left);
+		rb->free(tree);
 		return 0;
 	}
 
@@ -434,7 +473,6 @@ static struct rbnode *del_min(struct rbtree *rb, struct rbnode *tree)
 	return fix_up(tree);
 }
 
-#if 0
 /* push a red link on this node to the right */
 static struct rbnode *move_red_right(struct rbnode *tree)
 {
@@ -448,7 +486,6 @@ static struct rbnode *move_red_right(struct rbnode *tree)
 	}
 	return tree;
 }
-#endif
 
 /* push a red link on this node to the left */
 static struct rbnode *move_red_left(struct rbnode *tree)
@@ -5,6 +5,7 @@
 #include "intr.h"
 #include "asmops.h"
 #include "config.h"
+#include "mem.h"
 
 #define EMPTY(q)	((q)->head == 0)
 
@@ -142,6 +143,8 @@ void wakeup(void *wait_addr)
 
 static void idle_proc(void)
 {
+	int filled;
+
 	/* make sure we send any pending EOIs if needed.
 	 * end_of_irq will actually check if it's needed first.
 	 */
@@ -152,11 +155,21 @@ static void idle_proc(void)
 
 	printf("idle loop is running\n");
 
-	/* make sure interrupts are enabled before halting */
+	/* use the idle time to refill the pre-zeroed page pool, one page at a
+	 * time with interrupts enabled in between, so that a process becoming
+	 * runnable is noticed right away. Once it's full, halt until the next
+	 * interrupt (make sure interrupts are enabled before halting).
+	 */
 	while(EMPTY(&runq)) {
 		enable_intr();
-		halt_cpu();
+		filled = refill_zero_pool();
 		disable_intr();
+
+		if(!filled && EMPTY(&runq)) {
+			enable_intr();
+			halt_cpu();
+			disable_intr();
+		}
 	}
 }
 
@@ -0,0 +1,227 @@
+/* object caches for fixed-size kernel objects (slab allocator).
+ *
+ * Each slab is a single kernel page, starting with a struct slab header,
+ * followed by a stack of the indices of its free objects, followed by the
+ * objects themselves. Since slabs are page-aligned, the slab of an object is
+ * found by masking off the page offset of its address, which makes freeing
+ * O(1), and the free objects are never written to by the allocator, so they
+ * stay in the state the constructor left them in.
+ *
+ * A cache keeps its slabs in three lists according to their occupancy: full,
+ * partial and empty. Allocations come from partial slabs first, to keep the
+ * number of slabs in use low. At most one empty slab is kept around, any
+ * other slab becoming empty is given back with pgfree.
+ */
+#include <stdio.h>
+#include <inttypes.h>
+#include "slab.h"
+#include "vm.h"
+#include "intr.h"
+#include "panic.h"
+
+#define OBJ_ALIGN	4
+
+struct slab {
+	struct kmem_cache *cache;
+	struct slab *next, *prev;
+	int nfree;	/* number of free objects, and top of the free stack */
+};
+
+#define FREE_STACK(s)	((unsigned short*)((s) + 1))
+#define SLAB_OBJ(s, i)	((char*)(s) + (s)->cache->objoffs + (i) * (s)->cache->objsize)
+
+static int init_cache(struct kmem_cache *cache);
+static struct slab *new_slab(struct kmem_cache *cache);
+static void list_add(struct slab **list, struct slab *s);
+static void list_rm(struct slab **list, struct slab *s);
+
+/* list of all caches which have been used at least once */
+static struct kmem_cache *cache_list;
+
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	void *obj;
+	struct slab *s;
+	int intr_state = get_intr_state();
+	disable_intr();
+
+	if(!cache->objsize && init_cache(cache) == -1) {
+		set_intr_state(intr_state);
+		return 0;
+	}
+
+	if(!(s = cache->partial)) {
+		if((s = cache->empty)) {
+			list_rm(&cache->empty, s);
+		} else if(!(s = new_slab(cache))) {
+			set_intr_state(intr_state);
+			return 0;
+		}
+		list_add(&cache->partial, s);
+	}
+
+	obj = SLAB_OBJ(s, FREE_STACK(s)[--s->nfree]);
+	if(!s->nfree) {
+		list_rm(&cache->partial, s);
+		list_add(&cache->full, s);
+	}
+
+	cache->nobj++;
+	cache->nalloc++;
+
+	set_intr_state(intr_state);
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	int idx, intr_state;
+	struct slab *s, *release = 0;
+
+	if(!obj) return;
+
+	s = (struct slab*)((uint32_t)obj & ~PGOFFS_MASK);
+	if(s->cache != cache) {
+		panic("kmem_cache_free(%s): %x is not an object of this cache\n", cache->name,
+				(unsigned int)obj);
+	}
+	idx = ((char*)obj - SLAB_OBJ(s, 0)) / cache->objsize;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	if(s->nfree >= cache->slab_nobj) {
+		panic("kmem_cache_free(%s): %x freed twice\n", cache->name, (unsigned int)obj);
+	}
+	if(!s->nfree) {
+		list_rm(&cache->full, s);
+		list_add(&cache->partial, s);
+	}
+	FREE_STACK(s)[s->nfree++] = idx;
+
+	cache->nobj--;
+	cache->nfree++;
+
+	if(s->nfree == cache->slab_nobj) {
+		list_rm(&cache->partial, s);
+
+		if(cache->empty) {
+			/* we already have a spare empty slab, give this one back */
+			s->cache = 0;
+			cache->nslabs--;
+			release = s;
+		} else {
+			list_add(&cache->empty, s);
+		}
+	}
+
+	/* the cache is consistent at this point, so it's fine if pgfree needs to
+	 * allocate from it
+	 */
+	if(release) {
+		pgfree(ADDR_TO_PAGE(release), 1);
+	}
+
+	set_intr_state(intr_state);
+}
+
+void dbg_print_kmem_caches(void)
+{
+	int used;
+	struct kmem_cache *c = cache_list;
+
+	printf("%-12s %6s %6s %6s %7s %10s %10s %5s\n", "cache", "objsz", "nobj",
+			"slabs", "in use", "allocs", "frees", "util");
+	while(c) {
+		used = c->nslabs ? c->nobj * 100 / (c->nslabs * c->slab_nobj) : 0;
+
+		printf("%-12s %6d %6d %6d %7d %10lu %10lu %4d%%\n", c->name, c->objsize,
+				c->slab_nobj, c->nslabs, c->nobj, c->nalloc, c->nfree, used);
+		c = c->next;
+	}
+}
+
+/* calculates the layout of the slabs, and adds the cache to the cache list */
+static int init_cache(struct kmem_cache *cache)
+{
+	int nobj, objsize, objoffs;
+
+	objsize = (cache->size + OBJ_ALIGN - 1) & ~(OBJ_ALIGN - 1);
+	if(objsize <= 0) {
+		return -1;
+	}
+
+	nobj = (PGSIZE - sizeof(struct slab)) / (objsize + sizeof(unsigned short));
+	for(;;) {
+		if(nobj <= 0) {
+			printf("kmem cache %s: objects of %d bytes don't fit in a slab\n",
+					cache->name, (int)cache->size);
+			return -1;
+		}
+		objoffs = sizeof(struct slab) + nobj * sizeof(unsigned short);
+		objoffs = (objoffs + OBJ_ALIGN - 1) & ~(OBJ_ALIGN - 1);
+
+		if(objoffs + nobj * objsize <= PGSIZE) {
+			break;
+		}
+		nobj--;
+	}
+
+	cache->objsize = objsize;
+	cache->objoffs = objoffs;
+	cache->slab_nobj = nobj;
+
+	cache->next = cache_list;
+	cache_list = cache;
+	return 0;
+}
+
+static struct slab *new_slab(struct kmem_cache *cache)
+{
+	int i, pg;
+	struct slab *s;
+
+	if((pg = pgalloc(1, MEM_KERNEL)) == -1) {
+		return 0;
+	}
+	s = (struct slab*)PAGE_TO_ADDR(pg);
+	s->cache = cache;
+	s->next = s->prev = 0;
+	s->nfree = cache->slab_nobj;
+
+	/* objects are handed out starting from the lowest address */
+	for(i=0; i<cache->slab_nobj; i++) {
+		FREE_STACK(s)[i] = cache->slab_nobj - i - 1;
+
+		if(cache->ctor) {
+			cache->ctor(SLAB_OBJ(s, i));
+		}
+	}
+
+	cache->nslabs++;
+	return s;
+}
+
+static void list_add(struct slab **list, struct slab *s)
+{
+	s->prev = 0;
+	s->next = *list;
+	if(*list) {
+		(*list)->prev = s;
+	}
+	*list = s;
+}
+
+static void list_rm(struct slab **list, struct slab *s)
+{
+	if(s->prev) {
+		s->prev->next = s->next;
+	} else {
+		*list = s->next;
+	}
+	if(s->next) {
+		s->next->prev = s->prev;
+	}
+	s->next = s->prev = 0;
+}
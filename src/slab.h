@@ -0,0 +1,37 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stdlib.h>
+
+struct slab;
+
+/* An object cache hands out objects of a single type (size), carved out of
+ * single-page slabs. Caches are meant to be statically allocated, and
+ * initialized with KMEM_CACHE_INIT, so that they can be used at any point,
+ * even before the allocator which would have to allocate them exists.
+ */
+struct kmem_cache {
+	const char *name;
+	size_t size;
+	void (*ctor)(void*);	/* called once per object when a slab is created */
+
+	/* calculated when the first slab is created */
+	int objsize, objoffs, slab_nobj;
+
+	struct slab *full, *partial, *empty;
+
+	/* statistics */
+	int nslabs, nobj;
+	unsigned long nalloc, nfree;
+
+	struct kmem_cache *next;	/* list of all the caches in use */
+};
+
+#define KMEM_CACHE_INIT(name, size, ctor)	{ name, size, ctor }
+
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void dbg_print_kmem_caches(void);
+
+#endif	/* SLAB_H_ */
@@ -0,0 +1,420 @@
+/* paging anonymous user memory out to a swap partition.
+ *
+ * The swap device is divided into page-sized slots, and each slot has a
+ * reference count: the number of user page table entries holding it, since
+ * page tables are copied (or shared) by fork just like with mapped pages. The
+ * page table entry of a swapped out page holds its slot and permissions, with
+ * the present bit clear (see PG_SWAPPED in vm.h).
+ *
+ * When we run out of physical memory, swap_out picks victims with a clock
+ * (second chance) scan over the frame database: user pages mapped once, which
+ * haven't been accessed since the last time the hand went past them. Slots
+ * are allocated next-fit, so pages evicted together end up next to each other
+ * in swap, and swap_in reads back runs of them with a single request.
+ *
+ * Every process keeps count of the swapped out pages in its address space
+ * (swap_pages). After fork, the page tables are shared, so a page evicted
+ * through a shared table is charged to every process using that table. Swap
+ * entries are only ever cleared from private tables (set_pte and clear_pte
+ * unshare the table first), so they're released against the process whose
+ * table held them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "swap.h"
+#include "bdev.h"
+#include "part.h"
+#include "ata.h"
+#include "vm.h"
+#include "mem.h"
+#include "proc.h"
+#include "mutex.h"
+#include "intr.h"
+#include "panic.h"
+#include "config.h"
+
+/* linux swap partition type */
+#define PTYPE_SWAP		0x82
+
+#define SLOT_BLOCKS		(PGSIZE / BLKSZ)
+
+static int evict(int pg, struct page *frame);
+static int alloc_slot(void);
+static int rw_slots(int slot, int count, int *ppg, int write);
+static struct process *find_owner(uint32_t pgdir_addr);
+static void charge_swap(uint32_t pgdir_addr, int vpg, int count);
+
+static struct block_device *swap_dev;
+static int nslots;
+static unsigned char *slot_ref;
+static int next_slot;
+
+/* kernel virtual pages for mapping the pages being read or written */
+static int io_vpg;
+
+/* held during swap I/O. Whoever faults on a page while it's being written
+ * out waits for it here, before reading it back in.
+ */
+static mutex_t swap_lock;
+
+/* next physical page to look at */
+static int clock_hand;
+
+
+/* use the first swap partition we can find */
+void init_swap(void)
+{
+	int i, partid;
+	struct partition *plist, *p;
+	char name[16];
+
+	for(i=0; i<ata_num_devices(); i++) {
+		plist = p = get_part_list(i);
+
+		partid = 0;
+		while(p) {
+			if(get_part_type(p) == PTYPE_SWAP) {
+				sprintf(name, "ata%dp%d", i, partid);
+				if(swap_on(bdev_by_name(name)) == 0) {
+					free_part_list(plist);
+					return;
+				}
+			}
+			p = p->next;
+			partid++;
+		}
+		free_part_list(plist);
+	}
+}
+
+int swap_on(dev_t dev)
+{
+	struct block_device *bdev;
+	int num;
+
+	if(swap_dev) {
+		return -EBUSY;
+	}
+	if(!(bdev = blk_open(dev))) {
+		return -ENOENT;
+	}
+	if((num = bdev->size / SLOT_BLOCKS) < 2) {
+		blk_close(bdev);
+		return -EINVAL;
+	}
+
+	if((io_vpg = pgreserve(SWAP_CLUSTER, MEM_KERNEL)) == -1) {
+		blk_close(bdev);
+		return -ENOMEM;
+	}
+	if(!(slot_ref = malloc(num))) {
+		pgfree(io_vpg, SWAP_CLUSTER);
+		blk_close(bdev);
+		return -ENOMEM;
+	}
+	memset(slot_ref, 0, num);
+	/* never use the first slot, to leave the swap header alone */
+	slot_ref[0] = 1;
+	next_slot = 1;
+
+	nslots = num;
+	swap_dev = bdev;
+
+	printf("swap: %d pages on device %x\n", nslots - 1, (unsigned int)dev);
+	return 0;
+}
+
+/* page out up to count user pages, returns the number of pages freed */
+int swap_out(int count)
+{
+	int res, wraps = 0, nout = 0;
+	struct page *frame;
+
+	if(!swap_dev) {
+		return 0;
+	}
+
+	mutex_lock(&swap_lock);
+
+	/* the first full round might only clear the accessed bits, and the
+	 * second one finds them still clear
+	 */
+	while(nout < count) {
+		if(!(frame = get_page_frame(clock_hand))) {
+			clock_hand = 0;
+			if(++wraps > 2) break;
+			continue;
+		}
+
+		if((res = evict(clock_hand++, frame)) == -1) {
+			break;	/* out of swap space */
+		}
+		nout += res;
+	}
+
+	mutex_unlock(&swap_lock);
+	return nout;
+}
+
+/* called by the page fault handler for the swapped out page vpg of the
+ * current process. The following pages are read in with it, for as long as
+ * they were swapped out to consecutive slots.
+ */
+int swap_in(int vpg)
+{
+	int i, n, slot, res, intr_state;
+	int ppg[SWAP_CLUSTER];
+	pte_t ent[SWAP_CLUSTER], *pte;
+
+	if(!swap_dev) {
+		return -1;
+	}
+
+	/* take a copy of the entries, the page table might be mapped through the
+	 * temporary mapping, which we can't hold while waiting for the disk
+	 */
+	intr_state = get_intr_state();
+	disable_intr();
+
+	if(!(pte = map_pte(get_pgdir_addr(), vpg))) {
+		set_intr_state(intr_state);
+		return -1;
+	}
+	slot = PTE_SWAP_SLOT(*pte);
+
+	n = 0;
+	while(n < SWAP_CLUSTER && PAGE_TO_PGTBL_PG(vpg) + n < PGTBL_ENTRIES) {
+		ent[n] = pte[n];
+		if(!(ent[n] & PG_SWAPPED) || PTE_SWAP_SLOT(ent[n]) != slot + n) {
+			break;
+		}
+		n++;
+	}
+	unmap_pte(pte);
+	set_intr_state(intr_state);
+
+	if(!n) {
+		return -1;
+	}
+
+	/* allocate the pages before taking the lock, swap_out might need it */
+	for(i=0; i<n; i++) {
+		if((ppg[i] = alloc_page_frame()) == -1) {
+			if(swap_out(SWAP_CLUSTER) <= 0 || (ppg[i] = alloc_page_frame()) == -1) {
+				break;
+			}
+		}
+	}
+	if(!(n = i)) {
+		return -1;
+	}
+
+	mutex_lock(&swap_lock);
+	res = rw_slots(slot, n, ppg, 0);
+	mutex_unlock(&swap_lock);
+
+	for(i=0; i<n; i++) {
+		int same = 0;
+
+		/* the entries might have changed while we were waiting for the disk */
+		disable_intr();
+		if(res != -1 && (pte = map_pte(get_pgdir_addr(), vpg + i))) {
+			same = *pte == ent[i];
+			unmap_pte(pte);
+		}
+		if(same) {
+			/* this also drops the reference to the slot */
+			map_page(vpg + i, ppg[i], PTE_USER_ATTR(ent[i]));
+		} else {
+			free_page_frame(ppg[i]);
+		}
+		set_intr_state(intr_state);
+	}
+	return res;
+}
+
+/* a page table entry holding the slot was copied */
+void swap_dup(int slot)
+{
+	if(slot <= 0 || slot >= nslots || slot_ref[slot] == 0xff) {
+		panic("swap_dup(%d): invalid slot\n", slot);
+	}
+	slot_ref[slot]++;
+}
+
+/* a page table entry holding the slot was cleared or replaced, in a page
+ * table belonging to process p
+ */
+void swap_put(int slot, struct process *p)
+{
+	if(slot <= 0 || slot >= nslots || !slot_ref[slot]) {
+		panic("swap_put(%d): slot not in use\n", slot);
+	}
+	slot_ref[slot]--;
+
+	if(p && p->swap_pages > 0) {
+		p->swap_pages--;
+	}
+}
+
+/* returns 1 if the page was swapped out, 0 if it's not a candidate or it got
+ * a second chance, -1 if we're out of swap space.
+ */
+static int evict(int pg, struct page *frame)
+{
+	int slot, intr_state;
+	pte_t ent, swent, *pte;
+
+	/* shared pages would have to be unmapped from every page table */
+	if(!(frame->flags & PAGE_USER) || (frame->flags & PAGE_LOCKED) || frame->nref != 1) {
+		return 0;
+	}
+	if(!find_owner(frame->owner)) {
+		return 0;
+	}
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	if(!(pte = map_pte(frame->owner, frame->vpage))) {
+		set_intr_state(intr_state);
+		return 0;
+	}
+	ent = *pte;
+
+	/* the first mapping might be gone, and the page mapped somewhere else */
+	if(!(ent & PG_PRESENT) || PTE_PAGE(ent) != pg) {
+		unmap_pte(pte);
+		set_intr_state(intr_state);
+		return 0;
+	}
+
+	if(ent & PG_ACCESSED) {
+		*pte = ent & ~(pte_t)PG_ACCESSED;
+		unmap_pte(pte);
+		flush_tlb_page(frame->vpage);
+		set_intr_state(intr_state);
+		return 0;
+	}
+
+	if((slot = alloc_slot()) == -1) {
+		unmap_pte(pte);
+		set_intr_state(intr_state);
+		return -1;
+	}
+
+	/* from now on the owner faults on the page, and waits in swap_in until
+	 * we're done writing it
+	 */
+	swent = MK_SWAP_PTE(slot, ent);
+	*pte = swent;
+	unmap_pte(pte);
+	flush_tlb_page(frame->vpage);
+	charge_swap(frame->owner, frame->vpage, 1);
+
+	set_intr_state(intr_state);
+
+	if(rw_slots(slot, 1, &pg, 1) == -1) {
+		disable_intr();
+
+		/* put it back, unless it was unmapped in the meantime */
+		if((pte = map_pte(frame->owner, frame->vpage))) {
+			if(*pte == swent) {
+				*pte = ent;
+				unmap_pte(pte);
+				slot_ref[slot] = 0;
+				charge_swap(frame->owner, frame->vpage, -1);
+				set_intr_state(intr_state);
+				return 0;
+			}
+			unmap_pte(pte);
+		}
+		set_intr_state(intr_state);
+	}
+
+	/* nothing maps the page any more */
+	if(unref_page(pg) == 0) {
+		free_page_frame(pg);
+	}
+	return 1;
+}
+
+static int alloc_slot(void)
+{
+	int i, slot = next_slot;
+
+	for(i=0; i<nslots; i++) {
+		if(!slot_ref[slot]) {
+			slot_ref[slot] = 1;
+			next_slot = slot + 1 < nslots ? slot + 1 : 1;
+			return slot;
+		}
+		if(++slot >= nslots) {
+			slot = 1;
+		}
+	}
+	return -1;
+}
+
+/* read or write count consecutive slots from/to the physical pages in ppg.
+ * Called with swap_lock held.
+ */
+static int rw_slots(int slot, int count, int *ppg, int write)
+{
+	int i, res;
+	void *buf = (void*)PAGE_TO_ADDR(io_vpg);
+
+	for(i=0; i<count; i++) {
+		map_page(io_vpg + i, ppg[i], PG_WRITABLE);
+	}
+
+	if(write) {
+		res = blk_write(swap_dev, slot * SLOT_BLOCKS, count * SLOT_BLOCKS, buf);
+	} else {
+		res = blk_read(swap_dev, slot * SLOT_BLOCKS, count * SLOT_BLOCKS, buf);
+	}
+
+	unmap_page_range(io_vpg, count);
+	return res;
+}
+
+static struct process *find_owner(uint32_t pgdir_addr)
+{
+	struct process *p = 0;
+
+	while((p = next_process(p))) {
+		if(p->state != STATE_ZOMBIE && p->ctx.pgtbl_paddr == pgdir_addr) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+/* add count to the swapped out pages of every process with the page table
+ * holding the entry of vpg in the address space pgdir_addr: the processes
+ * using that address space (a vfork child and its parent, which gets the
+ * child's count back in return_vm), and the ones sharing the table with it
+ * after fork. Called with interrupts disabled.
+ */
+static void charge_swap(uint32_t pgdir_addr, int vpg, int count)
+{
+	int tbl;
+	struct process *p = 0;
+
+	if((tbl = pgtbl_page(pgdir_addr, vpg)) == -1) {
+		return;
+	}
+	while((p = next_process(p))) {
+		if(p->state == STATE_ZOMBIE || !p->ctx.pgtbl_paddr) {
+			continue;
+		}
+		if(p->ctx.pgtbl_paddr == pgdir_addr || pgtbl_page(p->ctx.pgtbl_paddr, vpg) == tbl) {
+			p->swap_pages += count;
+			if(p->swap_pages < 0) {
+				p->swap_pages = 0;
+			}
+		}
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef SWAP_H_
+#define SWAP_H_
+
+#include "fs.h"	/* for dev_t */
+
+struct process;
+
+void init_swap(void);
+int swap_on(dev_t dev);
+
+int swap_out(int count);
+int swap_in(int vpg);
+
+void swap_dup(int slot);
+void swap_put(int slot, struct process *p);
+
+#endif	/* SWAP_H_ */
@@ -5,6 +5,7 @@
 #include "sched.h"
 #include "timer.h"
 #include "fs.h"
+#include "vm.h"
 
 static int (*sys_func[NUM_SYSCALLS])();
 
@@ -21,7 +22,18 @@ void init_syscall(void)
 	sys_func[SYS_WAITPID] = sys_waitpid;	/* proc.c */
 	sys_func[SYS_GETPID] = sys_getpid;		/* proc.c */
 	sys_func[SYS_GETPPID] = sys_getppid;	/* proc.c */
+	sys_func[SYS_VFORK] = sys_vfork;		/* proc.c */
+	sys_func[SYS_SPAWN] = sys_spawn;		/* proc.c */
+	sys_func[SYS_BRK] = sys_brk;			/* vm_sys.c */
+	sys_func[SYS_SBRK] = sys_sbrk;			/* vm_sys.c */
+	sys_func[SYS_MMAP] = sys_mmap;			/* vm_sys.c */
+	sys_func[SYS_MUNMAP] = sys_munmap;		/* vm_sys.c */
 
+	/* The filesystem syscalls are compiled, but not reachable yet: there's no
+	 * sys_open/sys_close/sys_lseek to get file descriptors with, and init_fs
+	 * doesn't mount a root filesystem. That includes copy_file_range and
+	 * fallocate, which work on open file descriptors.
+	 */
 #if 0
 	sys_func[SYS_MOUNT] = sys_mount;		/* fs.c */
 	sys_func[SYS_UMOUNT] = sys_umount;		/* fs.c */
@@ -30,6 +42,8 @@ void init_syscall(void)
 	sys_func[SYS_READ] = sys_read;			/* fs.c */
 	sys_func[SYS_WRITE] = sys_write;		/* fs.c */
 	sys_func[SYS_LSEEK] = sys_lseek;		/* fs.c */
+	sys_func[SYS_COPY_FILE_RANGE] = sys_copy_file_range;	/* fs_sys.c */
+	sys_func[SYS_FALLOCATE] = sys_fallocate;	/* fs_sys.c */
 #endif
 
 	interrupt(SYSCALL_INT, syscall);
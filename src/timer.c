@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "sched.h"
 #include "config.h"
+#include "slab.h"
 
 /* frequency of the oscillator driving the 8254 timer */
 #define OSC_FREQ_HZ		1193182
@@ -54,6 +55,8 @@ static void timer_handler();
 
 static struct timer_event *evlist;
 
+static struct kmem_cache event_cache = KMEM_CACHE_INIT("timer_event", sizeof(struct timer_event), 0);
+
 
 void init_timer(void)
 {
@@ -93,7 +96,7 @@ void sleep(unsigned long msec)
 		return;
 	}
 
-	if(!(ev = malloc(sizeof *ev))) {
+	if(!(ev = kmem_cache_alloc(&event_cache))) {
 		printf("sleep: failed to allocate timer_event structure\n");
 		return;
 	}
@@ -163,7 +166,7 @@ static void timer_handler(int inum)
 			printf("timer going off!!!\n");
 			/* wake up all processes waiting on this address */
 			wakeup(ev);
-			free(ev);
+			kmem_cache_free(&event_cache, ev);
 		}
 	}
 
@@ -0,0 +1,470 @@
+/* tmpfs: memory-only filesystem.
+ *
+ * There is no block device behind it. Inodes live in a table indexed by inode
+ * number, and file data is kept in kernel pages, one page per PGSIZE bytes of
+ * the file. The interface is the same as for the disk filesystem: the struct
+ * inodes passed around are copies, and get_inode/put_inode move the metadata
+ * in and out of the table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tmpfs.h"
+#include "vm.h"
+#include "kdef.h"
+
+struct tmpfs_dirent {
+	int ino;
+	char name[NAME_MAX + 1];
+	struct tmpfs_dirent *next;
+};
+
+struct tmpfs_node {
+	struct inode inode;		/* only the metadata fields are used */
+	int parent;				/* parent directory inode (directories) */
+
+	int *pages;				/* kernel pages with the file data, 0 for holes */
+	int max_pages;			/* size of the pages array */
+
+	struct tmpfs_dirent *dents;	/* directory entries, except . and .. */
+};
+
+struct tmpfs_sb {
+	struct tmpfs_node **nodes;	/* indexed by inode number */
+	int max_nodes;
+
+	int root_ino;
+	unsigned int npages, max_pages;
+};
+
+static void tmpfs_umount(struct filesys *fs);
+static int tmpfs_get_inode(struct filesys *fs, int ino, struct inode *inode);
+static int tmpfs_put_inode(struct filesys *fs, struct inode *inode);
+static int tmpfs_lookup(struct filesys *fs, struct inode *dir, const char *name);
+static int tmpfs_create(struct filesys *fs, struct inode *dir, const char *name, int mode, struct inode *node);
+static int tmpfs_unlink(struct filesys *fs, struct inode *dir, const char *name);
+static int tmpfs_read(struct filesys *fs, struct inode *node, long offs, void *buf, int sz);
+static int tmpfs_write(struct filesys *fs, struct inode *node, long offs, void *buf, int sz);
+static int tmpfs_prealloc(struct filesys *fs, struct inode *node, long offs, long len);
+
+static struct tmpfs_node *new_node(struct tmpfs_sb *sb, int mode);
+static void free_node(struct tmpfs_sb *sb, struct tmpfs_node *n);
+static struct tmpfs_node *find_node(struct tmpfs_sb *sb, int ino);
+static void *grow_array(void *arr, int *size, int min_size, int elemsz);
+static void *get_page(struct tmpfs_sb *sb, struct tmpfs_node *n, int pg, int alloc);
+
+static struct fs_operations tmpfs_ops = {
+	tmpfs_umount,
+	tmpfs_get_inode,
+	tmpfs_put_inode,
+	tmpfs_lookup,
+	tmpfs_create,
+	tmpfs_unlink,
+	tmpfs_read,
+	tmpfs_write,
+	tmpfs_prealloc
+};
+
+int tmpfs_mount(struct filesys *fs, unsigned int max_pages)
+{
+	struct tmpfs_sb *sb;
+	struct tmpfs_node *root;
+
+	if(!(sb = malloc(sizeof *sb))) {
+		return -ENOMEM;
+	}
+	memset(sb, 0, sizeof *sb);
+	sb->max_pages = max_pages;
+
+	if(!(root = new_node(sb, S_IFDIR | 0777))) {
+		free(sb);
+		return -ENOMEM;
+	}
+	sb->root_ino = root->inode.ino;
+	root->parent = root->inode.ino;
+	root->inode.nlink = 2;
+
+	memset(fs, 0, sizeof *fs);
+	fs->fsop = &tmpfs_ops;
+	fs->data = sb;
+	fs->root_ino = sb->root_ino;
+	return 0;
+}
+
+static void tmpfs_umount(struct filesys *fs)
+{
+	int i;
+	struct tmpfs_sb *sb = fs->data;
+
+	for(i=0; i<sb->max_nodes; i++) {
+		if(sb->nodes[i]) {
+			free_node(sb, sb->nodes[i]);
+		}
+	}
+	free(sb->nodes);
+	free(sb);
+}
+
+static int tmpfs_get_inode(struct filesys *fs, int ino, struct inode *inode)
+{
+	struct tmpfs_node *n;
+
+	if(!(n = find_node(fs->data, ino))) {
+		return -1;
+	}
+	*inode = n->inode;
+	return 0;
+}
+
+static int tmpfs_put_inode(struct filesys *fs, struct inode *inode)
+{
+	struct tmpfs_node *n;
+
+	if(!(n = find_node(fs->data, inode->ino))) {
+		return -1;
+	}
+	/* the size is changed only by writes, which keep it up to date */
+	inode->size = n->inode.size;
+	n->inode = *inode;
+	return 0;
+}
+
+static int tmpfs_lookup(struct filesys *fs, struct inode *dir, const char *name)
+{
+	struct tmpfs_node *dn;
+	struct tmpfs_dirent *dent;
+
+	if(!(dn = find_node(fs->data, dir->ino))) {
+		return -ENOENT;
+	}
+	if(!(dn->inode.mode & S_IFDIR)) {
+		return -ENOTDIR;
+	}
+
+	if(strcmp(name, ".") == 0) {
+		return dn->inode.ino;
+	}
+	if(strcmp(name, "..") == 0) {
+		return dn->parent;
+	}
+
+	dent = dn->dents;
+	while(dent) {
+		if(strcmp(dent->name, name) == 0) {
+			return dent->ino;
+		}
+		dent = dent->next;
+	}
+	return -ENOENT;
+}
+
+static int tmpfs_create(struct filesys *fs, struct inode *dir, const char *name, int mode, struct inode *node)
+{
+	int res;
+	struct tmpfs_sb *sb = fs->data;
+	struct tmpfs_node *dn, *n;
+	struct tmpfs_dirent *dent;
+
+	if((res = tmpfs_lookup(fs, dir, name)) != -ENOENT) {
+		return res < 0 ? res : -EEXIST;
+	}
+	if(strlen(name) > NAME_MAX) {
+		return -ENAMETOOLONG;
+	}
+	if(!(dn = find_node(sb, dir->ino))) {
+		return -ENOENT;
+	}
+
+	if(!(dent = malloc(sizeof *dent))) {
+		return -ENOMEM;
+	}
+	if(!(n = new_node(sb, mode))) {
+		free(dent);
+		return -ENOSPC;
+	}
+	n->inode.nlink = 1;
+	if(mode & S_IFDIR) {
+		/* "." in the new directory, and ".." pointing back to its parent */
+		n->parent = dn->inode.ino;
+		n->inode.nlink++;
+		dn->inode.nlink++;
+	}
+
+	dent->ino = n->inode.ino;
+	memcpy(dent->name, name, strlen(name) + 1);
+	dent->next = dn->dents;
+	dn->dents = dent;
+
+	*node = n->inode;
+	*dir = dn->inode;
+	return 0;
+}
+
+static int tmpfs_unlink(struct filesys *fs, struct inode *dir, const char *name)
+{
+	struct tmpfs_sb *sb = fs->data;
+	struct tmpfs_node *dn, *n;
+	struct tmpfs_dirent dummy, *prev, *dent;
+
+	if(!(dn = find_node(sb, dir->ino))) {
+		return -ENOENT;
+	}
+	if(!(dn->inode.mode & S_IFDIR)) {
+		return -ENOTDIR;
+	}
+	if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return -EINVAL;
+	}
+
+	dummy.next = dn->dents;
+	prev = &dummy;
+	while(prev->next && strcmp(prev->next->name, name) != 0) {
+		prev = prev->next;
+	}
+	if(!(dent = prev->next)) {
+		return -ENOENT;
+	}
+	n = find_node(sb, dent->ino);
+
+	if(n->inode.mode & S_IFDIR) {
+		if(n->dents) {
+			return -ENOTEMPTY;
+		}
+		/* drop the ".." link to the parent, and the "." link to itself */
+		dn->inode.nlink--;
+		n->inode.nlink = 1;
+	}
+
+	prev->next = dent->next;
+	dn->dents = dummy.next;
+	free(dent);
+	*dir = dn->inode;
+
+	if(--n->inode.nlink <= 0) {
+		free_node(sb, n);
+	}
+	return 0;
+}
+
+static int tmpfs_read(struct filesys *fs, struct inode *node, long offs, void *buf, int sz)
+{
+	int pg, pgoffs, len, res = 0;
+	char *dest = buf, *src;
+	struct tmpfs_node *n;
+
+	if(offs < 0 || sz < 0) {
+		return -EINVAL;
+	}
+	if(!(n = find_node(fs->data, node->ino))) {
+		return -ENOENT;
+	}
+	if(offs >= n->inode.size) {
+		return 0;
+	}
+	if(sz > n->inode.size - offs) {
+		sz = n->inode.size - offs;
+	}
+
+	while(sz > 0) {
+		pg = offs / PGSIZE;
+		pgoffs = offs % PGSIZE;
+		len = PGSIZE - pgoffs < sz ? PGSIZE - pgoffs : sz;
+
+		if((src = get_page(fs->data, n, pg, 0))) {
+			memcpy(dest, src + pgoffs, len);
+		} else {
+			memset(dest, 0, len);	/* hole */
+		}
+		dest += len;
+		offs += len;
+		sz -= len;
+		res += len;
+	}
+	return res;
+}
+
+static int tmpfs_write(struct filesys *fs, struct inode *node, long offs, void *buf, int sz)
+{
+	int pg, pgoffs, len, res = 0;
+	char *src = buf, *dest;
+	struct tmpfs_node *n;
+
+	if(offs < 0 || sz < 0) {
+		return -EINVAL;
+	}
+	if(!(n = find_node(fs->data, node->ino))) {
+		return -ENOENT;
+	}
+
+	while(sz > 0) {
+		pg = offs / PGSIZE;
+		pgoffs = offs % PGSIZE;
+		len = PGSIZE - pgoffs < sz ? PGSIZE - pgoffs : sz;
+
+		if(!(dest = get_page(fs->data, n, pg, 1))) {
+			/* a short write if we got anything in, otherwise out of space */
+			if(!res) {
+				return -ENOSPC;
+			}
+			break;
+		}
+		memcpy(dest + pgoffs, src, len);
+		src += len;
+		offs += len;
+		sz -= len;
+		res += len;
+	}
+
+	if(offs > n->inode.size) {
+		n->inode.size = offs;
+	}
+	node->size = n->inode.size;
+	return res;
+}
+
+/* allocate the pages for [offs, offs + len), without changing the size */
+static int tmpfs_prealloc(struct filesys *fs, struct inode *node, long offs, long len)
+{
+	int pg, end;
+	struct tmpfs_node *n;
+	struct tmpfs_sb *sb = fs->data;
+
+	if(offs < 0 || len <= 0) {
+		return -EINVAL;
+	}
+	if(!(n = find_node(fs->data, node->ino))) {
+		return -ENOENT;
+	}
+	if(len > (long)sb->max_pages * PGSIZE || offs > (long)sb->max_pages * PGSIZE - len) {
+		return -ENOSPC;
+	}
+
+	end = (offs + len + PGSIZE - 1) / PGSIZE;
+	for(pg = offs / PGSIZE; pg < end; pg++) {
+		if(!get_page(fs->data, n, pg, 1)) {
+			return -ENOSPC;
+		}
+	}
+	return 0;
+}
+
+static struct tmpfs_node *new_node(struct tmpfs_sb *sb, int mode)
+{
+	int i, old_max;
+	struct tmpfs_node *n, **nodes;
+
+	/* inode 0 is never used, like in the disk filesystem */
+	for(i=1; i<sb->max_nodes; i++) {
+		if(!sb->nodes[i]) break;
+	}
+	if(i >= sb->max_nodes) {
+		old_max = sb->max_nodes;
+		if(!(nodes = grow_array(sb->nodes, &sb->max_nodes, i + 1, sizeof *nodes))) {
+			return 0;
+		}
+		sb->nodes = nodes;
+		i = old_max ? old_max : 1;
+	}
+
+	if(!(n = malloc(sizeof *n))) {
+		return 0;
+	}
+	memset(n, 0, sizeof *n);
+	n->inode.ino = i;
+	n->inode.mode = mode;
+
+	sb->nodes[i] = n;
+	return n;
+}
+
+static void free_node(struct tmpfs_sb *sb, struct tmpfs_node *n)
+{
+	int i;
+	struct tmpfs_dirent *dent;
+
+	for(i=0; i<n->max_pages; i++) {
+		if(n->pages[i]) {
+			pgfree(n->pages[i], 1);
+			sb->npages--;
+		}
+	}
+	free(n->pages);
+
+	while(n->dents) {
+		dent = n->dents;
+		n->dents = dent->next;
+		free(dent);
+	}
+
+	sb->nodes[n->inode.ino] = 0;
+	free(n);
+}
+
+static struct tmpfs_node *find_node(struct tmpfs_sb *sb, int ino)
+{
+	if(ino <= 0 || ino >= sb->max_nodes) {
+		return 0;
+	}
+	return sb->nodes[ino];
+}
+
+/* grow a zero-filled array to at least min_size elements, doubling its size.
+ * returns the new array, or 0 on failure, in which case the old one is left
+ * alone.
+ */
+static void *grow_array(void *arr, int *size, int min_size, int elemsz)
+{
+	char *newarr;
+	int newsz = *size ? *size : 16;
+
+	while(newsz < min_size) {
+		newsz *= 2;
+	}
+	if(!(newarr = malloc(newsz * elemsz))) {
+		return 0;
+	}
+	if(*size) {
+		memcpy(newarr, arr, *size * elemsz);
+	}
+	memset(newarr + *size * elemsz, 0, (newsz - *size) * elemsz);
+	free(arr);
+
+	*size = newsz;
+	return newarr;
+}
+
+/* returns the address of page pg of the file data, allocating and clearing
+ * it if it doesn't exist and alloc is true. A file can't be larger than the
+ * whole filesystem, so pages past that are rejected before growing the page
+ * array for them.
+ */
+static void *get_page(struct tmpfs_sb *sb, struct tmpfs_node *n, int pg, int alloc)
+{
+	int *pages, kpg;
+	void *addr;
+
+	if(pg < n->max_pages && n->pages[pg]) {
+		return (void*)PAGE_TO_ADDR(n->pages[pg]);
+	}
+	if(!alloc || pg < 0 || pg >= sb->max_pages || sb->npages >= sb->max_pages) {
+		return 0;
+	}
+
+	if(pg >= n->max_pages) {
+		if(!(pages = grow_array(n->pages, &n->max_pages, pg + 1, sizeof *pages))) {
+			return 0;
+		}
+		n->pages = pages;
+	}
+
+	if((kpg = pgalloc(1, MEM_KERNEL)) == -1) {
+		return 0;
+	}
+	addr = (void*)PAGE_TO_ADDR(kpg);
+	memset(addr, 0, PGSIZE);
+
+	n->pages[pg] = kpg;
+	sb->npages++;
+	return addr;
+}
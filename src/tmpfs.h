@@ -0,0 +1,11 @@
+#ifndef TMPFS_H_
+#define TMPFS_H_
+
+#include "fs.h"
+
+/* create an empty memory-only filesystem, which can use up to max_pages
+ * kernel pages for file data.
+ */
+int tmpfs_mount(struct filesys *fs, unsigned int max_pages);
+
+#endif	/* TMPFS_H_ */
@@ -8,115 +8,283 @@
 #include "mem.h"
 #include "panic.h"
 #include "proc.h"
+#include "slab.h"
+#include "swap.h"
+
+/* The last four entries of the last page directory point to the four page
+ * directories, which makes all the page tables appear as an array of pages
+ * in the top 8mb of the address space, indexed by page directory entry
+ * (PGTBL), and the four page directories as the last four of them, which
+ * is a single array of 2048 entries at PGDIR_ADDR.
+ */
+#define PGDIR_SELF		(PGDIR_ENTRIES - 4)
+#define PGTBL_BASE		((uint32_t)PGDIR_SELF * PGTBL_ENTRIES * PGSIZE)
+#define PGTBL(x)		((pte_t*)(PGTBL_BASE + PGSIZE * (x)))
+#define PGDIR_ADDR		((uint32_t)PGTBL(PGDIR_SELF))
 
-#define IDMAP_START		0xa0000
+/* 2mb pages are blocks of this order for the physical allocator */
+#define LARGE_PG_ORDER	9
 
-#define PGDIR_ADDR		0xfffff000
-#define PGTBL_BASE		(0xffffffff - 4096 * 1024 + 1)
-#define PGTBL(x)		((uint32_t*)(PGTBL_BASE + PGSIZE * (x)))
+/* virtual pages of the kmap slots, right below the page tables. They're kept
+ * out of the kernel pgalloc range, and their page table is allocated by
+ * init_vm along with all the other kernel page tables.
+ */
+#define KMAP_BASE_PAGE	(ADDR_TO_PAGE(PGTBL_BASE) - KMAP_NUM_SLOTS)
+#define KMAP_PAGE(slot)	(KMAP_BASE_PAGE + (slot))
 
 #define ATTR_PGDIR_MASK	0x3f
 #define ATTR_PGTBL_MASK	0x1ff
 
 #define PAGEFAULT		14
 
+/* longest run of pages to invalidate one by one, instead of flushing the TLB */
+#define TLB_FLUSH_MAX	32
+
+/* user page directory entries are always writable, a read-only one points to
+ * a page table shared copy-on-write after fork.
+ */
+#define PGTBL_SHARED(ent)	(((ent) & (PG_PRESENT | PG_WRITABLE | PG_LARGE)) == PG_PRESENT)
+
+
+/* Free ranges of virtual pages are kept in two treaps (binary search trees
+ * balanced by random priorities): one ordered by address, to find the
+ * neighbours of a range being freed and the range containing a specific
+ * address, and one ordered by size (then address), for best-fit allocation.
+ * Both are intrusive, so that updating them never needs to allocate memory.
+ */
+enum { BY_ADDR, BY_SIZE };
 
 struct page_range {
 	int start, end;
-	struct page_range *next;
+	struct page_range *link[2][2];	/* [BY_ADDR/BY_SIZE][left/right] */
+	unsigned int prio;
+};
+
+struct range_tree {
+	struct page_range *root[2];
+	int nranges, npages;
 };
 
+#define RANGE_SIZE(r)	((r)->end - (r)->start)
+
 /* defined in vm-asm.S */
 void enable_paging(void);
 void disable_paging(void);
+int enable_pae(void);
+int enable_nx(void);
 int get_paging_status(void);
 void set_pgdir_addr(uint32_t addr);
-void flush_tlb(void);
-void flush_tlb_addr(uint32_t addr);
-#define flush_tlb_page(p)	flush_tlb_addr(PAGE_TO_ADDR(p))
 uint32_t get_fault_addr(void);
 
-static void coalesce(struct page_range *low, struct page_range *mid, struct page_range *high);
 static void pgfault(int inum);
-static int copy_on_write(struct vm_page *page);
+static int copy_on_write(int vpg, struct vm_area *va);
+static int demand_zero(int vpg, struct vm_area *va, int write);
+static void put_user_page(int ppg);
+static int alloc_user_page(void);
+static uint32_t alloc_user_pgtbl(void);
+static void init_vmmap(struct rbtree *vmmap);
+static int cmp_vm_area(void *a, void *b);
+static void del_vm_area(struct rbnode *node, void *cls);
+static int set_pte(int vpage, int ppage, unsigned int attr, int pgon);
+static int clear_pte(int vpage);
+static void flush_tlb_range(int vpg_start, int pgcount);
+static void free_page_range(int start, int num);
+static int alloc_pgtbl(int diridx);
+static void map_large(int vpg, uint32_t paddr, unsigned int attr);
+static pte_t *map_pde(uint32_t pdpt_addr, int diridx);
+static uint32_t alloc_pgdir(uint32_t *dir_addr);
+static int split_large(int diridx);
+static void sync_kernel_pde(int diridx);
+static void ref_pgtbl(int ppg);
+static int unref_pgtbl(int ppg);
+static int unshare_pgtbl(int diridx);
 static struct page_range *alloc_node(void);
 static void free_node(struct page_range *node);
-
-/* page directory */
-static uint32_t *pgdir;
-
-/* 2 lists of free ranges, for kernel memory and user memory */
-static struct page_range *pglist[2];
-/* list of free page_range structures to be used in the lists */
-static struct page_range *node_pool;
+static void add_range(struct page_range *r);
+static void rm_range(struct page_range *r);
+static void resize_range(struct page_range *r, int start, int end);
+static struct page_range *tree_insert(struct page_range *root, struct page_range *node, int t);
+static struct page_range *tree_remove(struct page_range *root, struct page_range *node, int t);
+static struct page_range *rotate(struct page_range *root, int t, int dir);
+static int range_less(struct page_range *a, struct page_range *b, int t);
+static struct page_range *find_range_before(int pg);
+static void print_ranges(struct page_range *node, int *last);
+
+/* the four page directories, as a single array */
+static pte_t *pgdir;
+
+/* non-zero if the no-execute bit is enabled */
+static int nx;
+
+/* free ranges of kernel memory. Free user memory is tracked per address
+ * space instead, it's whatever isn't covered by the vm_areas of the process
+ * (see find_vm_gap).
+ */
+static struct range_tree pglist;
+/* object caches for the page_range nodes, and for the vm_areas */
+static struct kmem_cache node_cache = KMEM_CACHE_INIT("page_range", sizeof(struct page_range), 0);
+static struct kmem_cache vm_area_cache = KMEM_CACHE_INIT("vm_area", sizeof(struct vm_area), 0);
 /* the first page range for the whole kernel address space, to get things started */
 static struct page_range first_node;
 
+/* page tables shared by more than one process, keyed by the physical page of
+ * the table, with the number of page directories pointing to it as data.
+ */
+static struct rbtree shared_pgtbl;
+
+/* first page of user space, right after the identity map */
+static int user_start_pg;
+
+/* physical page full of zeros, mapped read-only wherever anonymous memory is
+ * read before it's ever written
+ */
+static int zero_pg;
+
 
 void init_vm(void)
 {
-	uint32_t idmap_end;
+	uint32_t idmap_end, pdpt_addr, dir_addr;
 	int i, kmem_start_pg, pgtbl_base_pg;
 
-	/* setup the page tables */
-	pgdir = (uint32_t*)alloc_phys_page();
-	memset(pgdir, 0, PGSIZE);
-	set_pgdir_addr((uint32_t)pgdir);
+	if(!enable_pae()) {
+		panic("PAE not supported by this processor\n");
+	}
+	nx = enable_nx();
+
+	/* setup the page directory pointer table and the page directories. Paging
+	 * is still disabled, so the physical addresses can be used directly.
+	 */
+	if(!(pdpt_addr = alloc_pgdir(&dir_addr))) {
+		panic("failed to allocate the page directories\n");
+	}
+	pgdir = (pte_t*)dir_addr;
 
-	/* map the video memory and kernel code 1-1 */
+	/* map the video memory and kernel code 1-1 with 2mb pages, everything
+	 * from 0 up to the next 2mb boundary
+	 */
 	get_kernel_mem_range(0, &idmap_end);
-	map_mem_range(IDMAP_START, idmap_end - IDMAP_START, IDMAP_START, 0);
+	idmap_end = (idmap_end + LARGE_PGSIZE - 1) & LARGE_PGADDR_MASK;
+	for(i=0; i<ADDR_TO_PGTBL(idmap_end); i++) {
+		pgdir[i] = ((pte_t)i << 21) | PG_LARGE | PG_WRITABLE | PG_PRESENT;
+	}
 
-	/* make the last page directory entry point to the page directory */
-	pgdir[1023] = ((uint32_t)pgdir & PGENT_ADDR_MASK) | PG_PRESENT;
-	pgdir = (uint32_t*)PGDIR_ADDR;
+	set_pgdir_addr(pdpt_addr);
+	pgdir = (pte_t*)PGDIR_ADDR;
 
 	/* set the page fault handler */
 	interrupt(PAGEFAULT, pgfault);
 
 	/* we can enable paging now */
 	enable_paging();
+	printf("paging: PAE%s\n", nx ? ", NX" : "");
 
 	/* initialize the virtual page allocator */
-	node_pool = 0;
-
 	kmem_start_pg = ADDR_TO_PAGE(KMEM_START);
 	pgtbl_base_pg = ADDR_TO_PAGE(PGTBL_BASE);
 
 	first_node.start = kmem_start_pg;
-	first_node.end = pgtbl_base_pg;
-	first_node.next = 0;
-	pglist[MEM_KERNEL] = &first_node;
+	first_node.end = KMAP_BASE_PAGE;
+	add_range(&first_node);
+
+	/* user space starts after the identity map */
+	user_start_pg = ADDR_TO_PAGE(idmap_end);
 
-	pglist[MEM_USER] = alloc_node();
-	pglist[MEM_USER]->start = ADDR_TO_PAGE(idmap_end);
-	pglist[MEM_USER]->end = kmem_start_pg;
-	pglist[MEM_USER]->next = 0;
+	rb_init(&shared_pgtbl, RB_KEY_INT);
 
-	/* temporarily map something into every 1024th page of the kernel address
-	 * space to force pre-allocation of all the kernel page-tables
+	/* pre-allocate all the kernel page tables, so that the kernel part of the
+	 * page directory never changes, and can be shared by all processes
 	 */
-	for(i=kmem_start_pg; i<pgtbl_base_pg; i+=1024) {
-		/* if there's already something mapped here, leave it alone */
-		if(virt_to_phys_page(i) == -1) {
-			map_page(i, 0, 0);
-			unmap_page(i);
+	for(i=PAGE_TO_PGTBL(kmem_start_pg); i<PAGE_TO_PGTBL(pgtbl_base_pg); i++) {
+		if(!(pgdir[i] & PG_PRESENT) && alloc_pgtbl(i) == -1) {
+			panic("failed to allocate the kernel page tables\n");
+		}
+	}
+
+	if(!(zero_pg = ADDR_TO_PAGE(alloc_phys_page()))) {
+		panic("failed to allocate the zero page\n");
+	}
+	zero_phys_page(PAGE_TO_ADDR(zero_pg));
+	/* keep a reference for ourselves, so that it's never freed */
+	ref_page(zero_pg);
+	get_page_frame(zero_pg)->flags |= PAGE_LOCKED;
+}
+
+/* Allocate the page directory pointer table and the four page directories
+ * of a new address space, and link them together: the PDPT points to the
+ * directories, and the last four entries of the last directory point back to
+ * all four (see PGDIR_SELF). The directories are a single physically
+ * contiguous block, returned in dir_addr, and everything is below 4gb, since
+ * cr3 can only hold a 32bit address. Returns the physical address of the
+ * PDPT, or 0 if we're out of memory. With paging enabled, it uses the
+ * KMAP_PGDIR slot, so call it with interrupts disabled.
+ */
+static uint32_t alloc_pgdir(uint32_t *dir_addr)
+{
+	int i, pgon;
+	uint32_t pdpt_addr, addr;
+	pte_t *tbl;
+
+	if(!(pdpt_addr = alloc_phys_page())) {
+		return 0;
+	}
+	if(!(addr = alloc_phys_pages(2))) {
+		free_phys_page(pdpt_addr);
+		return 0;
+	}
+	pgon = get_paging_status();
+
+	for(i=0; i<4; i++) {
+		zero_phys_page(addr + i * PGSIZE);
+	}
+	tbl = pgon ? kmap(ADDR_TO_PAGE(addr) + 3, KMAP_PGDIR) : (pte_t*)(addr + 3 * PGSIZE);
+	for(i=0; i<4; i++) {
+		tbl[PGDIR_SELF - 3 * PGTBL_ENTRIES + i] = (addr + i * PGSIZE) | PG_WRITABLE | PG_PRESENT;
+	}
+
+	/* the PDPT entries have no permission bits, only the present bit */
+	tbl = pgon ? kmap(ADDR_TO_PAGE(pdpt_addr), KMAP_PGDIR) : (pte_t*)pdpt_addr;
+	memset(tbl, 0, PGSIZE);
+	for(i=0; i<4; i++) {
+		tbl[i] = (addr + i * PGSIZE) | PG_PRESENT;
+	}
+	if(pgon) {
+		kunmap(KMAP_PGDIR);
+	}
+
+	*dir_addr = addr;
+	return pdpt_addr;
+}
+
+/* allocate an empty page table for the page directory entry diridx (paging
+ * must be enabled)
+ */
+static int alloc_pgtbl(int diridx)
+{
+	uint32_t addr;
+	int clear = 0;
+
+	if(!(addr = alloc_phys_page_flags(PHYS_ZEROED | PHYS_POOL_ONLY))) {
+		if(!(addr = alloc_phys_page())) {
+			return -1;
 		}
+		clear = 1;
+	}
+	pgdir[diridx] = addr | PG_WRITABLE | PG_PRESENT;
+	flush_tlb_addr((uint32_t)PGTBL(diridx));
+	if(clear) {
+		memset(PGTBL(diridx), 0, PGSIZE);
 	}
+	return 0;
 }
 
 /* if ppage == -1 we allocate a physical page by calling alloc_phys_page */
 int map_page(int vpage, int ppage, unsigned int attr)
 {
-	uint32_t *pgtbl;
-	int diridx, pgidx, pgon, intr_state;
-	struct process *p;
+	int res, intr_state;
 
 	intr_state = get_intr_state();
 	disable_intr();
 
-	pgon = get_paging_status();
-
 	if(ppage < 0) {
 		uint32_t addr = alloc_phys_page();
 		if(!addr) {
@@ -126,16 +294,188 @@ int map_page(int vpage, int ppage, unsigned int attr)
 		ppage = ADDR_TO_PAGE(addr);
 	}
 
+	if((res = set_pte(vpage, ppage, attr, get_paging_status())) != -1) {
+		flush_tlb_page(vpage);
+	}
+
+	set_intr_state(intr_state);
+	return res;
+}
+
+int unmap_page(int vpage)
+{
+	int res, intr_state;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	if((res = clear_pte(vpage)) == -1) {
+		printf("unmap_page(%d): page already not mapped\n", vpage);
+	} else {
+		flush_tlb_page(vpage);
+	}
+
+	set_intr_state(intr_state);
+	return res;
+}
+
+/* Map a range of pages in a single pass: the page table entries are written
+ * with interrupts disabled throughout, and the TLB is flushed once at the end
+ * (see flush_tlb_range).
+ *
+ * If ppg_start is -1, we allocate physical pages to map with alloc_phys_pages(),
+ * in blocks as large as possible, so that the range ends up physically
+ * contiguous whenever there's enough contiguous free memory.
+ *
+ * User pages are zero-filled instead, preferably with pre-zeroed pages.
+ *
+ * If we run out of memory part of the way, the pages mapped so far are
+ * unmapped again, and the ones we allocated are freed, before returning -1.
+ */
+int map_page_range(int vpg_start, int pgcount, int ppg_start, unsigned int attr)
+{
+	int i, j, ppg, order, nblk, pgon, intr_state, res = 0;
+	uint32_t paddr;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	pgon = get_paging_status();
+
+	if(ppg_start >= 0) {
+		for(i=0; i<pgcount; i++) {
+			if(set_pte(vpg_start + i, ppg_start + i, attr, pgon) == -1) {
+				res = -1;
+				break;
+			}
+		}
+
+	} else if(attr & PG_USER) {
+		for(i=0; i<pgcount; i++) {
+			if((paddr = alloc_phys_page_flags(PHYS_ZEROED | PHYS_POOL_ONLY))) {
+				if(set_pte(vpg_start + i, ADDR_TO_PAGE(paddr), attr, pgon) == -1) {
+					free_phys_page(paddr);
+					res = -1;
+					break;
+				}
+				continue;
+			}
+			/* no pre-zeroed pages left, clear it through its new mapping */
+			if((ppg = alloc_user_page()) == -1) {
+				res = -1;
+				break;
+			}
+			if(set_pte(vpg_start + i, ppg, attr, pgon) == -1) {
+				free_page_frame(ppg);
+				res = -1;
+				break;
+			}
+			flush_tlb_page(vpg_start + i);
+			memset((void*)PAGE_TO_ADDR(vpg_start + i), 0, PGSIZE);
+		}
+
+	} else {
+		for(i=0; i<pgcount; i+=nblk) {
+			/* whole 2mb-aligned blocks of kernel memory get a single 2mb page */
+			if(PAGE_TO_PGTBL_PG(vpg_start + i) == 0 && pgcount - i >= PGTBL_ENTRIES &&
+					(paddr = alloc_phys_pages(LARGE_PG_ORDER))) {
+				map_large(vpg_start + i, paddr, attr);
+				nblk = PGTBL_ENTRIES;
+				continue;
+			}
+
+			order = 0;
+			while(order < PHYS_MAX_ORDER && (2 << order) <= pgcount - i) {
+				order++;
+			}
+			/* fall back to smaller blocks if memory is fragmented */
+			while(!(paddr = alloc_phys_pages(order))) {
+				if(--order < 0) {
+					res = -1;
+					goto end;
+				}
+			}
+			nblk = 1 << order;
+
+			for(j=0; j<nblk; j++) {
+				if(set_pte(vpg_start + i + j, ADDR_TO_PAGE(paddr) + j, attr, pgon) == -1) {
+					while(--j >= 0) {
+						clear_pte(vpg_start + i + j);
+					}
+					free_phys_pages(paddr, order);
+					res = -1;
+					goto end;
+				}
+			}
+		}
+	}
+
+end:
+	if(res == -1) {
+		/* undo the first i pages, which were mapped successfully */
+		if(ppg_start >= 0) {
+			for(j=0; j<i; j++) {
+				clear_pte(vpg_start + j);
+			}
+		} else {
+			free_page_range(vpg_start, i);
+		}
+	}
+	flush_tlb_range(vpg_start, pgcount);
+	set_intr_state(intr_state);
+	return res;
+}
+
+int unmap_page_range(int vpg_start, int pgcount)
+{
+	int i, intr_state, res = 0;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	for(i=0; i<pgcount; i++) {
+		if(clear_pte(vpg_start + i) == -1) {
+			printf("unmap_page_range: page %d already not mapped\n", vpg_start + i);
+			res = -1;
+		}
+	}
+	flush_tlb_range(vpg_start, pgcount);
+
+	set_intr_state(intr_state);
+	return res;
+}
+
+/* write the page table entry for vpage, allocating the page table if
+ * necessary, without flushing the TLB. Called with interrupts disabled.
+ */
+static int set_pte(int vpage, int ppage, unsigned int attr, int pgon)
+{
+	pte_t *pgtbl;
+	int diridx, pgidx, clear = 0;
+
 	diridx = PAGE_TO_PGTBL(vpage);
 	pgidx = PAGE_TO_PGTBL_PG(vpage);
 
+	if(pgdir[diridx] & PG_LARGE) {
+		printf("map_page(%d): page inside a 2mb page\n", vpage);
+		return -1;
+	}
+
 	if(!(pgdir[diridx] & PG_PRESENT)) {
-		/* no page table present, we must allocate one */
-		uint32_t addr = alloc_phys_page();
+		/* no page table present, we must allocate one. Use a pre-zeroed page
+		 * if there is one, otherwise it's cleared in place below.
+		 */
+		uint32_t addr = alloc_phys_page_flags(PHYS_ZEROED | PHYS_POOL_ONLY);
+		if(!addr) {
+			if(!(addr = vpage < KMEM_START_PAGE ? alloc_user_pgtbl() : alloc_phys_page())) {
+				return -1;
+			}
+			clear = 1;
+		}
 
 		/* make sure all page directory entries in the below the kernel vm
 		 * split have the user and writable bits set, otherwise further user
-		 * mappings on the same 4mb block will be unusable in user space.
+		 * mappings on the same 2mb block will be unusable in user space.
 		 */
 		unsigned int pgdir_attr = attr;
 		if(vpage < ADDR_TO_PAGE(KMEM_START)) {
@@ -144,99 +484,147 @@ int map_page(int vpage, int ppage, unsigned int attr)
 
 		pgdir[diridx] = addr | (pgdir_attr & ATTR_PGDIR_MASK) | PG_PRESENT;
 
-		pgtbl = pgon ? PGTBL(diridx) : (uint32_t*)addr;
-		memset(pgtbl, 0, PGSIZE);
+		pgtbl = pgon ? PGTBL(diridx) : (pte_t*)addr;
+		if(clear) {
+			memset(pgtbl, 0, PGSIZE);
+		}
 	} else {
 		if(pgon) {
+			/* don't change the mappings of the other processes sharing it */
+			if(unshare_pgtbl(diridx) == -1) {
+				return -1;
+			}
 			pgtbl = PGTBL(diridx);
 		} else {
-			pgtbl = (uint32_t*)(pgdir[diridx] & PGENT_ADDR_MASK);
+			pgtbl = (pte_t*)(uint32_t)(pgdir[diridx] & PGENT_ADDR_MASK);
 		}
 	}
 
-	pgtbl[pgidx] = PAGE_TO_ADDR(ppage) | (attr & ATTR_PGTBL_MASK) | PG_PRESENT;
-	flush_tlb_page(vpage);
-
-	/* if it's a new *user* mapping, and there is a current process, update the vmmap */
-	if((attr & PG_USER) && (p = get_current_proc())) {
-		struct vm_page *page;
-
-		if(!(page = get_vm_page_proc(p, vpage))) {
-			if(!(page = malloc(sizeof *page))) {
-				panic("map_page: failed to allocate new vm_page structure");
-			}
-			page->vpage = vpage;
-			page->ppage = ppage;
-			page->flags = (attr & ATTR_PGTBL_MASK) | PG_PRESENT;
-			page->nref = 1;
-
-			rb_inserti(&p->vmmap, vpage, page);
-		} else {
-			/* otherwise just update the mapping */
-			page->ppage = ppage;
+	/* user page table entries hold a reference to the page they map, and
+	 * the frame database remembers where a page was first mapped
+	 */
+	if(vpage < KMEM_START_PAGE && (attr & PG_USER)) {
+		struct page *frame;
 
-			/* XXX don't touch the flags, as that's how we implement CoW
-			 * by changing the mapping without affecting the vm_page
-			 */
+		ref_page(ppage);
+		if((frame = get_page_frame(ppage)) && frame->nref == 1) {
+			frame->owner = get_pgdir_addr();
+			frame->vpage = vpage;
+		}
+		if(pgtbl[pgidx] & PG_PRESENT) {
+			put_user_page(PTE_PAGE(pgtbl[pgidx]));
+		} else if(pgtbl[pgidx] & PG_SWAPPED) {
+			swap_put(PTE_SWAP_SLOT(pgtbl[pgidx]), get_current_proc());
 		}
 	}
 
-	set_intr_state(intr_state);
+	pgtbl[pgidx] = MK_PTE(ppage, attr & ATTR_PGTBL_MASK) | PG_PRESENT;
+	if((attr & PG_NOEXEC) && nx) {
+		pgtbl[pgidx] |= PG_NX;
+	}
+	/* user pages start out as recently used, so that the swap clock scan
+	 * doesn't evict them before whoever mapped them gets to use them
+	 */
+	if(vpage < KMEM_START_PAGE && (attr & PG_USER)) {
+		pgtbl[pgidx] |= PG_ACCESSED;
+	}
 	return 0;
 }
 
-int unmap_page(int vpage)
+/* clear the page table entry for vpage without flushing the TLB. Returns -1
+ * if it wasn't mapped. User pages are freed if this was their last mapping,
+ * and swapped out pages give their swap slot back. Called with interrupts
+ * disabled.
+ */
+static int clear_pte(int vpage)
 {
-	uint32_t *pgtbl;
-	int res = 0;
+	pte_t *pgtbl;
 	int diridx = PAGE_TO_PGTBL(vpage);
 	int pgidx = PAGE_TO_PGTBL_PG(vpage);
 
-	int intr_state = get_intr_state();
-	disable_intr();
-
 	if(!(pgdir[diridx] & PG_PRESENT)) {
-		goto err;
+		return -1;
+	}
+	/* unmapping part of a 2mb page, split it into 4k pages first */
+	if((pgdir[diridx] & PG_LARGE) && split_large(diridx) == -1) {
+		printf("unmap_page(%d): failed to split 2mb page\n", vpage);
+		return -1;
+	}
+	if(!PGTBL(diridx)[pgidx]) {
+		return -1;
+	}
+	if(unshare_pgtbl(diridx) == -1) {
+		printf("unmap_page(%d): failed to copy shared page table\n", vpage);
+		return -1;
 	}
 	pgtbl = PGTBL(diridx);
 
 	if(!(pgtbl[pgidx] & PG_PRESENT)) {
-		goto err;
+		if(pgtbl[pgidx] & PG_SWAPPED) {
+			swap_put(PTE_SWAP_SLOT(pgtbl[pgidx]), get_current_proc());
+			pgtbl[pgidx] = 0;
+		}
+		return -1;
 	}
-	pgtbl[pgidx] = 0;
-	flush_tlb_page(vpage);
-
-	if(0) {
-err:
-		printf("unmap_page(%d): page already not mapped\n", vpage);
-		res = -1;
+	if(vpage < KMEM_START_PAGE && (pgtbl[pgidx] & PG_USER)) {
+		put_user_page(PTE_PAGE(pgtbl[pgidx]));
 	}
-	set_intr_state(intr_state);
-	return res;
+	pgtbl[pgidx] = 0;
+	return 0;
 }
 
-/* if ppg_start is -1, we allocate physical pages to map with alloc_phys_page() */
-int map_page_range(int vpg_start, int pgcount, int ppg_start, unsigned int attr)
+/* invalidate the TLB entries of a range of pages after changing their page
+ * table entries. Up to TLB_FLUSH_MAX pages are invalidated one at a time with
+ * invlpg, longer runs are cheaper to drop all at once by reloading cr3.
+ */
+static void flush_tlb_range(int vpg_start, int pgcount)
 {
-	int i, phys_pg;
+	int i;
 
-	for(i=0; i<pgcount; i++) {
-		phys_pg = ppg_start < 0 ? -1 : ppg_start + i;
-		map_page(vpg_start + i, phys_pg, attr);
+	if(pgcount > TLB_FLUSH_MAX) {
+		flush_tlb();
+	} else {
+		for(i=0; i<pgcount; i++) {
+			flush_tlb_page(vpg_start + i);
+		}
 	}
-	return 0;
 }
 
-int unmap_page_range(int vpg_start, int pgcount)
+/* unmap a range of pages, and free the physical memory backing them: the
+ * kernel pages, and the user pages which aren't mapped anywhere else. The TLB
+ * isn't flushed. Called with interrupts disabled.
+ */
+static void free_page_range(int start, int num)
 {
-	int i, res = 0;
+	int i;
 
-	for(i=0; i<pgcount; i++) {
-		if(unmap_page(vpg_start + i) == -1) {
-			res = -1;
+	for(i=0; i<num; i++) {
+		int phys_pg, diridx = PAGE_TO_PGTBL(start + i);
+
+		/* whole 2mb pages are replaced by an empty page table again */
+		if((pgdir[diridx] & PG_LARGE) && PAGE_TO_PGTBL_PG(start + i) == 0 &&
+				num - i >= PGTBL_ENTRIES) {
+			phys_pg = PTE_PAGE(pgdir[diridx]);
+			if(alloc_pgtbl(diridx) == -1) {
+				panic("free_page_range: failed to allocate page table\n");
+			}
+			flush_tlb();
+			sync_kernel_pde(diridx);
+			free_phys_pages(PAGE_TO_ADDR(phys_pg), LARGE_PG_ORDER);
+			i += PGTBL_ENTRIES - 1;
+			continue;
+		}
+
+		/* user pages are freed by clear_pte, when they're not shared */
+		if((phys_pg = virt_to_phys_page(start + i)) != -1) {
+			clear_pte(start + i);
+			if(start + i >= KMEM_START_PAGE) {
+				free_phys_page(PAGE_TO_ADDR(phys_pg));
+			}
+		} else if(start + i < KMEM_START_PAGE) {
+			clear_pte(start + i);	/* might be swapped out */
 		}
 	}
-	return res;
 }
 
 /* if paddr is 0, we allocate physical pages with alloc_phys_page() */
@@ -257,24 +645,65 @@ int map_mem_range(uint32_t vaddr, size_t sz, uint32_t paddr, unsigned int attr)
 	return map_page_range(vpg_start, num_pages, ppg_start, attr);
 }
 
-/* translate a virtual address to a physical address using the current page table */
-uint32_t virt_to_phys(uint32_t vaddr)
+/* clear a physical page, by mapping it temporarily in the KMAP_TMP slot */
+void zero_phys_page(uint32_t paddr)
+{
+	int intr_state;
+
+	if(!get_paging_status()) {
+		memset((void*)paddr, 0, PGSIZE);
+		return;
+	}
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	memset(kmap(ADDR_TO_PAGE(paddr), KMAP_TMP), 0, PGSIZE);
+	kunmap(KMAP_TMP);
+
+	set_intr_state(intr_state);
+}
+
+/* map the physical page ppg at the virtual page of a kmap slot, and return
+ * its address. It just writes the page table entry and invalidates it in the
+ * TLB, without going through pgalloc or map_page. A slot holds one mapping at
+ * a time, so call it with interrupts disabled, and release the slot with
+ * kunmap before enabling them again.
+ */
+void *kmap(int ppg, int slot)
+{
+	int vpg = KMAP_PAGE(slot);
+
+	PGTBL(PAGE_TO_PGTBL(vpg))[PAGE_TO_PGTBL_PG(vpg)] = MK_PTE(ppg, PG_WRITABLE | PG_PRESENT);
+	flush_tlb_page(vpg);
+	return (void*)PAGE_TO_ADDR(vpg);
+}
+
+void kunmap(int slot)
+{
+	int vpg = KMAP_PAGE(slot);
+
+	PGTBL(PAGE_TO_PGTBL(vpg))[PAGE_TO_PGTBL_PG(vpg)] = 0;
+	flush_tlb_page(vpg);
+}
+
+/* translate a virtual address to a physical address using the current page
+ * table. Physical addresses of user pages can be above 4gb.
+ */
+uint64_t virt_to_phys(uint32_t vaddr)
 {
 	int pg;
-	uint32_t pgaddr;
 
 	if((pg = virt_to_phys_page(ADDR_TO_PAGE(vaddr))) == -1) {
 		return 0;
 	}
-	pgaddr = PAGE_TO_ADDR(pg);
-
-	return pgaddr | ADDR_TO_PGOFFS(vaddr);
+	return ((uint64_t)pg << 12) | ADDR_TO_PGOFFS(vaddr);
 }
 
 /* translate a virtual page number to a physical page number using the current page table */
 int virt_to_phys_page(int vpg)
 {
-	uint32_t pgaddr, *pgtbl;
+	pte_t *pgtbl;
 	int diridx, pgidx;
 
 	if(vpg < 0 || vpg >= PAGE_COUNT) {
@@ -287,165 +716,326 @@ int virt_to_phys_page(int vpg)
 	if(!(pgdir[diridx] & PG_PRESENT)) {
 		return -1;
 	}
+	if(pgdir[diridx] & PG_LARGE) {
+		return PTE_PAGE(pgdir[diridx]) + pgidx;
+	}
 	pgtbl = PGTBL(diridx);
 
 	if(!(pgtbl[pgidx] & PG_PRESENT)) {
 		return -1;
 	}
-	pgaddr = pgtbl[pgidx] & PGENT_ADDR_MASK;
-	return ADDR_TO_PAGE(pgaddr);
+	return PTE_PAGE(pgtbl[pgidx]);
 }
 
-/* same as virt_to_phys, but uses the vm_page tree instead of the actual page table */
-uint32_t virt_to_phys_proc(struct process *p, uint32_t vaddr)
+/* map a whole 2mb-aligned slot of kernel memory with a single 2mb page,
+ * replacing its (empty) page table.
+ */
+static void map_large(int vpg, uint32_t paddr, unsigned int attr)
 {
-	int pg;
-	uint32_t pgaddr;
+	int diridx = PAGE_TO_PGTBL(vpg);
+	uint32_t pgtbl_addr = (uint32_t)(pgdir[diridx] & PGENT_ADDR_MASK);
 
-	if((pg = virt_to_phys_page_proc(p, ADDR_TO_PAGE(vaddr))) == -1) {
-		return 0;
-	}
-	pgaddr = PAGE_TO_ADDR(pg);
+	pgdir[diridx] = paddr | (attr & ATTR_PGDIR_MASK) | PG_LARGE | PG_PRESENT;
+	flush_tlb();
 
-	return pgaddr | ADDR_TO_PGOFFS(vaddr);
+	if(pgtbl_addr) {
+		free_phys_page(pgtbl_addr);
+	}
+	sync_kernel_pde(diridx);
 }
 
-/* same virt_to_phys_page, but uses the vm_page tree instead of the actual page table */
-int virt_to_phys_page_proc(struct process *p, int vpg)
+/* replace a 2mb page with a page table mapping the same memory with 4k pages */
+static int split_large(int diridx)
 {
-	struct rbnode *node;
-	assert(p);
+	int i, base;
+	uint32_t addr, attr;
+	pte_t *tbl;
 
-	if(!(node = rb_findi(&p->vmmap, vpg))) {
+	if(!(addr = alloc_phys_page())) {
 		return -1;
 	}
-	return ((struct vm_page*)node->data)->ppage;
-}
+	base = PTE_PAGE(pgdir[diridx]);
+	attr = pgdir[diridx] & ATTR_PGDIR_MASK;
 
-/* allocate a contiguous block of virtual memory pages along with
- * backing physical memory for them, and update the page table.
- */
-int pgalloc(int num, int area)
-{
-	int intr_state, ret = -1;
-	struct page_range *node, *prev, dummy;
+	/* fill it in through the temporary mapping, the 2mb page might be mapping
+	 * whatever we're running on
+	 */
+	tbl = kmap(ADDR_TO_PAGE(addr), KMAP_TMP);
+	for(i=0; i<PGTBL_ENTRIES; i++) {
+		tbl[i] = MK_PTE(base + i, attr | PG_PRESENT);
+	}
+	kunmap(KMAP_TMP);
 
-	intr_state = get_intr_state();
-	disable_intr();
+	pgdir[diridx] = addr | attr | PG_PRESENT;
+	flush_tlb();
 
-	dummy.next = pglist[area];
-	node = pglist[area];
-	prev = &dummy;
+	sync_kernel_pde(diridx);
+	return 0;
+}
 
-	while(node) {
-		if(node->end - node->start >= num) {
-			ret = node->start;
-			node->start += num;
+/* The kernel part of the page directories is copied to every process by
+ * clone_vm, so the rare changes to kernel page directory entries (2mb pages
+ * coming and going) have to be copied to the page directories of all other
+ * processes.
+ */
+static void sync_kernel_pde(int diridx)
+{
+	uint32_t cur_pgdir;
+	pte_t *pde;
+	struct process *p = 0;
 
-			if(node->start == node->end) {
-				prev->next = node->next;
-				node->next = 0;
+	if(diridx < PAGE_TO_PGTBL(KMEM_START_PAGE)) {
+		return;
+	}
+	cur_pgdir = get_pgdir_addr();
 
-				if(node == pglist[area]) {
-					pglist[area] = 0;
-				}
-				free_node(node);
-			}
-			break;
+	while((p = next_process(p))) {
+		if(!p->ctx.pgtbl_paddr || p->ctx.pgtbl_paddr == cur_pgdir) {
+			continue;
 		}
-
-		prev = node;
-		node = node->next;
+		pde = map_pde(p->ctx.pgtbl_paddr, diridx);
+		*pde = pgdir[diridx];
+		kunmap(KMAP_PTE);
 	}
+}
 
-	if(ret >= 0) {
-		/*unsigned int attr = (area == MEM_USER) ? (PG_USER | PG_WRITABLE) : PG_GLOBAL;*/
-		unsigned int attr = (area == MEM_USER) ? (PG_USER | PG_WRITABLE) : 0;
+/* add a reference to a page table shared by fork. Tables used by a single
+ * process aren't in the shared_pgtbl tree, so the first fork starts at 2.
+ */
+static void ref_pgtbl(int ppg)
+{
+	struct rbnode *node;
 
-		/* allocate physical storage and map */
-		if(map_page_range(ret, num, -1, attr) == -1) {
-			ret = -1;
+	if((node = rb_findi(&shared_pgtbl, ppg))) {
+		node->data = (void*)((int)node->data + 1);
+	} else {
+		rb_inserti(&shared_pgtbl, ppg, (void*)2);
+	}
+}
+
+/* drop a reference to a shared page table, returns the number of page
+ * directories still pointing to it.
+ */
+static int unref_pgtbl(int ppg)
+{
+	int count;
+	struct rbnode *node;
+
+	if(!(node = rb_findi(&shared_pgtbl, ppg))) {
+		return 0;
+	}
+	if((count = (int)node->data - 1) <= 1) {
+		rb_deletei(&shared_pgtbl, ppg);
+	} else {
+		node->data = (void*)count;
+	}
+	return count;
+}
+
+/* give the current process a private copy of the page table of the user page
+ * directory entry diridx, if it's shared with other processes. The last
+ * process left using a shared table just makes its entry writable again.
+ */
+static int unshare_pgtbl(int diridx)
+{
+	int i, ppg, intr_state;
+	uint32_t addr;
+	pte_t *tbl;
+
+	if(diridx >= PAGE_TO_PGTBL(KMEM_START_PAGE) || !PGTBL_SHARED(pgdir[diridx])) {
+		return 0;
+	}
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	ppg = PTE_PAGE(pgdir[diridx]);
+
+	addr = 0;
+	if(rb_findi(&shared_pgtbl, ppg) && !(addr = alloc_user_pgtbl())) {
+		set_intr_state(intr_state);
+		return -1;
+	}
+	/* making room might have slept, while the other processes exited */
+	if(addr && !rb_findi(&shared_pgtbl, ppg)) {
+		free_phys_page(addr);
+		addr = 0;
+	}
+
+	if(addr) {
+		/* from now on the pages are mapped by both tables, so they become
+		 * copy-on-write themselves. The other processes can't write through
+		 * the original table anyway, their directory entries are read-only.
+		 * Neither can we, through its read-only self-mapping, so the bits are
+		 * cleared through a temporary mapping.
+		 */
+		tbl = kmap(ppg, KMAP_TMP);
+		for(i=0; i<PGTBL_ENTRIES; i++) {
+			tbl[i] &= ~(pte_t)PG_WRITABLE;
 		}
+		kunmap(KMAP_TMP);
+
+		memcpy(kmap(ADDR_TO_PAGE(addr), KMAP_TMP), PGTBL(diridx), PGSIZE);
+		kunmap(KMAP_TMP);
+
+		for(i=0; i<PGTBL_ENTRIES; i++) {
+			if((PGTBL(diridx)[i] & PG_PRESENT) && (PGTBL(diridx)[i] & PG_USER)) {
+				ref_page(PTE_PAGE(PGTBL(diridx)[i]));
+			} else if(PGTBL(diridx)[i] & PG_SWAPPED) {
+				swap_dup(PTE_SWAP_SLOT(PGTBL(diridx)[i]));
+			}
+		}
+
+		unref_pgtbl(ppg);
+		pgdir[diridx] = addr | (pgdir[diridx] & PGOFFS_MASK);
 	}
+	pgdir[diridx] |= PG_WRITABLE;
+	flush_tlb();
 
 	set_intr_state(intr_state);
-	return ret;
+	return 0;
 }
 
-int pgalloc_vrange(int start, int num)
+/* same as virt_to_phys, but for the address space of process p */
+uint64_t virt_to_phys_proc(struct process *p, uint32_t vaddr)
 {
-	struct page_range *node, *prev, dummy;
-	int area, intr_state, ret = -1;
+	int pg;
+
+	if((pg = virt_to_phys_page_proc(p, ADDR_TO_PAGE(vaddr))) == -1) {
+		return 0;
+	}
+	return ((uint64_t)pg << 12) | ADDR_TO_PGOFFS(vaddr);
+}
+
+/* same as virt_to_phys_page, but for the address space of process p. Its
+ * page directories and page tables are looked up through the temporary
+ * mapping if it's not the current process.
+ */
+int virt_to_phys_page_proc(struct process *p, int vpg)
+{
+	int res = -1, intr_state;
+	pte_t ent, *tbl;
+	assert(p);
 
-	area = (start >= ADDR_TO_PAGE(KMEM_START)) ? MEM_KERNEL : MEM_USER;
-	if(area == MEM_USER && start + num > ADDR_TO_PAGE(KMEM_START)) {
-		printf("pgalloc_vrange: invalid range request crossing user/kernel split\n");
+	if(p->ctx.pgtbl_paddr == get_pgdir_addr()) {
+		return virt_to_phys_page(vpg);
+	}
+	if(vpg < 0 || vpg >= PAGE_COUNT) {
 		return -1;
 	}
 
 	intr_state = get_intr_state();
 	disable_intr();
 
-	dummy.next = pglist[area];
-	node = pglist[area];
-	prev = &dummy;
+	ent = *map_pde(p->ctx.pgtbl_paddr, PAGE_TO_PGTBL(vpg));
 
-	/* check to see if the requested VM range is available */
-	node = pglist[area];
-	while(node) {
-		if(start >= node->start && start + num <= node->end) {
-			ret = start;	/* can do .. */
-
-			if(start == node->start) {
-				/* adjacent to the start of the range */
-				node->start += num;
-			} else if(start + num == node->end) {
-				/* adjacent to the end of the range */
-				node->end = start;
-			} else {
-				/* somewhere in the middle, which means we need
-				 * to allocate a new page_range
-				 */
-				struct page_range *newnode;
+	if((ent & (PG_PRESENT | PG_LARGE)) == (PG_PRESENT | PG_LARGE)) {
+		res = PTE_PAGE(ent) + PAGE_TO_PGTBL_PG(vpg);
+	} else if(ent & PG_PRESENT) {
+		tbl = kmap(PTE_PAGE(ent), KMAP_PTE);
+		ent = tbl[PAGE_TO_PGTBL_PG(vpg)];
+		if(ent & PG_PRESENT) {
+			res = PTE_PAGE(ent);
+		}
+	}
+	kunmap(KMAP_PTE);
 
-				if(!(newnode = alloc_node())) {
-					panic("pgalloc_vrange failed to allocate new page_range while splitting a range in half... bummer\n");
-				}
-				newnode->start = start + num;
-				newnode->end = node->end;
-				newnode->next = node->next;
-
-				node->end = start;
-				node->next = newnode;
-				/* no need to check for null nodes at this point, there's
-				 * certainly stuff at the begining and the end, otherwise we
-				 * wouldn't be here. so break out of it.
-				 */
-				break;
-			}
+	set_intr_state(intr_state);
+	return res;
+}
 
-			if(node->start == node->end) {
-				prev->next = node->next;
-				node->next = 0;
+/* returns a pointer to the page directory entry diridx, in the address space
+ * with the page directory pointer table at physical address pdpt_addr. The
+ * PDPT, and then the page directory, are mapped in the KMAP_PTE slot, so call
+ * it with interrupts disabled, and kunmap(KMAP_PTE) when you're done.
+ */
+static pte_t *map_pde(uint32_t pdpt_addr, int diridx)
+{
+	pte_t *tbl;
 
-				if(node == pglist[area]) {
-					pglist[area] = 0;
-				}
-				free_node(node);
-			}
-			break;
+	tbl = kmap(ADDR_TO_PAGE(pdpt_addr), KMAP_PTE);
+	tbl = kmap(PTE_PAGE(tbl[diridx / PGTBL_ENTRIES]), KMAP_PTE);
+	return tbl + diridx % PGTBL_ENTRIES;
+}
+
+/* returns a pointer to the page table entry of vpg in the address space with
+ * the page directory pointer table at physical address pgdir_addr, or 0 if
+ * there's no page table for it. Other address spaces, and page tables shared
+ * since fork (which are mapped read-only), are accessed through the temporary
+ * mapping, so call it with interrupts disabled, and give the entry back with
+ * unmap_pte as soon as you're done with it.
+ */
+pte_t *map_pte(uint32_t pgdir_addr, int vpg)
+{
+	int diridx = PAGE_TO_PGTBL(vpg);
+	pte_t pde, *tbl;
+
+	if(pgdir_addr == get_pgdir_addr()) {
+		pde = pgdir[diridx];
+		if((pde & (PG_PRESENT | PG_LARGE)) != PG_PRESENT) {
+			return 0;
+		}
+		if(!PGTBL_SHARED(pde)) {
+			return PGTBL(diridx) + PAGE_TO_PGTBL_PG(vpg);
 		}
+		tbl = kmap(PTE_PAGE(pde), KMAP_PTE);
+		return tbl + PAGE_TO_PGTBL_PG(vpg);
+	}
+
+	pde = *map_pde(pgdir_addr, diridx);
+
+	if((pde & (PG_PRESENT | PG_LARGE)) != PG_PRESENT) {
+		kunmap(KMAP_PTE);
+		return 0;
+	}
+	tbl = kmap(PTE_PAGE(pde), KMAP_PTE);
+	return tbl + PAGE_TO_PGTBL_PG(vpg);
+}
 
-		prev = node;
-		node = node->next;
+void unmap_pte(pte_t *pte)
+{
+	if(ADDR_TO_PAGE(pte) == KMAP_PAGE(KMAP_PTE)) {
+		kunmap(KMAP_PTE);
 	}
+}
+
+/* returns the physical page of the page table holding the entry of vpg, in
+ * the address space with the PDPT at pgdir_addr, or -1 if there isn't one.
+ * Uses the KMAP_PTE slot, so call it with interrupts disabled.
+ */
+int pgtbl_page(uint32_t pgdir_addr, int vpg)
+{
+	pte_t pde;
 
-	if(ret >= 0) {
+	if(pgdir_addr == get_pgdir_addr()) {
+		pde = pgdir[PAGE_TO_PGTBL(vpg)];
+	} else {
+		pde = *map_pde(pgdir_addr, PAGE_TO_PGTBL(vpg));
+		kunmap(KMAP_PTE);
+	}
+	if((pde & (PG_PRESENT | PG_LARGE)) != PG_PRESENT) {
+		return -1;
+	}
+	return PTE_PAGE(pde);
+}
+
+/* allocate a contiguous block of virtual memory pages along with
+ * backing physical memory for them, and update the page table.
+ */
+int pgalloc(int num, int area)
+{
+	int intr_state, ret;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	if((ret = pgreserve(num, area)) >= 0) {
 		/*unsigned int attr = (area == MEM_USER) ? (PG_USER | PG_WRITABLE) : PG_GLOBAL;*/
-		unsigned int attr = (area == MEM_USER) ? (PG_USER | PG_WRITABLE) : 0;
+		unsigned int attr = (area == MEM_USER) ? (PG_USER | PG_WRITABLE) : PG_WRITABLE;
 
 		/* allocate physical storage and map */
 		if(map_page_range(ret, num, -1, attr) == -1) {
+			pgfree(ret, num);
 			ret = -1;
 		}
 	}
@@ -454,76 +1044,204 @@ int pgalloc_vrange(int start, int num)
 	return ret;
 }
 
-void pgfree(int start, int num)
+int pgalloc_vrange(int start, int num)
 {
-	int i, area, intr_state;
-	struct page_range *node, *new, *prev, *next;
+	int intr_state, ret;
 
 	intr_state = get_intr_state();
 	disable_intr();
 
-	for(i=0; i<num; i++) {
-		int phys_pg = virt_to_phys_page(start + i);
-		if(phys_pg != -1) {
-			free_phys_page(phys_pg);
+	if((ret = pgreserve_vrange(start, num)) >= 0) {
+		unsigned int attr = (start >= ADDR_TO_PAGE(KMEM_START)) ? PG_WRITABLE : (PG_USER | PG_WRITABLE);
+
+		/* allocate physical storage and map */
+		if(map_page_range(ret, num, -1, attr) == -1) {
+			pgfree(ret, num);
+			ret = -1;
 		}
 	}
 
-	if(!(new = alloc_node())) {
-		panic("pgfree: can't allocate new page_range node to add the freed pages\n");
+	set_intr_state(intr_state);
+	return ret;
+}
+
+/* like pgalloc and pgalloc_vrange, but only allocate the virtual range,
+ * without mapping anything to it. pgreserve picks the smallest free range
+ * which is large enough.
+ *
+ * User pages are allocated in the address space of the current process, and
+ * they're only free until a vm_area is added for them, which is up to the
+ * caller.
+ */
+int pgreserve(int num, int area)
+{
+	int intr_state, ret = -1;
+	struct page_range *node, *best = 0;
+
+	if(num <= 0) {
+		return -1;
+	}
+	if(area == MEM_USER) {
+		return find_vm_gap(get_current_proc(), num, 0);
 	}
-	new->start = start;
-	new->end = start + num;
 
-	area = PAGE_TO_ADDR(start) >= KMEM_START ? MEM_KERNEL : MEM_USER;
+	intr_state = get_intr_state();
+	disable_intr();
 
-	if(!pglist[area] || pglist[area]->start > start) {
-		next = new->next = pglist[area];
-		pglist[area] = new;
-		prev = 0;
+	node = pglist.root[BY_SIZE];
+	while(node) {
+		if(RANGE_SIZE(node) >= num) {
+			best = node;
+			node = node->link[BY_SIZE][0];
+		} else {
+			node = node->link[BY_SIZE][1];
+		}
+	}
 
-	} else {
+	if(best) {
+		ret = best->start;
+		if(RANGE_SIZE(best) == num) {
+			rm_range(best);
+			free_node(best);
+		} else {
+			resize_range(best, best->start + num, best->end);
+		}
+	}
+
+	set_intr_state(intr_state);
+	return ret;
+}
 
-		prev = 0;
-		node = pglist[area];
-		next = node ? node->next : 0;
+int pgreserve_vrange(int start, int num)
+{
+	struct page_range *node, *spare = 0, *unused = 0;
+	struct process *p;
+	int intr_state, ret = -1;
 
-		while(node) {
-			if(!next || next->start > start) {
-				/* place here, after node */
-				new->next = next;
-				node->next = new;
-				prev = node;	/* needed by coalesce after the loop */
-				break;
-			}
+	if(num <= 0 || start < 0 || num > PAGE_COUNT - start) {
+		return -1;
+	}
+	if(start < KMEM_START_PAGE) {
+		if(start + num > KMEM_START_PAGE) {
+			printf("pgreserve_vrange: invalid range request crossing user/kernel split\n");
+			return -1;
+		}
+		/* free if it's not part of any area of the current process */
+		if(start < user_start_pg || !(p = get_current_proc()) ||
+				find_vm_overlap(p, start, start + num)) {
+			return -1;
+		}
+		return start;
+	}
 
-			prev = node;
-			node = next;
-			next = node ? node->next : 0;
+	intr_state = get_intr_state();
+	disable_intr();
+
+again:
+	/* check to see if the requested VM range is available */
+	node = find_range_before(start + 1);
+	if(node && start + num <= node->end) {
+		ret = start;	/* can do .. */
+
+		if(start == node->start && start + num == node->end) {
+			/* the whole range */
+			rm_range(node);
+			unused = node;
+		} else if(start == node->start) {
+			/* adjacent to the start of the range */
+			resize_range(node, start + num, node->end);
+		} else if(start + num == node->end) {
+			/* adjacent to the end of the range */
+			resize_range(node, node->start, start);
+		} else {
+			/* somewhere in the middle, which means we need another
+			 * page_range for the part after it. Allocating it might reserve
+			 * pages itself, so look for our range again afterwards.
+			 */
+			if(!spare) {
+				spare = alloc_node();
+				goto again;
+			}
+			spare->start = start + num;
+			spare->end = node->end;
+			resize_range(node, node->start, start);
+			add_range(spare);
+			spare = 0;
 		}
 	}
 
-	coalesce(prev, new, next);
+	/* both trees are consistent again, freeing nodes is safe now */
+	if(spare) free_node(spare);
+	if(unused) free_node(unused);
+
 	set_intr_state(intr_state);
+	return ret;
 }
 
-static void coalesce(struct page_range *low, struct page_range *mid, struct page_range *high)
+void pgfree(int start, int num)
 {
-	if(high) {
-		if(mid->end == high->start) {
-			mid->end = high->end;
-			mid->next = high->next;
-			free_node(high);
+	int end, intr_state;
+	struct page_range *node, *prev, *next, *spare = 0, *unused = 0;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	free_page_range(start, num);
+	flush_tlb_range(start, num);
+
+	/* user pages become free when their vm_areas are removed */
+	if(start < KMEM_START_PAGE) {
+		set_intr_state(intr_state);
+		return;
+	}
+
+again:
+	/* the free ranges right before and after it */
+	prev = find_range_before(start);
+	next = 0;
+	node = pglist.root[BY_ADDR];
+	while(node) {
+		if(node->start > start) {
+			next = node;
+			node = node->link[BY_ADDR][0];
+		} else {
+			node = node->link[BY_ADDR][1];
 		}
 	}
 
-	if(low) {
-		if(low->end == mid->start) {
-			low->end += mid->end;
-			low->next = mid->next;
-			free_node(mid);
+	if((prev && prev->end > start) || (next && next->start < start + num)) {
+		panic("pgfree(%d, %d): pages already free\n", start, num);
+	}
+
+	/* coalesce with them if they're adjacent */
+	if(prev && prev->end == start) {
+		if(next && next->start == start + num) {
+			/* fills the gap between two free ranges, merge all three */
+			end = next->end;
+			rm_range(next);
+			unused = next;
+			resize_range(prev, prev->start, end);
+		} else {
+			resize_range(prev, prev->start, start + num);
 		}
+	} else if(next && next->start == start + num) {
+		resize_range(next, start, next->end);
+	} else {
+		/* allocating a node might reserve pages itself, look again after */
+		if(!spare) {
+			spare = alloc_node();
+			goto again;
+		}
+		spare->start = start;
+		spare->end = start + num;
+		add_range(spare);
+		spare = 0;
 	}
+
+	if(spare) free_node(spare);
+	if(unused) free_node(unused);
+
+	set_intr_state(intr_state);
 }
 
 static void pgfault(int inum)
@@ -531,27 +1249,41 @@ static void pgfault(int inum)
 	struct intr_frame *frm = get_intr_frame();
 	uint32_t fault_addr = get_fault_addr();
 
-	/* the fault occured in user space */
-	if(frm->err & PG_USER) {
+	/* the fault occured in user space, or the kernel touched user memory
+	 * (syscall arguments and results) which isn't there yet, because it's
+	 * demand-zero or swapped out
+	 */
+	if((frm->err & PG_USER) || (fault_addr < KMEM_START && get_current_proc())) {
 		int fault_page = ADDR_TO_PAGE(fault_addr);
+		struct vm_area *va;
 		struct process *proc = get_current_proc();
-		printf("DBG: page fault in user space (pid: %d)\n", proc->id);
 		assert(proc);
 
 		if(frm->err & PG_PRESENT) {
 			/* it's not due to a missing page fetch the attributes */
 			int pgnum = ADDR_TO_PAGE(fault_addr);
 
+			if((frm->err & PG_WRITABLE) && PGTBL_SHARED(pgdir[PAGE_TO_PGTBL(pgnum)])) {
+				/* write to a page table shared since fork, get our own copy
+				 * and restart. If the page itself is still shared, that will
+				 * fault again as a normal CoW fault.
+				 */
+				if(unshare_pgtbl(PAGE_TO_PGTBL(pgnum)) == -1) {
+					panic("failed to copy shared page table!");
+				}
+				return;
+			}
+
 			if((frm->err & PG_WRITABLE) && (get_page_bit(pgnum, PG_WRITABLE, 0) == 0)) {
 				/* write permission fault might be a CoW fault or just an error
-				 * fetch the vm_page permissions to check if this is suppoosed to be
-				 * a writable page (which means we should CoW).
+				 * check the permissions of the vm_area it belongs to, to see if
+				 * this is supposed to be a writable page (which means we should CoW).
 				 */
-				struct vm_page *page = get_vm_page_proc(proc, pgnum);
+				struct vm_area *va = find_vm_area(proc, pgnum);
 
-				if(page->flags & PG_WRITABLE) {
+				if(va && (va->flags & PG_WRITABLE)) {
 					/* ok this is a CoW fault */
-					if(copy_on_write(page) == -1) {
+					if(copy_on_write(pgnum, va) == -1) {
 						panic("copy on write failed!");
 					}
 					return;	/* done, allow the process to restart the instruction and continue */
@@ -566,23 +1298,48 @@ static void pgfault(int inum)
 
 		/* so it's a missing page... ok */
 
+		/* swapped out pages are read back in from the swap device */
+		if((pgdir[PAGE_TO_PGTBL(fault_page)] & (PG_PRESENT | PG_LARGE)) == PG_PRESENT &&
+				(PGTBL(PAGE_TO_PGTBL(fault_page))[PAGE_TO_PGTBL_PG(fault_page)] & PG_SWAPPED)) {
+			if(swap_in(fault_page) == -1) {
+				printf("failed to read page %x back from swap\n", PAGE_TO_ADDR(fault_page));
+				goto unhandled;
+			}
+			return;
+		}
+
+		if((va = find_vm_area(proc, fault_page))) {
+			/* heap and mmap memory is only allocated when it's first touched */
+			if(va->type == VMA_ANON && demand_zero(fault_page, va, frm->err & PG_WRITABLE) != -1) {
+				return;
+			}
+			goto unhandled;
+		}
+
 		/* detect if it's an automatic stack growth deal */
 		if(fault_page < proc->user_stack_pg && proc->user_stack_pg - fault_page < USTACK_MAXGROW) {
 			int num_pages = proc->user_stack_pg - fault_page;
 			printf("growing user (%d) stack by %d pages\n", proc->id, num_pages);
 
-			if(pgalloc_vrange(fault_page, num_pages) != fault_page) {
+			if(pgreserve_vrange(fault_page, num_pages) != fault_page ||
+					map_page_range(fault_page, num_pages, -1, USTACK_ATTR) == -1) {
 				printf("failed to allocate VM for stack growth\n");
 				/* TODO: in the future we'd SIGSEGV the process here, for now just panic */
 				goto unhandled;
 			}
+
+			/* the stack area grows down with it */
+			if((va = find_vm_area(proc, proc->user_stack_pg))) {
+				va->start = fault_page;
+			} else if(add_vm_area(proc, fault_page, proc->user_stack_pg,
+						USTACK_ATTR, VMA_MEM) == -1) {
+				panic("failed to add the stack vm_area\n");
+			}
 			proc->user_stack_pg = fault_page;
 			return;
 		}
 
-		/* it's not a stack growth fault. since we don't do swapping yet, just
-		 * fall to unhandled and panic
-		 */
+		/* it's not a stack growth fault, just fall to unhandled and panic */
 	}
 
 unhandled:
@@ -593,6 +1350,9 @@ unhandled:
 	if(frm->err & PG_PRESENT) {
 		if(frm->err & 8) {
 			printf("reserved bit set in some paging structure\n");
+		} else if(frm->err & 0x10) {
+			printf("instruction fetch from a no-execute page ");
+			printf("in %s mode\n", (frm->err & PG_USER) ? "user" : "kernel");
 		} else {
 			printf("%s protection violation ", (frm->err & PG_WRITABLE) ? "WRITE" : "READ");
 			printf("in %s mode\n", (frm->err & PG_USER) ? "user" : "kernel");
@@ -605,105 +1365,414 @@ unhandled:
 }
 
 /* copy-on-write handler, called from pgfault above */
-static int copy_on_write(struct vm_page *page)
+static int copy_on_write(int vpg, struct vm_area *va)
 {
-	int tmpvpg;
-	struct vm_page *newpage;
-	struct rbnode *vmnode;
-	struct process *p = get_current_proc();
+	int ppg, newppg, intr_state;
 
-	assert(page->nref > 0);
+	ppg = virt_to_phys_page(vpg);
 
 	/* first of all check the refcount. If it's 1 then we don't need to copy
 	 * anything. This will happen when all forked processes except one have
 	 * marked this read-write again after faulting.
 	 */
-	if(page->nref == 1) {
-		set_page_bit(page->vpage, PG_WRITABLE, PAGE_ONLY);
+	if(ppg != zero_pg && get_page_ref(ppg) == 1) {
+		set_page_bit(vpg, PG_WRITABLE, PAGE_ONLY);
 		return 0;
 	}
 
-	/* ok let's make a copy and mark it read-write */
-	if(!(newpage = malloc(sizeof *newpage))) {
-		printf("copy_on_write: failed to allocate new vm_page\n");
-		return -1;
+	if(ppg == zero_pg) {
+		/* first write to demand-zero memory, no need to copy anything */
+		return map_page_range(vpg, 1, -1, va->flags);
 	}
-	newpage->vpage = page->vpage;
-	newpage->flags = page->flags;
 
-	if(!(tmpvpg = pgalloc(1, MEM_KERNEL))) {
+	/* ok let's make a copy and mark it read-write */
+	if((newppg = alloc_user_page()) == -1) {
 		printf("copy_on_write: failed to allocate physical page\n");
 		/* XXX proper action: SIGSEGV */
 		return -1;
 	}
-	newpage->ppage = virt_to_phys_page(tmpvpg);
-	newpage->nref = 1;
 
 	/* do the copy */
-	memcpy((void*)PAGE_TO_ADDR(tmpvpg), (void*)PAGE_TO_ADDR(page->vpage), PGSIZE);
-	unmap_page(tmpvpg);
-	pgfree(tmpvpg, 1);
+	intr_state = get_intr_state();
+	disable_intr();
 
-	/* set the new vm_page in the process vmmap */
-	vmnode = rb_findi(&p->vmmap, newpage->vpage);
-	assert(vmnode && vmnode->data == page);	/* shouldn't be able to fail */
-	vmnode->data = newpage;
+	memcpy(kmap(newppg, KMAP_COPY), (void*)PAGE_TO_ADDR(vpg), PGSIZE);
+	kunmap(KMAP_COPY);
 
-	/* also update tha page table */
-	map_page(newpage->vpage, newpage->ppage, newpage->flags);
+	set_intr_state(intr_state);
 
-	/* finally decrease the refcount at the original vm_page struct */
-	page->nref--;
-	return 0;
+	/* update the page table, which also drops our reference to the
+	 * original page
+	 */
+	return map_page(vpg, newppg, va->flags);
 }
 
-/* --- page range list node management --- */
-#define NODES_IN_PAGE	(PGSIZE / sizeof(struct page_range))
+/* called by pgfault for missing pages of anonymous areas (heap and mmap
+ * memory), to allocate them on first use. Reads map the shared zero page
+ * read-only, and the first write replaces it with a private page in
+ * copy_on_write.
+ */
+static int demand_zero(int vpg, struct vm_area *va, int write)
+{
+	if(write) {
+		if(!(va->flags & PG_WRITABLE)) {
+			return -1;
+		}
+		return map_page_range(vpg, 1, -1, va->flags);
+	}
+	return map_page(vpg, zero_pg, PG_USER | (va->flags & PG_NOEXEC));
+}
+
+/* drop the reference of a user page table entry to the page it maps, freeing
+ * the page if it was the last one
+ */
+static void put_user_page(int ppg)
+{
+	if(unref_page(ppg) == 0) {
+		free_page_frame(ppg);
+	}
+}
 
+/* allocate a physical page for user memory, paging out other user pages to
+ * make room if we're out of memory. User pages are only ever accessed through
+ * user mappings and kmap, so they can come from high memory. Returns the
+ * page number, or -1.
+ */
+static int alloc_user_page(void)
+{
+	int pg;
+
+	if((pg = alloc_page_frame()) == -1 && swap_out(SWAP_CLUSTER) > 0) {
+		pg = alloc_page_frame();
+	}
+	return pg;
+}
+
+/* allocate a physical page for a user page table, paging out user pages to
+ * make room like alloc_user_page. Returns the physical address, or 0.
+ */
+static uint32_t alloc_user_pgtbl(void)
+{
+	uint32_t addr;
+
+	if(!(addr = alloc_phys_page()) && swap_out(SWAP_CLUSTER) > 0) {
+		addr = alloc_phys_page();
+	}
+	return addr;
+}
+
+/* --- page range list node management --- */
 static struct page_range *alloc_node(void)
 {
 	struct page_range *node;
-	int pg, i;
 
-	if(node_pool) {
-		node = node_pool;
-		node_pool = node_pool->next;
-		/*printf("alloc_node -> %x\n", (unsigned int)node);*/
+	if(!(node = kmem_cache_alloc(&node_cache))) {
+		panic("ran out of physical memory while allocating VM range structures\n");
+	}
+	return node;
+}
+
+static void free_node(struct page_range *node)
+{
+	/* the statically allocated first node doesn't come from the cache */
+	if(node != &first_node) {
+		kmem_cache_free(&node_cache, node);
+	}
+}
+
+static void add_range(struct page_range *r)
+{
+	static unsigned int seed = 0x9e3779b9;
+	struct range_tree *tree = &pglist;
+
+	/* xorshift, the priorities just have to look random */
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	r->prio = seed;
+
+	tree->root[BY_ADDR] = tree_insert(tree->root[BY_ADDR], r, BY_ADDR);
+	tree->root[BY_SIZE] = tree_insert(tree->root[BY_SIZE], r, BY_SIZE);
+	tree->nranges++;
+	tree->npages += RANGE_SIZE(r);
+}
+
+static void rm_range(struct page_range *r)
+{
+	struct range_tree *tree = &pglist;
+
+	tree->root[BY_ADDR] = tree_remove(tree->root[BY_ADDR], r, BY_ADDR);
+	tree->root[BY_SIZE] = tree_remove(tree->root[BY_SIZE], r, BY_SIZE);
+	tree->nranges--;
+	tree->npages -= RANGE_SIZE(r);
+}
+
+/* change the extents of a free range. It must stay between the same
+ * neighbours, so only its position in the size tree changes.
+ */
+static void resize_range(struct page_range *r, int start, int end)
+{
+	struct range_tree *tree = &pglist;
+
+	tree->root[BY_SIZE] = tree_remove(tree->root[BY_SIZE], r, BY_SIZE);
+	tree->npages -= RANGE_SIZE(r);
+
+	r->start = start;
+	r->end = end;
+
+	tree->root[BY_SIZE] = tree_insert(tree->root[BY_SIZE], r, BY_SIZE);
+	tree->npages += RANGE_SIZE(r);
+}
+
+static struct page_range *tree_insert(struct page_range *root, struct page_range *node, int t)
+{
+	int dir;
+
+	if(!root) {
+		node->link[t][0] = node->link[t][1] = 0;
 		return node;
 	}
 
-	/* no node structures in the pool, we need to allocate a new page,
-	 * split it up into node structures, add them in the pool, and
-	 * allocate one of them.
-	 */
-	if(!(pg = pgalloc(1, MEM_KERNEL))) {
-		panic("ran out of physical memory while allocating VM range structures\n");
+	dir = range_less(root, node, t);
+	root->link[t][dir] = tree_insert(root->link[t][dir], node, t);
+
+	/* keep the heap property of the priorities */
+	if(root->link[t][dir]->prio > root->prio) {
+		root = rotate(root, t, dir);
 	}
-	node_pool = (struct page_range*)PAGE_TO_ADDR(pg);
+	return root;
+}
+
+static struct page_range *tree_remove(struct page_range *root, struct page_range *node, int t)
+{
+	int dir;
+	struct page_range *left, *right;
 
-	/* link them up, skip the first as we'll just allocate it anyway */
-	for(i=2; i<NODES_IN_PAGE; i++) {
-		node_pool[i - 1].next = node_pool + i;
+	if(!root) {
+		panic("tree_remove: page_range %d-%d not found\n", node->start, node->end);
 	}
-	node_pool[NODES_IN_PAGE - 1].next = 0;
 
-	/* grab the first and return it */
-	node = node_pool++;
-	/*printf("alloc_node -> %x\n", (unsigned int)node);*/
-	return node;
+	if(root == node) {
+		left = root->link[t][0];
+		right = root->link[t][1];
+		if(!left) return right;
+		if(!right) return left;
+
+		/* rotate the child with the higher priority up, and keep going down */
+		dir = left->prio > right->prio ? 0 : 1;
+		root = rotate(root, t, dir);
+		root->link[t][!dir] = tree_remove(root->link[t][!dir], node, t);
+		return root;
+	}
+
+	dir = range_less(root, node, t);
+	root->link[t][dir] = tree_remove(root->link[t][dir], node, t);
+	return root;
 }
 
-static void free_node(struct page_range *node)
+/* make the child of root in direction dir the new root of the subtree */
+static struct page_range *rotate(struct page_range *root, int t, int dir)
+{
+	struct page_range *child = root->link[t][dir];
+
+	root->link[t][dir] = child->link[t][!dir];
+	child->link[t][!dir] = root;
+	return child;
+}
+
+static int range_less(struct page_range *a, struct page_range *b, int t)
+{
+	if(t == BY_SIZE && RANGE_SIZE(a) != RANGE_SIZE(b)) {
+		return RANGE_SIZE(a) < RANGE_SIZE(b);
+	}
+	return a->start < b->start;
+}
+
+/* returns the free range with the highest start address below pg */
+static struct page_range *find_range_before(int pg)
+{
+	struct page_range *res = 0, *node = pglist.root[BY_ADDR];
+
+	while(node) {
+		if(node->start < pg) {
+			res = node;
+			node = node->link[BY_ADDR][1];
+		} else {
+			node = node->link[BY_ADDR][0];
+		}
+	}
+	return res;
+}
+
+/* --- vm_area management --- */
+static void init_vmmap(struct rbtree *vmmap)
+{
+	rb_init(vmmap, RB_KEY_ADDR);
+	rb_set_compare_func(vmmap, cmp_vm_area);
+	rb_set_delete_func(vmmap, del_vm_area, 0);
+}
+
+/* overlapping areas compare equal, which makes any page of an area (or any
+ * range overlapping it) find it in the tree
+ */
+static int cmp_vm_area(void *a, void *b)
+{
+	struct vm_area *va = a, *vb = b;
+
+	if(va->end <= vb->start) {
+		return -1;
+	}
+	return va->start >= vb->end ? 1 : 0;
+}
+
+static void del_vm_area(struct rbnode *node, void *cls)
+{
+	kmem_cache_free(&vm_area_cache, node->key);
+}
+
+static int insert_vm_area(struct rbtree *vmmap, int start, int end, unsigned int flags, int type)
+{
+	struct vm_area *va, key;
+
+	key.start = start;
+	key.end = end;
+	if(start >= end || rb_find(vmmap, &key)) {
+		return -1;
+	}
+
+	if(!(va = kmem_cache_alloc(&vm_area_cache))) {
+		return -1;
+	}
+	va->start = start;
+	va->end = end;
+	va->flags = flags;
+	va->type = type;
+
+	return rb_insert(vmmap, va, va);
+}
+
+/* add the area [start, end) to the vmmap of p, fails if it overlaps any of
+ * its existing areas
+ */
+int add_vm_area(struct process *p, int start, int end, unsigned int flags, int type)
+{
+	return insert_vm_area(&p->vmmap, start, end, flags, type);
+}
+
+/* remove an area from the vmmap and free it. Any pages still mapped in its
+ * range are left alone.
+ */
+void rm_vm_area(struct process *p, struct vm_area *va)
+{
+	rb_delete(&p->vmmap, va);
+}
+
+struct vm_area *find_vm_area(struct process *p, int vpg)
+{
+	struct vm_area key;
+	struct rbnode *node;
+
+	key.start = vpg;
+	key.end = vpg + 1;
+	if(!(node = rb_find(&p->vmmap, &key))) {
+		return 0;
+	}
+	return node->data;
+}
+
+/* returns the lowest area overlapping [start, end), or 0 if there isn't any */
+struct vm_area *find_vm_overlap(struct process *p, int start, int end)
+{
+	struct vm_area *va, *res = 0;
+	struct rbnode *node = rb_root(&p->vmmap);
+
+	while(node) {
+		va = node->key;
+		if(end <= va->start) {
+			node = node->left;
+		} else if(start >= va->end) {
+			node = node->right;
+		} else {
+			/* there might be more overlapping areas further left */
+			res = va;
+			node = node->left;
+		}
+	}
+	return res;
+}
+
+/* returns 0 if size bytes at addr are all user memory belonging to areas of
+ * p, which the kernel can access on its behalf (missing pages are faulted
+ * in), -1 otherwise
+ */
+int check_user_range(struct process *p, uint32_t addr, int size)
 {
-	node->next = node_pool;
-	node_pool = node;
-	/*printf("free_node\n");*/
+	int pg, end;
+	struct vm_area *va;
+
+	if(size <= 0 || addr >= KMEM_START || (uint32_t)size > KMEM_START - addr) {
+		return -1;
+	}
+	pg = ADDR_TO_PAGE(addr);
+	end = ADDR_TO_PAGE(addr + size - 1) + 1;
+
+	while(pg < end) {
+		if(!(va = find_vm_area(p, pg))) {
+			return -1;
+		}
+		pg = va->end;
+	}
+	return 0;
+}
+
+/* find num consecutive pages of the user address space of p, which aren't
+ * part of any of its areas. The lowest such range is returned, or with top
+ * the highest one which leaves USTACK_MAXGROW pages free below the stack.
+ * Returns -1 if there's no gap large enough.
+ */
+int find_vm_gap(struct process *p, int num, int top)
+{
+	int start, end, res = -1;
+	struct rbnode *node;
+	struct vm_area *va;
+
+	if(!p || num <= 0) {
+		return -1;
+	}
+	end = KMEM_START_PAGE;
+	if(top) {
+		end = (p->user_stack_pg ? p->user_stack_pg : KMEM_START_PAGE) - USTACK_MAXGROW;
+	}
+
+	/* the gaps are the ranges between consecutive areas */
+	start = user_start_pg;
+	rb_begin(&p->vmmap);
+	while((node = rb_next(&p->vmmap))) {
+		va = node->data;
+		if(va->start >= end) {
+			break;
+		}
+		if(va->start - start >= num) {
+			if(!top) {
+				return start;
+			}
+			res = va->start - num;
+		}
+		if(va->end > start) {
+			start = va->end;
+		}
+	}
+
+	if(end - start >= num) {
+		res = top ? end - num : start;
+	}
+	return res;
 }
 
 /* clone_vm makes a copy of the current page tables, thus duplicating the
  * virtual address space.
  *
- * For the kernel part of the address space (last 256 page directory entries)
+ * For the kernel part of the address space (last 512 page directory entries)
  * we don't want to diplicate the page tables, just point all page directory
  * entries to the same set of page tables.
  *
@@ -712,135 +1781,198 @@ static void free_node(struct page_range *node)
  */
 void clone_vm(struct process *pdest, struct process *psrc, int cow)
 {
-	int i, j, dirpg, tblpg, kstart_dirent;
-	uint32_t paddr;
-	uint32_t *ndir, *ntbl;
+	int i, j, kstart_dirent, intr_state;
+	uint32_t paddr, pdpt_paddr, dir_paddr;
+	pte_t *ndir = 0, *nde, *ntbl;
 	struct rbnode *vmnode;
+	struct vm_area *va;
 
-	/* allocate the new page directory */
-	if((dirpg = pgalloc(1, MEM_KERNEL)) == -1) {
-		panic("clone_vmem: failed to allocate page directory page\n");
-	}
-	ndir = (uint32_t*)PAGE_TO_ADDR(dirpg);
-
-	/* allocate a virtual page for temporarily mapping all new
-	 * page tables while we populate them.
+	/* a copy of the parent's vm_areas. The pages themselves are shared
+	 * through the page tables, and their reference counts.
 	 */
-	if((tblpg = pgalloc(1, MEM_KERNEL)) == -1) {
-		panic("clone_vmem: failed to allocate page table page\n");
+	init_vmmap(&pdest->vmmap);
+	rb_begin(&psrc->vmmap);
+	while((vmnode = rb_next(&psrc->vmmap))) {
+		va = vmnode->data;
+		if(insert_vm_area(&pdest->vmmap, va->start, va->end, va->flags, va->type) == -1) {
+			panic("clone_vm: failed to allocate vm_area\n");
+		}
 	}
-	ntbl = (uint32_t*)PAGE_TO_ADDR(tblpg);
 
-	/* we will allocate physical pages and map them to this virtual page
-	 * as needed in the loop below. we don't need the physical page allocated
-	 * by pgalloc.
+	/* the new page directories and each new page table are filled in
+	 * through their kmap slots, which we hold until we're done
 	 */
-	free_phys_page(virt_to_phys((uint32_t)ntbl));
+	intr_state = get_intr_state();
+	disable_intr();
 
-	kstart_dirent = ADDR_TO_PAGE(KMEM_START) / 1024;
+	/* allocate the new page directories */
+	if(!(pdpt_paddr = alloc_pgdir(&dir_paddr))) {
+		panic("clone_vm: failed to allocate page directory pages\n");
+	}
 
-	/* user space */
-	for(i=0; i<kstart_dirent; i++) {
-		if(pgdir[i] & PG_PRESENT) {
-			if(cow) {
-				/* first go through all the entries of the existing
-				 * page table and unset the writable bits.
-				 */
-				for(j=0; j<1024; j++) {
-					if(PGTBL(i)[j] & PG_PRESENT) {
-						clear_page_bit(i * 1024 + j, PG_WRITABLE, PAGE_ONLY);
-						/*PGTBL(i)[j] &= ~(uint32_t)PG_WRITABLE;*/
-					}
-				}
-			}
+	kstart_dirent = PAGE_TO_PGTBL(KMEM_START_PAGE);
 
+	for(i=0; i<PGDIR_SELF; i++) {
+		/* the four directories are mapped one at a time */
+		if(i % PGTBL_ENTRIES == 0) {
+			ndir = kmap(ADDR_TO_PAGE(dir_paddr) + i / PGTBL_ENTRIES, KMAP_PGDIR);
+		}
+		nde = ndir + i % PGTBL_ENTRIES;
+
+		if(i >= kstart_dirent) {
+			/* for the kernel space we'll just use the same page tables */
+			*nde = pgdir[i];
+		} else if(pgdir[i] & PG_LARGE) {
+			/* 2mb pages of the identity map are shared */
+			*nde = pgdir[i];
+		} else if(cow && (pgdir[i] & PG_PRESENT)) {
+			/* don't copy anything, both processes use the same page table
+			 * through a read-only directory entry. The first write anywhere
+			 * in these 2mb faults, and unshare_pgtbl gives the writer its own
+			 * copy then. The TLB is flushed once, after the loop.
+			 */
+			pgdir[i] &= ~(pte_t)PG_WRITABLE;
+			*nde = pgdir[i];
+			ref_pgtbl(PTE_PAGE(pgdir[i]));
+		} else if(pgdir[i] & PG_PRESENT) {
 			/* allocate a page table for the clone */
-			paddr = alloc_phys_page();
+			if(!(paddr = alloc_phys_page())) {
+				panic("clone_vm: failed to allocate page table\n");
+			}
 
 			/* copy the page table */
-			map_page(tblpg, ADDR_TO_PAGE(paddr), 0);
+			ntbl = kmap(ADDR_TO_PAGE(paddr), KMAP_PGTBL);
 			memcpy(ntbl, PGTBL(i), PGSIZE);
 
+			/* the user pages are now mapped by both page tables */
+			for(j=0; j<PGTBL_ENTRIES; j++) {
+				if((ntbl[j] & PG_PRESENT) && (ntbl[j] & PG_USER)) {
+					ref_page(PTE_PAGE(ntbl[j]));
+				} else if(ntbl[j] & PG_SWAPPED) {
+					swap_dup(PTE_SWAP_SLOT(ntbl[j]));
+				}
+			}
+
 			/* set the new page directory entry */
-			ndir[i] = paddr | (pgdir[i] & PGOFFS_MASK);
-		} else {
-			ndir[i] = 0;
+			*nde = paddr | (pgdir[i] & PGOFFS_MASK);
 		}
 	}
+	kunmap(KMAP_PGTBL);
+	kunmap(KMAP_PGDIR);
 
-	/* make a copy of the parent's vmmap tree pointing to the same vm_pages
-	 * and increase the reference counters for all vm_pages.
-	 */
-	rb_init(&pdest->vmmap, RB_KEY_INT);
-	rb_begin(&psrc->vmmap);
-	while((vmnode = rb_next(&psrc->vmmap))) {
-		struct vm_page *pg = vmnode->data;
-		pg->nref++;
-
-		/* insert the same vm_page to the new tree */
-		rb_inserti(&pdest->vmmap, pg->vpage, pg);
+	if(cow) {
+		/* we just changed all the page protection bits, so we need to flush the TLB */
+		flush_tlb();
 	}
 
-	/* for the kernel space we'll just use the same page tables */
-	for(i=kstart_dirent; i<1023; i++) {
-		ndir[i] = pgdir[i];
-	}
+	set_intr_state(intr_state);
 
-	/* also point the last page directory entry to the page directory address
-	 * since we're relying on recursive page tables
-	 */
-	paddr = virt_to_phys((uint32_t)ndir);
-	ndir[1023] = paddr | PG_PRESENT;
+	/* set the new page directory pointer table */
+	pdest->ctx.pgtbl_paddr = pdpt_paddr;
+}
 
-	if(cow) {
-		/* we just changed all the page protection bits, so we need to flush the TLB */
-		flush_tlb();
+/* create an empty address space for a new process, sharing only the kernel
+ * part of the page directories. Used by spawn, which doesn't need anything
+ * from the parent's address space.
+ */
+int create_vm(struct process *p)
+{
+	int i, kstart_dirent, intr_state;
+	uint32_t pdpt_paddr, dir_paddr;
+	pte_t *ndir = 0;
+
+	intr_state = get_intr_state();
+	disable_intr();
+
+	if(!(pdpt_paddr = alloc_pgdir(&dir_paddr))) {
+		set_intr_state(intr_state);
+		return -1;
 	}
 
-	/* unmap before freeing the virtual pages, to avoid deallocating the physical pages */
-	unmap_page(dirpg);
-	unmap_page(tblpg);
+	kstart_dirent = PAGE_TO_PGTBL(KMEM_START_PAGE);
+
+	/* keep the 2mb pages of the identity map, everything else in user space
+	 * starts out unmapped
+	 */
+	for(i=0; i<PGDIR_SELF; i++) {
+		if(i % PGTBL_ENTRIES == 0) {
+			ndir = kmap(ADDR_TO_PAGE(dir_paddr) + i / PGTBL_ENTRIES, KMAP_PGDIR);
+		}
+		if(i >= kstart_dirent || (pgdir[i] & PG_LARGE)) {
+			ndir[i % PGTBL_ENTRIES] = pgdir[i];
+		}
+	}
+	kunmap(KMAP_PGDIR);
 
-	pgfree(dirpg, 1);
-	pgfree(tblpg, 1);
+	set_intr_state(intr_state);
 
-	/* set the new page directory pointer */
-	pdest->ctx.pgtbl_paddr = paddr;
+	p->ctx.pgtbl_paddr = pdpt_paddr;
+	init_vmmap(&p->vmmap);
+	return 0;
 }
 
 /* cleanup_vm called by exit to clean up any memory used by the process */
 void cleanup_vm(struct process *p)
 {
-	struct rbnode *vmnode;
+	int i, j, nkeep, intr_state;
+	pte_t *pgtbl;
 
-	/* go through the vm map and reduce refcounts all around
-	 * when a ref goes to 0, free the physical page
-	 */
-	rb_begin(&p->vmmap);
-	while((vmnode = rb_next(&p->vmmap))) {
-		struct vm_page *page = vmnode->data;
+	intr_state = get_intr_state();
+	disable_intr();
 
-		/* skip kernel pages obviously */
-		if(!(page->flags & PG_USER)) {
+	for(i=0; i<PAGE_TO_PGTBL(KMEM_START_PAGE); i++) {
+		if(!(pgdir[i] & PG_PRESENT) || (pgdir[i] & PG_LARGE)) {
 			continue;
 		}
+		/* tables still shared with other processes are left to them */
+		if(PGTBL_SHARED(pgdir[i])) {
+			if(unref_pgtbl(PTE_PAGE(pgdir[i])) > 0) {
+				pgdir[i] = 0;
+				continue;
+			}
+			/* we were the last one, it's ours to write again */
+			pgdir[i] |= PG_WRITABLE;
+			flush_tlb_addr((uint32_t)PGTBL(i));
+		}
 
-		if(--page->nref <= 0) {
-			/* free the physical page if nref goes to 0 */
-			free_phys_page(PAGE_TO_ADDR(page->ppage));
+		/* drop the references to the user pages, freeing the ones which
+		 * aren't mapped by any other process
+		 */
+		pgtbl = PGTBL(i);
+		nkeep = 0;
+		for(j=0; j<PGTBL_ENTRIES; j++) {
+			if(!(pgtbl[j] & PG_PRESENT)) {
+				if(pgtbl[j] & PG_SWAPPED) {
+					swap_put(PTE_SWAP_SLOT(pgtbl[j]), p);
+					pgtbl[j] = 0;
+				}
+				continue;
+			}
+			if(pgtbl[j] & PG_USER) {
+				put_user_page(PTE_PAGE(pgtbl[j]));
+				pgtbl[j] = 0;
+			} else {
+				nkeep++;	/* identity map */
+			}
+		}
+		if(!nkeep) {
+			free_phys_page((uint32_t)(pgdir[i] & PGENT_ADDR_MASK));
+			pgdir[i] = 0;
 		}
 	}
+	flush_tlb();
+
+	set_intr_state(intr_state);
 
-	/* destroying the tree will free the nodes */
+	/* destroying the tree will free the vm_areas */
 	rb_destroy(&p->vmmap);
 }
 
-
 int get_page_bit(int pgnum, uint32_t bit, int wholepath)
 {
 	int tidx = PAGE_TO_PGTBL(pgnum);
 	int tent = PAGE_TO_PGTBL_PG(pgnum);
-	uint32_t *pgtbl = PGTBL(tidx);
+	pte_t *pgtbl = PGTBL(tidx);
 
 	if(wholepath) {
 		if((pgdir[tidx] & bit) == 0) {
@@ -855,7 +1987,7 @@ void set_page_bit(int pgnum, uint32_t bit, int wholepath)
 {
 	int tidx = PAGE_TO_PGTBL(pgnum);
 	int tent = PAGE_TO_PGTBL_PG(pgnum);
-	uint32_t *pgtbl = PGTBL(tidx);
+	pte_t *pgtbl = PGTBL(tidx);
 
 	if(wholepath) {
 		pgdir[tidx] |= bit;
@@ -869,44 +2001,52 @@ void clear_page_bit(int pgnum, uint32_t bit, int wholepath)
 {
 	int tidx = PAGE_TO_PGTBL(pgnum);
 	int tent = PAGE_TO_PGTBL_PG(pgnum);
-	uint32_t *pgtbl = PGTBL(tidx);
+	pte_t *pgtbl = PGTBL(tidx);
 
 	if(wholepath) {
-		pgdir[tidx] &= ~bit;
+		pgdir[tidx] &= ~(pte_t)bit;
 	}
 
-	pgtbl[tent] &= ~bit;
+	pgtbl[tent] &= ~(pte_t)bit;
 
 	flush_tlb_page(pgnum);
 }
 
 
 #define USER_PGDIR_ENTRIES	PAGE_TO_PGTBL(KMEM_START_PAGE)
+/* construct the vm_areas of the first process from the current page tables,
+ * one for each run of user pages with the same permissions
+ */
 int cons_vmmap(struct rbtree *vmmap)
 {
-	int i, j;
-
-	rb_init(vmmap, RB_KEY_INT);
+	int i, j, start = 0;
+	unsigned int attr, cur = 0;
+	pte_t *pgtbl;
 
-	for(i=0; i<USER_PGDIR_ENTRIES; i++) {
-		if(pgdir[i] & PG_PRESENT) {
-			/* page table is present, iterate through its 1024 pages */
-			uint32_t *pgtbl = PGTBL(i);
+	init_vmmap(vmmap);
 
-			for(j=0; j<1024; j++) {
-				if(pgtbl[j] & PG_PRESENT) {
-					struct vm_page *vmp;
+	/* one past the last user page table, to close the last run */
+	for(i=0; i<=USER_PGDIR_ENTRIES; i++) {
+		pgtbl = 0;
+		if(i < USER_PGDIR_ENTRIES && (pgdir[i] & PG_PRESENT) && !(pgdir[i] & PG_LARGE)) {
+			pgtbl = PGTBL(i);
+		}
 
-					if(!(vmp = malloc(sizeof *vmp))) {
-						panic("cons_vmap failed to allocate memory");
-					}
-					vmp->vpage = i * 1024 + j;
-					vmp->ppage = ADDR_TO_PAGE(pgtbl[j] & PGENT_ADDR_MASK);
-					vmp->flags = pgtbl[j] & ATTR_PGTBL_MASK;
-					vmp->nref = 1;	/* when first created assume no sharing */
+		for(j=0; j<PGTBL_ENTRIES; j++) {
+			attr = 0;
+			if(pgtbl && (pgtbl[j] & PG_PRESENT) && (pgtbl[j] & PG_USER)) {
+				attr = PTE_USER_ATTR(pgtbl[j]);
+			}
 
-					rb_inserti(vmmap, vmp->vpage, vmp);
+			if(attr != cur) {
+				if(cur && insert_vm_area(vmmap, start, i * PGTBL_ENTRIES + j, cur, VMA_MEM) == -1) {
+					panic("cons_vmap failed to allocate memory");
 				}
+				start = i * PGTBL_ENTRIES + j;
+				cur = attr;
+			}
+			if(!pgtbl && !cur) {
+				break;	/* nothing else in this 2mb */
 			}
 		}
 	}
@@ -914,50 +2054,73 @@ int cons_vmmap(struct rbtree *vmmap)
 	return 0;
 }
 
-struct vm_page *get_vm_page(int vpg)
-{
-	return get_vm_page_proc(get_current_proc(), vpg);
-}
-
-struct vm_page *get_vm_page_proc(struct process *p, int vpg)
-{
-	struct rbnode *node;
-
-	if(!p || !(node = rb_findi(&p->vmmap, vpg))) {
-		return 0;
-	}
-	return node->data;
-}
-
-
 void dbg_print_vm(int area)
 {
+	int last, intr_state, largest = 0;
 	struct page_range *node;
-	int last, intr_state;
+	struct range_tree *tree = &pglist;
+	struct rbnode *vmnode;
+	struct vm_area *va;
+	struct process *p;
 
 	intr_state = get_intr_state();
 	disable_intr();
 
-	node = pglist[area];
-	last = area == MEM_USER ? 0 : ADDR_TO_PAGE(KMEM_START);
+	if(area == MEM_USER) {
+		/* user space is described by the areas of the current process */
+		printf("user vm space\n");
+		if((p = get_current_proc())) {
+			rb_begin(&p->vmmap);
+			while((vmnode = rb_next(&p->vmmap))) {
+				va = vmnode->data;
+				printf("  vm-area: %x -> %x (%s%s)\n", PAGE_TO_ADDR(va->start),
+						PAGE_TO_ADDR(va->end), va->flags & PG_WRITABLE ? "rw" : "ro",
+						va->type == VMA_ANON ? ", anon" : "");
+			}
+		}
+		set_intr_state(intr_state);
+		return;
+	}
 
-	printf("%s vm space\n", area == MEM_USER ? "user" : "kernel");
+	last = ADDR_TO_PAGE(KMEM_START);
 
-	while(node) {
-		if(node->start > last) {
-			printf("  vm-used: %x -> %x\n", PAGE_TO_ADDR(last), PAGE_TO_ADDR(node->start));
-		}
+	printf("kernel vm space\n");
+	print_ranges(tree->root[BY_ADDR], &last);
 
-		printf("  vm-free: %x -> ", PAGE_TO_ADDR(node->start));
-		if(node->end >= PAGE_COUNT) {
-			printf("END\n");
-		} else {
-			printf("%x\n", PAGE_TO_ADDR(node->end));
+	/* the largest free range is the rightmost node of the size tree */
+	if((node = tree->root[BY_SIZE])) {
+		while(node->link[BY_SIZE][1]) {
+			node = node->link[BY_SIZE][1];
 		}
-
-		last = node->end;
-		node = node->next;
+		largest = RANGE_SIZE(node);
 	}
 
+	/* fragmentation: how much of the free space isn't in the largest range */
+	printf("  %d free ranges, %d pages free, largest: %d pages, fragmentation: %d%%\n",
+			tree->nranges, tree->npages, largest,
+			tree->npages ? 100 - largest * 100 / tree->npages : 0);
+
 	set_intr_state(intr_state);
 }
+
+/* in-order traversal of the address tree, for dbg_print_vm */
+static void print_ranges(struct page_range *node, int *last)
+{
+	if(!node) return;
+
+	print_ranges(node->link[BY_ADDR][0], last);
+
+	if(node->start > *last) {
+		printf("  vm-used: %x -> %x\n", PAGE_TO_ADDR(*last), PAGE_TO_ADDR(node->start));
+	}
+
+	printf("  vm-free: %x -> ", PAGE_TO_ADDR(node->start));
+	if(node->end >= PAGE_COUNT) {
+		printf("END\n");
+	} else {
+		printf("%x\n", PAGE_TO_ADDR(node->end));
+	}
+	*last = node->end;
+
+	print_ranges(node->link[BY_ADDR][1], last);
+}
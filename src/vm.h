@@ -8,6 +8,13 @@
 #define KMEM_START		0xc0000000
 #define KMEM_START_PAGE	ADDR_TO_PAGE(KMEM_START)
 
+/* With PAE, page tables and page directories hold 512 64bit entries, and
+ * there are four page directories, one for each gigabyte of the address
+ * space, pointed to by the page directory pointer table in cr3. Physical
+ * addresses, and so page table entries, can be larger than 32 bits.
+ */
+typedef uint64_t pte_t;
+
 /* page mapping flags */
 #define PG_PRESENT			(1 << 0)
 #define PG_WRITABLE			(1 << 1)
@@ -19,6 +26,28 @@
 #define PG_TYPE				(1 << 7)
 /* PG_GLOBAL mappings won't flush from TLB */
 #define PG_GLOBAL			(1 << 8)
+/* in page directory entries, PG_TYPE maps a 2mb page instead of a page table */
+#define PG_LARGE			PG_TYPE
+/* available to the OS: not present user page, swapped out (see swap.c) */
+#define PG_SWAPPED			(1 << 9)
+/* mapping attribute for map_page & co: not executable. It's turned into
+ * PG_NX in the page table entry, if the processor supports it.
+ */
+#define PG_NOEXEC			(1 << 10)
+/* no instruction fetches from this page (only valid if NX is enabled) */
+#define PG_NX				((pte_t)1 << 63)
+
+/* page table entries of swapped out pages hold the swap slot in place of the
+ * physical page, and the permissions of the page
+ */
+#define PTE_SWAP_SLOT(ent)		((uint32_t)((ent) >> 12))
+#define MK_SWAP_PTE(slot, ent)	\
+	(((pte_t)(slot) << 12) | ((ent) & (PG_USER | PG_WRITABLE)) | \
+	 (((ent) & PG_NX) ? PG_NOEXEC : 0) | PG_SWAPPED)
+
+/* attributes of a present or swapped out user page, for mapping it again */
+#define PTE_USER_ATTR(ent)		\
+	(((ent) & (PG_USER | PG_WRITABLE | PG_NOEXEC)) | (((ent) & PG_NX) ? PG_NOEXEC : 0))
 
 
 #define PGSIZE					4096
@@ -26,17 +55,31 @@
 
 #define PGOFFS_MASK				0xfff
 #define PGNUM_MASK				0xfffff000
-#define PGENT_ADDR_MASK			PGNUM_MASK
+#define PGENT_ADDR_MASK			0x000ffffffffff000ULL
 
 #define ADDR_TO_PAGE(x)			((uint32_t)(x) >> 12)
 #define PAGE_TO_ADDR(x)			((uint32_t)(x) << 12)
 
-#define ADDR_TO_PGTBL(x)		((uint32_t)(x) >> 22)
-#define ADDR_TO_PGTBL_PG(x)		(((uint32_t)(x) >> 12) & 0x3ff)
+/* physical page of a page table entry, and the entry mapping a physical page */
+#define PTE_PAGE(ent)			((int)(((ent) & PGENT_ADDR_MASK) >> 12))
+#define MK_PTE(pg, attr)		(((pte_t)(pg) << 12) | (attr))
+
+/* entries per page table, and page directory entries in all four
+ * directories. The page directory index of a page (PAGE_TO_PGTBL) is an
+ * index into all four of them as a single array.
+ */
+#define PGTBL_ENTRIES			512
+#define PGDIR_ENTRIES			2048
+
+#define ADDR_TO_PGTBL(x)		((uint32_t)(x) >> 21)
+#define ADDR_TO_PGTBL_PG(x)		(((uint32_t)(x) >> 12) & 0x1ff)
 #define ADDR_TO_PGOFFS(x)		((uint32_t)(x) & PGOFFS_MASK)
 
-#define PAGE_TO_PGTBL(x)		((uint32_t)(x) >> 10)
-#define PAGE_TO_PGTBL_PG(x)		((uint32_t)(x) & 0x3ff)
+#define PAGE_TO_PGTBL(x)		((uint32_t)(x) >> 9)
+#define PAGE_TO_PGTBL_PG(x)		((uint32_t)(x) & 0x1ff)
+
+#define LARGE_PGSIZE			(4096 * 512)
+#define LARGE_PGADDR_MASK		0xffe00000
 
 /* argument to clone_vm */
 #define CLONE_SHARED	0
@@ -46,13 +89,27 @@
 #define PAGE_ONLY		0
 #define WHOLE_PATH		1
 
-struct vm_page {
-	int vpage, ppage;
-	unsigned int flags;
+/* vm_area types */
+enum {
+	VMA_MEM,	/* populated when it's created (process image) */
+	VMA_ANON	/* demand-zero, pages are allocated when first touched */
+};
 
-	int nref;
+/* A range of the user address space of a process, with its permissions and
+ * backing type. The areas of a process are kept sorted and non-overlapping in
+ * its vmmap tree. Which pages are actually mapped is only recorded in the page
+ * tables, and the sharing of physical pages after fork in their reference
+ * counts in the frame database (see struct page in mem.h).
+ */
+struct vm_area {
+	int start, end;		/* virtual pages [start, end) */
+	unsigned int flags;	/* PG_USER, PG_WRITABLE if it's writable, PG_NOEXEC */
+	int type;
 };
 
+/* attributes of the user stack */
+#define USTACK_ATTR		(PG_USER | PG_WRITABLE | PG_NOEXEC)
+
 struct process;
 
 void init_vm(void);
@@ -63,12 +120,35 @@ int map_page_range(int vpg_start, int pgcount, int ppg_start, unsigned int attr)
 int unmap_page_range(int vpg_start, int pgcount);
 int map_mem_range(uint32_t vaddr, size_t sz, uint32_t paddr, unsigned int attr);
 
-uint32_t virt_to_phys(uint32_t vaddr);
+uint64_t virt_to_phys(uint32_t vaddr);
 int virt_to_phys_page(int vpg);
 
-uint32_t virt_to_phys_proc(struct process *p, uint32_t vaddr);
+void zero_phys_page(uint32_t paddr);
+
+uint64_t virt_to_phys_proc(struct process *p, uint32_t vaddr);
 int virt_to_phys_page_proc(struct process *p, int vpg);
 
+pte_t *map_pte(uint32_t pgdir_addr, int vpg);
+void unmap_pte(pte_t *pte);
+int pgtbl_page(uint32_t pgdir_addr, int vpg);
+
+/* fixed kernel virtual pages for temporary mappings of physical pages, one
+ * for each use, so that nested users (like zero_phys_page called while
+ * clone_vm is filling in a page table) never clobber each other's mapping.
+ */
+enum {
+	KMAP_TMP,		/* zero_phys_page, split_large, unshare_pgtbl */
+	KMAP_PTE,		/* page tables of other processes (map_pte & co) */
+	KMAP_COPY,		/* destination of copy_on_write */
+	KMAP_PGDIR,		/* page directory being built by clone_vm/create_vm */
+	KMAP_PGTBL,		/* page table being copied by clone_vm */
+
+	KMAP_NUM_SLOTS
+};
+
+void *kmap(int ppg, int slot);
+void kunmap(int slot);
+
 enum {
 	MEM_KERNEL,
 	MEM_USER
@@ -76,6 +156,8 @@ enum {
 
 int pgalloc(int num, int area);
 int pgalloc_vrange(int start, int num);
+int pgreserve(int num, int area);
+int pgreserve_vrange(int start, int num);
 void pgfree(int start, int num);
 
 /* don't be fooled by the fact these two accept process arguments
@@ -84,6 +166,9 @@ void pgfree(int start, int num);
 void clone_vm(struct process *pdest, struct process *psrc, int cow);
 void cleanup_vm(struct process *p);
 
+/* empty user address space for a new process */
+int create_vm(struct process *p);
+
 int get_page_bit(int pgnum, uint32_t bit, int wholepath);
 void set_page_bit(int pgnum, uint32_t bit, int wholepath);
 void clear_page_bit(int pgnum, uint32_t bit, int wholepath);
@@ -91,13 +176,26 @@ void clear_page_bit(int pgnum, uint32_t bit, int wholepath);
 /* construct the vm map for the current user mappings */
 int cons_vmmap(struct rbtree *vmmap);
 
-struct vm_page *get_vm_page(int vpg);
-struct vm_page *get_vm_page_proc(struct process *p, int vpg);
+int add_vm_area(struct process *p, int start, int end, unsigned int flags, int type);
+void rm_vm_area(struct process *p, struct vm_area *va);
+struct vm_area *find_vm_area(struct process *p, int vpg);
+struct vm_area *find_vm_overlap(struct process *p, int start, int end);
+int find_vm_gap(struct process *p, int num, int top);
+int check_user_range(struct process *p, uint32_t addr, int size);
+
+/* memory syscalls (vm_sys.c) */
+int sys_brk(void *addr);
+int sys_sbrk(int incr);
+int sys_mmap(void *addr, int len, int prot, int flags);
+int sys_munmap(void *addr, int len);
 
 void dbg_print_vm(int area);
 
 /* defined in vm-asm.S */
 void set_pgdir_addr(uint32_t addr);
 uint32_t get_pgdir_addr(void);
+void flush_tlb(void);
+void flush_tlb_addr(uint32_t addr);
+#define flush_tlb_page(p)	flush_tlb_addr(PAGE_TO_ADDR(p))
 
 #endif	/* VM_H_ */
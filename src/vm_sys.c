@@ -0,0 +1,178 @@
+/* implementation of the memory-related syscalls.
+ *
+ * Heap and anonymous mmap memory is only reserved here, physical pages are
+ * allocated by the page fault handler when each page is first touched (see
+ * demand_zero in vm.c).
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "vm.h"
+#include "proc.h"
+
+static int set_brk(struct process *p, uint32_t end);
+static int len_to_pages(int len);
+
+
+int sys_brk(void *addr)
+{
+	return set_brk(get_current_proc(), (uint32_t)addr);
+}
+
+/* returns the previous break */
+int sys_sbrk(int incr)
+{
+	int res;
+	uint32_t prev;
+	struct process *p = get_current_proc();
+
+	prev = p->heap_end;
+	if((res = set_brk(p, prev + incr)) < 0) {
+		return res;
+	}
+	return (int)prev;
+}
+
+/* only private anonymous mappings are supported. With MAP_FIXED, addr must
+ * be a page-aligned address in a free part of the user address space, any
+ * existing mappings aren't replaced.
+ */
+int sys_mmap(void *addr, int len, int prot, int flags)
+{
+	int start, num;
+	unsigned int attr;
+	struct process *p = get_current_proc();
+
+	if(!(flags & MAP_ANONYMOUS) || (flags & MAP_SHARED) || (num = len_to_pages(len)) <= 0) {
+		return -EINVAL;
+	}
+	if(num > KMEM_START_PAGE) {
+		return -ENOMEM;
+	}
+
+	if(flags & MAP_FIXED) {
+		/* the whole range must be in user space */
+		if(ADDR_TO_PGOFFS(addr) || (uint32_t)addr >= KMEM_START ||
+				num > KMEM_START_PAGE - ADDR_TO_PAGE(addr)) {
+			return -EINVAL;
+		}
+		start = pgreserve_vrange(ADDR_TO_PAGE(addr), num);
+	} else {
+		/* from the top down, away from the heap */
+		start = find_vm_gap(p, num, 1);
+	}
+	if(start == -1) {
+		return -ENOMEM;
+	}
+
+	attr = PG_USER;
+	if(prot & PROT_WRITE) attr |= PG_WRITABLE;
+	if(!(prot & PROT_EXEC)) attr |= PG_NOEXEC;
+
+	if(add_vm_area(p, start, start + num, attr, VMA_ANON) == -1) {
+		pgfree(start, num);
+		return -ENOMEM;
+	}
+	return PAGE_TO_ADDR(start);
+}
+
+/* unmap any part of the areas in the range, splitting them if necessary.
+ * Pages not belonging to an area are ignored, and the heap can only be
+ * shrunk with brk.
+ */
+int sys_munmap(void *addr, int len)
+{
+	int start, end, num, rmstart, rmend, hstart, hend;
+	struct vm_area *va;
+	struct process *p = get_current_proc();
+
+	if(ADDR_TO_PGOFFS(addr) || (num = len_to_pages(len)) <= 0 || (uint32_t)addr >= KMEM_START ||
+			num > KMEM_START_PAGE - ADDR_TO_PAGE(addr)) {
+		return -EINVAL;
+	}
+	start = ADDR_TO_PAGE(addr);
+	end = start + num;
+
+	hstart = ADDR_TO_PAGE(p->heap_start);
+	hend = ADDR_TO_PAGE(p->heap_end + PGSIZE - 1);
+	if(start < hend && end > hstart) {
+		return -EINVAL;
+	}
+
+	while(start < end && (va = find_vm_overlap(p, start, end))) {
+		rmstart = start > va->start ? start : va->start;
+		rmend = end < va->end ? end : va->end;
+
+		if(rmstart > va->start && rmend < va->end) {
+			/* a hole in the middle, the rest becomes a new area */
+			int end_pg = va->end;
+			va->end = rmstart;
+			if(add_vm_area(p, rmend, end_pg, va->flags, va->type) == -1) {
+				va->end = end_pg;
+				return -ENOMEM;
+			}
+		} else if(rmstart > va->start) {
+			va->end = rmstart;
+		} else if(rmend < va->end) {
+			va->start = rmend;
+		} else {
+			/* the whole area goes away */
+			rm_vm_area(p, va);
+		}
+
+		pgfree(rmstart, rmend - rmstart);
+		start = rmend;
+	}
+	return 0;
+}
+
+/* move the break to end, reserving more pages or unmapping the ones past the
+ * new break
+ */
+static int set_brk(struct process *p, uint32_t end)
+{
+	int pgend, new_pgend;
+	struct vm_area *va;
+
+	if(end < p->heap_start || end > KMEM_START) {
+		return -EINVAL;
+	}
+	pgend = ADDR_TO_PAGE(p->heap_end + PGSIZE - 1);
+	new_pgend = ADDR_TO_PAGE(end + PGSIZE - 1);
+
+	/* the heap area starts at the first page of the heap */
+	va = pgend > ADDR_TO_PAGE(p->heap_start) ? find_vm_area(p, pgend - 1) : 0;
+
+	if(new_pgend > pgend) {
+		if(pgreserve_vrange(pgend, new_pgend - pgend) == -1) {
+			return -ENOMEM;
+		}
+		if(va) {
+			va->end = new_pgend;
+		} else if(add_vm_area(p, pgend, new_pgend, PG_USER | PG_WRITABLE | PG_NOEXEC, VMA_ANON) == -1) {
+			pgfree(pgend, new_pgend - pgend);
+			return -ENOMEM;
+		}
+	} else if(new_pgend < pgend) {
+		if(new_pgend <= va->start) {
+			rm_vm_area(p, va);
+		} else {
+			va->end = new_pgend;
+		}
+		pgfree(new_pgend, pgend - new_pgend);
+	}
+
+	p->heap_end = end;
+	return 0;
+}
+
+/* number of pages needed for len bytes, or -1 if len isn't positive. It's
+ * rounded up in unsigned arithmetic, so that it can't overflow.
+ */
+static int len_to_pages(int len)
+{
+	if(len <= 0) {
+		return -1;
+	}
+	return ADDR_TO_PAGE((uint32_t)len + PGSIZE - 1);
+}